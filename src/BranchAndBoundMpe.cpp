@@ -0,0 +1,268 @@
+/*
+* Copyright (C) 2017 Boris Altshul.
+* All rights reserved.
+*
+* The software in this package is published under the terms of the BSD
+* style license a copy of which has been included with this distribution in
+* the LICENSE.txt file.
+*/
+
+#include "factor.h"
+#include "json/json.h"
+#include <cmath>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+
+using namespace bayeslib;
+
+/// Messages are rounded to ValueType, bounds within this log distance of best are explored
+static const double kLogTolerance = 1e-5;
+
+BranchAndBoundMpe::BranchAndBoundMpe(FactorSet &fs, int nIBound, ElimHeuristic heuristic) :
+   mDb(fs.GetDb()), mVarSet(fs.GetDb()), mLogConst(0), mLogRootBound(0), mMaxMessageSize(0),
+   mStarted(false), mDone(false), mLogBest(-std::numeric_limits<double>::infinity()), mNodes(0)
+{
+   // variables without edges are not in elimination order, they are eliminated last
+   VarSet vsAll = *fs.GetVarSet();
+   VarSet vsElim(mDb);
+   VarSet vsElimOrder = InteractionGraph(&fs).GetElimOrder(heuristic);
+   for (VarId id = vsElimOrder.GetFirst(); id != 0; id = vsElimOrder.GetNext(id))
+   {
+      if (vsAll.HasVar(id))
+         vsElim.Add(id);
+   }
+   vsElim.Add(vsAll);
+
+   // search assigns first the variable eliminated last
+   for (VarId id = vsElim.GetFirst(); id != 0; id = vsElim.GetNext(id))
+      mOrder.insert(mOrder.begin(), id);
+   std::map<VarId, int> depthOf;
+   for (size_t n = 0; n < mOrder.size(); n++)
+   {
+      mVarSet.Add(mOrder[n]);
+      depthOf[mOrder[n]] = (int) n;
+   }
+   int nDepth = (int) mOrder.size();
+   mFunctionsAt.resize(nDepth);
+   mMessagesAt.resize(nDepth);
+   mStates.assign(mDb.GetVarSet().GetSize() + 1, 0);
+
+   auto placeOf = [&depthOf](const VarSet &vs)
+   {
+      int place = -1;
+      for (VarId id = vs.GetFirst(); id != 0; id = vs.GetNext(id))
+         place = std::max(place, depthOf[id]);
+      return place;
+   };
+
+   std::vector<std::vector<std::shared_ptr<Factor> > > buckets(nDepth);
+   for (auto &f : fs.GetFactors())
+   {
+      Function fn;
+      fn.mFactor = f;
+      fn.mPlace = placeOf(f->GetVarSet());
+      if (fn.mPlace < 0)
+      {
+         mLogConst += LogValue(fn);
+         continue;
+      }
+      mFunctionsAt[fn.mPlace].push_back((int) mFunctions.size());
+      mFunctions.push_back(fn);
+      buckets[fn.mPlace].push_back(f);
+   }
+   mLogRootBound = mLogConst;
+
+   // mini-bucket elimination, largest scopes are placed first
+   for (int d = nDepth - 1; d >= 0; d--)
+   {
+      VarSet vsVar(mDb, mOrder[d]);
+      std::vector<std::shared_ptr<Factor> > &bucket = buckets[d];
+      std::stable_sort(bucket.begin(), bucket.end(),
+         [](const std::shared_ptr<Factor> &f1, const std::shared_ptr<Factor> &f2)
+         { return f1->GetVarSet().GetSize() > f2->GetVarSet().GetSize(); });
+
+      std::vector<std::vector<std::shared_ptr<Factor> > > minis;
+      std::vector<VarSet> scopes;
+      for (auto &f : bucket)
+      {
+         size_t m = 0;
+         for (; m < minis.size(); m++)
+         {
+            VarSet vs = scopes[m];
+            vs.Add(f->GetVarSet());
+            if ((int) vs.GetSize() <= nIBound + 1)
+               break;
+         }
+         if (m == minis.size())
+         {
+            minis.push_back(std::vector<std::shared_ptr<Factor> >());
+            scopes.push_back(VarSet(mDb));
+         }
+         minis[m].push_back(f);
+         scopes[m].Add(f->GetVarSet());
+      }
+
+      // message bounds the bucket while its variable is not assigned
+      for (auto &mini : minis)
+      {
+         FactorContraction contraction(mini, vsVar);
+         std::vector<VarState> argMax;
+         Function fn;
+         fn.mFactor = contraction.CreateResult();
+         contraction.Max(*fn.mFactor, argMax);
+         fn.mPlace = placeOf(fn.mFactor->GetVarSet());
+         mMaxMessageSize = std::max(mMaxMessageSize, (int) fn.mFactor->GetVarSet().GetSize());
+
+         int nMessage = (int) mMessages.size();
+         mMessages.push_back(fn);
+         if (fn.mPlace < 0)
+            mLogRootBound += LogValue(fn);
+         else
+            buckets[fn.mPlace].push_back(fn.mFactor);
+         for (int p = std::max(fn.mPlace, 0); p < d; p++)
+            mMessagesAt[p].push_back(nMessage);
+      }
+   }
+}
+
+double
+BranchAndBoundMpe::LogValue(const Function &fn) const
+{
+   const VarSet &vs = fn.mFactor->GetVarSet();
+   InstanceId row = 0;
+   for (VarId id = vs.GetFirst(); id != 0; id = vs.GetNext(id))
+      row += vs.GetInstanceComponent(id, mStates[id]);
+   ValueType v = fn.mFactor->Get(row);
+   return v > 0 ? std::log((double) v) : -std::numeric_limits<double>::infinity();
+}
+
+void
+BranchAndBoundMpe::Expand(int depth, double logG)
+{
+   VarId id = mOrder[depth];
+   Level level;
+   level.mLogG = logG;
+   level.mNext = 0;
+
+   int nStates = (int) mDb.GetDomainSize(id);
+   for (int state = 0; state < nStates; state++)
+   {
+      mStates[id] = (VarState) state;
+      double logF = logG;
+      for (int n : mFunctionsAt[depth])
+         logF += LogValue(mFunctions[n]);
+      for (int n : mMessagesAt[depth])
+         logF += LogValue(mMessages[n]);
+      if (logF > mLogBest - kLogTolerance)
+         level.mChildren.push_back(std::make_pair(logF, (VarState) state));
+   }
+   std::stable_sort(level.mChildren.begin(), level.mChildren.end(),
+      [](const std::pair<double, VarState> &c1, const std::pair<double, VarState> &c2)
+      { return c1.first > c2.first; });
+   mStack.push_back(level);
+}
+
+bool
+BranchAndBoundMpe::Run(double seconds)
+{
+   auto start = std::chrono::steady_clock::now();
+   int nDepth = (int) mOrder.size();
+   if (!mStarted)
+   {
+      mStarted = true;
+      if (nDepth == 0)
+         mLogBest = mLogConst;
+      else
+         Expand(0, mLogConst);
+   }
+
+   while (!mStack.empty())
+   {
+      if ((++mNodes & 255) == 0 && seconds >= 0)
+      {
+         std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+         if (elapsed.count() > seconds)
+            return false;
+      }
+
+      // children are sorted by bound, the first one that can not win closes the level
+      int depth = (int) mStack.size() - 1;
+      Level &level = mStack.back();
+      if (level.mNext >= level.mChildren.size() ||
+         level.mChildren[level.mNext].first <= mLogBest - kLogTolerance)
+      {
+         mStack.pop_back();
+         continue;
+      }
+      VarState state = level.mChildren[level.mNext++].second;
+      VarId id = mOrder[depth];
+      mStates[id] = state;
+      double logG = level.mLogG;
+      for (int n : mFunctionsAt[depth])
+         logG += LogValue(mFunctions[n]);
+
+      if (depth + 1 < nDepth)
+      {
+         Expand(depth + 1, logG);
+      }
+      else if (logG > mLogBest)
+      {
+         mLogBest = logG;
+         mBestStates = mStates;
+      }
+   }
+   mDone = true;
+   return true;
+}
+
+ValueType
+BranchAndBoundMpe::GetBestValue() const
+{
+   return (ValueType) std::exp(mLogBest);
+}
+
+Clause
+BranchAndBoundMpe::GetBestClause() const
+{
+   Clause res(mVarSet);
+   if (mBestStates.empty())
+      return res;
+   for (VarId id = mVarSet.GetFirst(); id != 0; id = mVarSet.GetNext(id))
+      res.SetVar(id, mBestStates[id]);
+   return res;
+}
+
+ValueType
+BranchAndBoundMpe::GetUpperBound() const
+{
+   return (ValueType) std::exp(mDone ? mLogBest : mLogRootBound);
+}
+
+double
+BranchAndBoundMpe::GetLogGap() const
+{
+   if (mDone)
+      return 0;
+   return mLogRootBound - mLogBest;
+}
+
+std::string
+BranchAndBoundMpe::GetJson(const VarDb &db) const
+{
+   char sz[200];
+   std::string s;
+   s = "{order:";
+   s += mVarSet.GetJson(db);
+   snprintf(sz, sizeof(sz), ",messages:%d,maxMessageVars:%d,nodes:%llu,best:%g,upper:%g,done:%s}",
+      (int) mMessages.size(), mMaxMessageSize, (unsigned long long) mNodes,
+      (double) GetBestValue(), (double) GetUpperBound(), mDone ? "true" : "false");
+   s += sz;
+   return s;
+}
+
+std::string
+BranchAndBoundMpe::GetType() const
+{
+   return "BranchAndBoundMpe";
+}
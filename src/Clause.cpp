@@ -30,67 +30,84 @@ bool ValToBool(const Json::Value &v)
 }
 
 Clause::Clause(const VarDb &db) :
-   mInstanceId(0), mVarSet(db)
+   mInstanceId(0), mpVarSet(std::make_shared<const VarSet>(db))
 {
-   mClause.fill(0);
+   _InitStates();
 }
 
 
 Clause::Clause(const VarSet &vs) :
-   mInstanceId(0), mVarSet(vs)
+   mInstanceId(0), mpVarSet(std::make_shared<const VarSet>(vs))
 {
-   mClause.fill(0);
+   _InitStates();
+}
+
+Clause::Clause(std::shared_ptr<const VarSet> pVs, InstanceId iid) :
+   mInstanceId(iid), mpVarSet(pVs)
+{
+   _InitStates();
+   if (iid)
+      UpdateClause();
 }
 
 Clause::Clause(const VarSet &vs, Json::Value &v) :
-   mInstanceId(0), mVarSet(vs)
+   mInstanceId(0), mpVarSet(std::make_shared<const VarSet>(vs))
 {
-   mClause.fill(0);
+   _InitStates();
+   const VarSet &varSet = *mpVarSet;
+   VarState *pStates = _States();
    Json::ArrayIndex i = 0;
-   for(VarId id = mVarSet.GetFirst();
+   for(VarId id = varSet.GetFirst();
       id != 0;
-      (id=mVarSet.GetNext(id)), ++i)   
+      (id=varSet.GetNext(id)), ++i)   
    {
       
       if(i < v.size())
       {
-         VarState vs = mVarSet.GetDb().JsonValToState(id, v[i]);
-         mClause[id] = vs;
-         if(vs)
-            mInstanceId += (InstanceId) vs  * mVarSet.GetInstanceComponent(id, vs);
+         VarState vs = varSet.GetDb().JsonValToState(id, v[i]);
+         pStates[i] = vs;
+         mInstanceId += varSet.GetInstanceComponentByOffs(i, vs);
       }
    }
 }
 
 Clause::Clause(const VarDb &db, std::initializer_list<ClauseInitializer> initlist) :
-   mInstanceId(0), mVarSet(db)
+   mInstanceId(0), mpVarSet(std::make_shared<const VarSet>(db))
 {
-   mClause.fill(0);
+   _InitStates();
    for (auto iter = initlist.begin(); iter != initlist.end(); ++iter)
    {
       AddVar(iter->varid, iter->nState);
    }
 }
 
+void
+Clause::_InitStates()
+{
+   mInline.fill(0);
+   mHeapStates.clear();
+   if (mpVarSet->GetSize() > INLINE_STATES)
+      mHeapStates.assign(mpVarSet->GetSize(), 0);
+}
+
 
 void 
 Clause::SetVar(VarId id, VarState val)
 {
    assert(id>0);
-   VarState curVal = mClause[id];
-   int nOffs = mVarSet.GetOffs(id);
+   int nOffs = mpVarSet->GetOffs(id);
 
    assert(nOffs >= 0);
    if( nOffs < 0)
       return;
 
+   VarState &curVal = _States()[nOffs];
    if(curVal != val)
    {
-      InstanceId oldInstanceComponent = mVarSet.GetInstanceComponent(id, curVal);
-      InstanceId newInstanceComponent = mVarSet.GetInstanceComponent(id, val);
-      mInstanceId -= oldInstanceComponent;
-      mInstanceId += newInstanceComponent;
-      mClause[id] = val;
+      InstanceId multiplier = mpVarSet->_GetByOffset(nOffs).mMultiplier;
+      mInstanceId -= multiplier * curVal;
+      mInstanceId += multiplier * val;
+      curVal = val;
    }
 
 }
@@ -99,11 +116,17 @@ Clause::SetVar(VarId id, VarState val)
 void
 Clause::AddVar(VarId id, VarState val)
 {
-   int nOffs = mVarSet.GetOffs(id);
+   int nOffs = mpVarSet->GetOffs(id);
    if (nOffs < 0)
    {
-      mVarSet.Add(id);
-      nOffs = mVarSet.GetOffs(id);
+      // VarSet is shared, extend a copy. New variable is appended with the
+      // highest multiplier so InstanceId and states of other variables are kept
+      std::shared_ptr<VarSet> pVs = std::make_shared<VarSet>(*mpVarSet);
+      pVs->Add(id);
+      std::vector<VarState> states(_States(), _States() + mpVarSet->GetSize());
+      mpVarSet = pVs;
+      _InitStates();
+      std::copy(states.begin(), states.end(), _States());
    }
 
    SetVar(id, val);
@@ -114,85 +137,98 @@ Clause::AddVar(VarId id, VarState val)
 VarState
 Clause::GetVar(VarId id) const
 {
-   return mClause[id];
+   int nOffs = mpVarSet->GetOffs(id);
+   if (nOffs < 0)
+      return 0;
+   return _States()[nOffs];
 }
 
 InstanceId 
 Clause::GetInstanceId(const VarSet &another) const
 {
    // correlate this varset with another
-	Clause cl(another);
-	for (VarId id = mVarSet.GetFirst();
-		id != 0;
-		id = mVarSet.GetNext(id))
-	{
-		if(another.HasVar(id))
-			cl.SetVar(id, mClause[id]);
-	}
-	return cl.GetInstanceId();
+   InstanceId res = 0;
+   const VarState *pStates = _States();
+   const VarSet::VarOperator *pOps = mpVarSet->_Ops();
+   for (unsigned int n = 0; n < mpVarSet->GetSize(); n++)
+   {
+      res += another.GetInstanceComponent(pOps[n].mId, pStates[n]);
+   }
+	return res;
 }
 
 
 bool
 Clause::Incr()
 {
-
-
-   bool bRes = false;
-   InstanceId idMax = mVarSet.GetInstances();
-   InstanceId tmpId = mInstanceId + 1;
-   if (tmpId >= idMax)
+   // odometer, first variable in VarSet is the least significant digit
+   VarState *pStates = _States();
+   const VarSet::VarOperator *pOps = mpVarSet->_Ops();
+   unsigned int nSize = mpVarSet->GetSize();
+   for (unsigned int n = 0; n < nSize; n++)
    {
-      tmpId = 0;
-      bRes = true;
+      if (++pStates[n] < pOps[n].mSize)
+      {
+         mInstanceId += pOps[n].mMultiplier;
+         return false;
+      }
+      mInstanceId -= pOps[n].mMultiplier * (pOps[n].mSize - 1);
+      pStates[n] = 0;
    }
-   mInstanceId = tmpId;
-   UpdateClause();
-   return bRes;
+   return true;
 }
 
 bool 
 Clause::Decr()
 {
-   bool bRes = false;
-   InstanceId idMax = mVarSet.GetInstances();
-   InstanceId tmpId = mInstanceId -1;
-   if (mInstanceId == 0)
+   VarState *pStates = _States();
+   const VarSet::VarOperator *pOps = mpVarSet->_Ops();
+   unsigned int nSize = mpVarSet->GetSize();
+   for (unsigned int n = 0; n < nSize; n++)
    {
-      tmpId = idMax-1;
-      bRes = true;
+      if (pStates[n] > 0)
+      {
+         pStates[n]--;
+         mInstanceId -= pOps[n].mMultiplier;
+         return false;
+      }
+      pStates[n] = (VarState) (pOps[n].mSize - 1);
+      mInstanceId += pOps[n].mMultiplier * (pOps[n].mSize - 1);
    }
-   mInstanceId = tmpId;
-   UpdateClause();
-   return bRes;
+   return true;
 
 }
 
 void 
 Clause::UpdateClause()
 {
-   mClause = mVarSet.ConvertVarArray(mInstanceId);
+   VarState *pStates = _States();
+   for (unsigned int n = 0; n < mpVarSet->GetSize(); n++)
+   {
+      pStates[n] = mpVarSet->FetchVarStateByOffs(n, mInstanceId);
+   }
 }
 
 
-Clause::Clause(const VarSet &vs, const std::array<VarState ,MAX_SET_SIZE> &clause) :
-      mInstanceId(0), mVarSet(vs) 
+Clause::Clause(const VarSet &vs, const std::vector<VarState> &clause) :
+      mInstanceId(0), mpVarSet(std::make_shared<const VarSet>(vs)) 
 {
-   int i=0;
-   for(VarId id = mVarSet.GetFirst();
-      id != 0;
-      id = mVarSet.GetNext(id), i++)   
+   _InitStates();
+   VarState *pStates = _States();
+   const VarSet::VarOperator *pOps = mpVarSet->_Ops();
+   for (unsigned int n = 0; n < mpVarSet->GetSize(); n++)
    {
-      VarState v = clause[id];
-      mClause[id] = v ;
-      mInstanceId += mVarSet.GetInstanceComponent(id, v);
+      VarState v = pOps[n].mId < clause.size() ? clause[pOps[n].mId] : 0;
+      pStates[n] = v;
+      mInstanceId += pOps[n].mMultiplier * v;
    }
 }
 
 
 Clause::Clause(const VarSet &vs, InstanceId iid) :      
-       mInstanceId(iid), mVarSet(vs)
+       mInstanceId(iid), mpVarSet(std::make_shared<const VarSet>(vs))
 {
+   _InitStates();
    UpdateClause();
 }
 
@@ -207,10 +243,11 @@ Clause::GetJson(const VarDb &db)const
 {
    std::string s;
    s = "{ ";
-   for (VarId id=mVarSet.GetFirst(); id != 0; id = mVarSet.GetNext(id))     
+   const VarSet &varSet = *mpVarSet;
+   for (VarId id=varSet.GetFirst(); id != 0; id = varSet.GetNext(id))     
    {
       char sz[100];
-      s += AddJsonAttr(sz, sizeof(sz), db[id].c_str(), "%d", (int) mClause[id]);
+      s += AddJsonAttr(sz, sizeof(sz), db[id].c_str(), "%d", (int) GetVar(id));
 
    }
    s.erase(s.length() - 1);
@@ -219,7 +256,7 @@ Clause::GetJson(const VarDb &db)const
 }
 
 Clause 
-Clause::Append(VarSet target, const Clause &cl1, const Clause &cl2)
+Clause::Append(const VarSet &target, const Clause &cl1, const Clause &cl2)
 {
    Clause res(target);
    const VarSet &vs1 = cl1.GetVarSet();
@@ -239,5 +276,3 @@ Clause::Append(VarSet target, const Clause &cl1, const Clause &cl2)
    }
    return res;
 }
-
-
@@ -0,0 +1,259 @@
+/*
+* Copyright (C) 2017 Boris Altshul.
+* All rights reserved.
+*
+* The software in this package is published under the terms of the BSD
+* style license a copy of which has been included with this distribution in
+* the LICENSE.txt file.
+*/
+
+#include "Factories.h"
+#include "json/json.h"
+#include <map>
+#include <algorithm>
+
+using namespace bayeslib;
+
+CompiledQuery::CompiledQuery(FactorSet &fs, const VarSet &vsQuery, const VarSet &vsEvidence,
+   QueryOp op) : mVQuery(vsQuery), mVEvidence(vsEvidence), mOp(op)
+{
+   const VarDb &db = fs.GetDb();
+
+   // barren nodes do not depend on evidence values, prune them once
+   FactorSet fsPruned = fs;
+   fsPruned.PruneVars(vsQuery.Disjuction(vsEvidence));
+
+   std::map<VarId, std::shared_ptr<Factor> > indicators;
+   for (VarId id = vsEvidence.GetFirst(); id != 0; id = vsEvidence.GetNext(id))
+   {
+      std::shared_ptr<Factor> f = std::make_shared<Factor>(VarSet(db, id));
+      mIndicators.push_back(f);
+      indicators[id] = f;
+   }
+
+   // model Factors with evidence variables are sliced by indicators
+   std::list<std::shared_ptr<Factor> > live;
+   for (auto &f : fsPruned.GetFactors())
+   {
+      VarSet vsApply = f->GetVarSet().Conjuction(vsEvidence);
+      if (vsApply.IsEmpty())
+      {
+         live.push_back(f);
+         continue;
+      }
+      std::vector<std::shared_ptr<Factor> > inputs = { f };
+      for (VarId id = vsApply.GetFirst(); id != 0; id = vsApply.GetNext(id))
+         inputs.push_back(indicators[id]);
+      live.push_back(AddStep(inputs, vsApply, false));
+   }
+
+   // hidden variables are summed out first, query variables are maximized after them
+   VarSet vsAll = fsPruned.GetVarSet()->Substract(vsEvidence);
+   VarSet vsOrder(db);
+   VarSet vsElimOrder = InteractionGraph(&fsPruned).GetElimOrder();
+   for (VarId id = vsElimOrder.GetFirst(); id != 0; id = vsElimOrder.GetNext(id))
+   {
+      if (vsAll.HasVar(id))
+         vsOrder.Add(id);
+   }
+   vsOrder.Add(vsAll);
+
+   VarSet vsHidden = vsOrder.Substract(vsQuery);
+   VarSet vsMax(db);
+   if (mOp == QueryOp_Map)
+      vsMax = vsOrder.Conjuction(vsQuery);
+
+   for (int pass = 0; pass < 2; pass++)
+   {
+      bool bMax = pass == 1;
+      const VarSet &vs = bMax ? vsMax : vsHidden;
+      for (VarId id = vs.GetFirst(); id != 0; id = vs.GetNext(id))
+      {
+         // same bucket as FactorSet::EliminateVar and FactorSet::MaximizeVar
+         std::vector<std::shared_ptr<Factor> > bucket;
+         for (auto iter = live.begin(); iter != live.end(); )
+         {
+            std::shared_ptr<Factor> f = *iter;
+            if ((bMax || f->GetFactorType() != VarType_Decision) && f->GetVarSet().HasVar(id))
+            {
+               bucket.push_back(f);
+               iter = live.erase(iter);
+            }
+            else
+            {
+               ++iter;
+            }
+         }
+         if (bucket.empty())
+            continue;
+         live.push_back(AddStep(bucket, VarSet(db, id), bMax));
+      }
+   }
+
+   // final product over query VarSet, ones factor keeps order of query variables
+   std::vector<std::shared_ptr<Factor> > inputs;
+   if (mOp == QueryOp_Marginal || live.empty())
+      inputs.push_back(FactorFactory::OnesFactor(mOp == QueryOp_Marginal ? vsQuery : VarSet(db)));
+   inputs.insert(inputs.end(), live.begin(), live.end());
+   mResult = AddStep(inputs, VarSet(db), mOp == QueryOp_Map);
+}
+
+std::shared_ptr<Factor>
+CompiledQuery::AddStep(const std::vector<std::shared_ptr<Factor> > &inputs,
+   const VarSet &vsEliminate, bool bMax)
+{
+   Step step;
+   step.mContraction = std::make_shared<FactorContraction>(inputs, vsEliminate);
+   step.mResult = step.mContraction->CreateResult();
+   step.mMax = bMax;
+
+   // indicators and step results are batched, model Factors are shared by the batch
+   for (auto &f : inputs)
+   {
+      int nBuffer = -1;
+      for (size_t k = 0; k < mIndicators.size(); k++)
+      {
+         if (mIndicators[k] == f)
+            nBuffer = (int) k;
+      }
+      for (size_t j = 0; j < mSteps.size(); j++)
+      {
+         if (mSteps[j].mResult == f)
+            nBuffer = (int) (mIndicators.size() + j);
+      }
+      step.mInputBuffers.push_back(nBuffer);
+   }
+   mSteps.push_back(step);
+   return step.mResult;
+}
+
+std::shared_ptr<Factor>
+CompiledQuery::Run(const Clause &evidence)
+{
+   VarId id = mVEvidence.GetFirst();
+   for (size_t k = 0; k < mIndicators.size(); k++, id = mVEvidence.GetNext(id))
+   {
+      Factor &f = *mIndicators[k];
+      VarState state = evidence.GetVar(id);
+      for (InstanceId n = 0; n < f.GetVarSet().GetInstances(); n++)
+         f.AddInstance(n, n == state ? 1.0F : 0.0F);
+   }
+
+   for (auto &step : mSteps)
+   {
+      if (step.mMax)
+         step.mContraction->Max(*step.mResult);
+      else
+         step.mContraction->Sum(*step.mResult);
+   }
+   return mResult;
+}
+
+std::vector<std::shared_ptr<Factor> >
+CompiledQuery::RunBatch(const std::vector<Clause> &evidence)
+{
+   size_t nBatch = evidence.size();
+   size_t nIndicators = mIndicators.size();
+   mBatchValues.resize(nIndicators + mSteps.size());
+   mBatchArgMax.resize(mSteps.size());
+
+   VarId id = mVEvidence.GetFirst();
+   for (size_t k = 0; k < nIndicators; k++, id = mVEvidence.GetNext(id))
+   {
+      std::vector<ValueType> &values = mBatchValues[k];
+      values.assign(mIndicators[k]->GetVarSet().GetInstances() * nBatch, 0.0F);
+      for (size_t b = 0; b < nBatch; b++)
+         values[evidence[b].GetVar(id) * nBatch + b] = 1.0F;
+   }
+
+   for (size_t j = 0; j < mSteps.size(); j++)
+   {
+      Step &step = mSteps[j];
+      std::vector<const ValueType *> inputs;
+      std::vector<bool> batched;
+      for (size_t k = 0; k < step.mInputBuffers.size(); k++)
+      {
+         int nBuffer = step.mInputBuffers[k];
+         batched.push_back(nBuffer >= 0);
+         inputs.push_back(nBuffer >= 0 ? mBatchValues[nBuffer].data() : 0);
+      }
+
+      InstanceId nRows = step.mResult->GetVarSet().GetInstances();
+      std::vector<ValueType> &values = mBatchValues[nIndicators + j];
+      values.resize(nRows * nBatch);
+      if (step.mMax)
+         mBatchArgMax[j].resize(nRows * nBatch);
+      step.mContraction->RunBatch(step.mMax, inputs, batched, nBatch, values.data(),
+         step.mMax ? mBatchArgMax[j].data() : 0);
+   }
+
+   const std::vector<ValueType> &resValues = mBatchValues.back();
+   InstanceId nRows = mResult->GetVarSet().GetInstances();
+   std::shared_ptr<const VarSet> pVsQuery = std::make_shared<const VarSet>(mVQuery);
+   std::vector<std::shared_ptr<Factor> > res;
+   for (size_t b = 0; b < nBatch; b++)
+   {
+      std::shared_ptr<Factor> f = mSteps.back().mContraction->CreateResult();
+      for (InstanceId n = 0; n < nRows; n++)
+         f->AddInstance(n, resValues[n * nBatch + b]);
+
+      if (mOp == QueryOp_Map)
+      {
+         // trace winning states back from the last maximized variable
+         Clause clMap(pVsQuery);
+         for (size_t j = mSteps.size(); j-- > 0; )
+         {
+            Step &step = mSteps[j];
+            if (!step.mMax)
+               continue;
+            const VarSet &vsOut = step.mResult->GetVarSet();
+            Clause clOut(vsOut);
+            for (VarId vid = vsOut.GetFirst(); vid != 0; vid = vsOut.GetNext(vid))
+               clOut.SetVar(vid, clMap.GetVar(vid));
+            InstanceId e = mBatchArgMax[j][clOut.GetInstanceId() * nBatch + b];
+            const VarSet &vsElim = step.mContraction->GetEliminatedVarSet();
+            for (VarId vid = vsElim.GetFirst(); vid != 0; vid = vsElim.GetNext(vid))
+               clMap.SetVar(vid, vsElim.FetchVarState(vid, e));
+         }
+         f->SetExtendedVarSet(mVQuery);
+         f->AddExtendedClause(0, clMap.GetInstanceId());
+      }
+      res.push_back(f);
+   }
+   return res;
+}
+
+InstanceId
+CompiledQuery::GetPeakInstances() const
+{
+   InstanceId res = 1;
+   for (auto &step : mSteps)
+      res = std::max(res, step.mResult->GetVarSet().GetInstances());
+   return res;
+}
+
+std::string
+CompiledQuery::GetJson(const VarDb &db) const
+{
+   std::string s;
+   s = "{op:";
+   s += mOp == QueryOp_Map ? "\"MAP\"" : "\"Marginal\"";
+   s += ",steps:[ ";
+   for (auto &step : mSteps)
+   {
+      s += "{eliminate:";
+      s += step.mContraction->GetEliminatedVarSet().GetJson(db);
+      s += ",result:";
+      s += step.mResult->GetVarSet().GetJson(db);
+      s += step.mMax ? ",max:true}," : ",max:false},";
+   }
+   s.erase(s.length() - 1);
+   s += "]}";
+   return s;
+}
+
+std::string
+CompiledQuery::GetType() const
+{
+   return "CompiledQuery";
+}
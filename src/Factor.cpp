@@ -9,8 +9,12 @@
 
 
 #include "factor.h"
+#include "FactorKernels.h"
 #include "json/json.h"
 #include <limits>
+#include <cmath>
+#include <algorithm>
+#include <cassert>
 using namespace bayeslib;
 
 char *
@@ -29,23 +33,253 @@ dumpbinary(char *sz, size_t lenSz, InstanceId v, int sizeVarSet)
    return sz;
 }
 
+// Rows of sparse table are kept in u32
+static bool
+FitsSparseRows(InstanceId nRows)
+{
+   return nRows <= (InstanceId) std::numeric_limits<u32>::max() + 1;
+}
+
+// InstanceId in target VarSet of every Clause of vs, in order of Clause::Incr
+static std::vector<InstanceId>
+ProjectInstances(const VarSet &vs, const VarSet &target)
+{
+   std::vector<InstanceId> res(vs.GetInstances());
+   Clause cl(vs);
+   InstanceId n = 0;
+   do
+   {
+      res[n++] = cl.GetInstanceId(target);
+   } while (!cl.Incr());
+   return res;
+}
+
 void
-Factor::Init()
+Factor::Init(bool bSparse)
 {
 	mFactorType = VarType_Normal;
+    mQuantMode = QuantMode_None;
+    mScale = 1;
+    mSparse = bSparse;
 
     mFactorSize = mSet.GetInstances();
-    int index= 0;
-
-    // B.A. replace mVarToIndex with mSet.GetOffset()
-    for(VarId id=mSet.GetFirst(); id != 0; id = mSet.GetNext(id))
-    {        
-        mBsPresent.set(id);
-        mVarToIndex[id] = index;
-        index++;        
-    }
-    mValues.resize(mFactorSize, 0.0F);
-    mValuePresent.resize(mFactorSize, false);
+    if (bSparse)
+        return;
+    FactorPool::Acquire(mValues, mFactorSize);
+    FactorPool::Acquire(mValuePresent, mFactorSize);
+}
+
+Factor::~Factor()
+{
+    FactorPool::Release(mValues);
+    FactorPool::Release(mValuePresent);
+    FactorPool::Release(mExtendedClauseVector);
+}
+
+// code c of QuantMode_Log8 is 2^((c-255)/16) of largest value, code 0 is exact zero
+static const ValueType *
+LogCodeTable()
+{
+   static std::vector<ValueType> table = []()
+   {
+      std::vector<ValueType> t(256, 0);
+      for (int c = 1; c < 256; c++)
+         t[c] = (ValueType) std::exp2((c - 255) / 16.0);
+      return t;
+   }();
+   return table.data();
+}
+
+Factor::ValueReader::ValueReader(const Factor &f) :
+   mpValues(0), mpCodes8(0), mpCodes16(0), mpLog(0), mScale(f.mScale)
+{
+   DBC_CHECK(!f.mSparse, "sparse table is read through GetReader");
+   switch (f.mQuantMode)
+   {
+   case QuantMode_Linear16:
+      mpCodes16 = f.mCodes16.data();
+      break;
+   case QuantMode_Log8:
+      mpLog = LogCodeTable();
+      mpCodes8 = f.mCodes8.data();
+      break;
+   case QuantMode_Linear8:
+      mpCodes8 = f.mCodes8.data();
+      break;
+   default:
+      mpValues = f.mValues.data();
+      break;
+   }
+}
+
+Factor::ValueReader::ValueReader(const ValueType *pValues) :
+   mpValues(pValues), mpCodes8(0), mpCodes16(0), mpLog(0), mScale(1)
+{
+}
+
+bool
+Factor::Quantize(QuantMode mode)
+{
+   if (mode == mQuantMode)
+      return true;
+   if (mQuantMode != QuantMode_None || mode == QuantMode_None || mSparse)
+      return false;
+
+   ValueType maxVal = 0;
+   for (InstanceId n = 0; n < mFactorSize; n++)
+   {
+      if (mValues[n] < 0)
+         return false;
+      maxVal = std::max(maxVal, mValues[n]);
+   }
+
+   // nonzero rows get at least code 1, so a possible state never becomes impossible
+   double maxCode = mode == QuantMode_Linear16 ? 65535 : 255;
+   if (mode == QuantMode_Log8)
+      mScale = maxVal > 0 ? maxVal : 1;
+   else
+      mScale = maxVal > 0 ? (ValueType) (maxVal / maxCode) : 1;
+   if (mode == QuantMode_Linear16)
+      mCodes16.assign(mFactorSize, 0);
+   else
+      mCodes8.assign(mFactorSize, 0);
+
+   for (InstanceId n = 0; n < mFactorSize; n++)
+   {
+      double v = mValues[n];
+      if (v <= 0)
+         continue;
+      double code = mode == QuantMode_Log8 ? 255 + 16 * std::log2(v / mScale) : v / mScale;
+      code = std::min(std::max(std::round(code), 1.0), maxCode);
+      if (mode == QuantMode_Linear16)
+         mCodes16[n] = (u16) code;
+      else
+         mCodes8[n] = (u8) code;
+   }
+   mQuantMode = mode;
+   FactorPool::Release(mValues);
+   return true;
+}
+
+const ValueType *
+Factor::GetDenseValues(std::vector<ValueType> &scratch) const
+{
+   if (mSparse)
+   {
+      FactorPool::Acquire(scratch, mFactorSize);
+      for (size_t n = 0; n < mSparseRows.size(); n++)
+         scratch[mSparseRows[n]] = mValues[n];
+      return scratch.data();
+   }
+   if (mQuantMode == QuantMode_None)
+      return mValues.data();
+   FactorPool::Acquire(scratch, mFactorSize);
+   ValueReader reader(*this);
+   for (InstanceId n = 0; n < mFactorSize; n++)
+      scratch[n] = reader[n];
+   return scratch.data();
+}
+
+Factor::ValueReader
+Factor::GetReader(std::vector<ValueType> &scratch) const
+{
+   if (mSparse)
+      return ValueReader(GetDenseValues(scratch));
+   return ValueReader(*this);
+}
+
+size_t
+Factor::GetStorageBytes() const
+{
+   return mValues.size() * sizeof(ValueType) + mCodes8.size() + mCodes16.size() * sizeof(u16) +
+      (mValuePresent.size() + 7) / 8 + mSparseRows.size() * sizeof(u32);
+}
+
+size_t
+Factor::SparsePos(InstanceId row) const
+{
+   auto it = std::lower_bound(mSparseRows.begin(), mSparseRows.end(), row);
+   if (it == mSparseRows.end() || *it != row)
+      return mSparseRows.size();
+   return it - mSparseRows.begin();
+}
+
+bool
+Factor::SetSparse(bool bSparse)
+{
+   if (bSparse == mSparse)
+      return true;
+   if (mQuantMode != QuantMode_None)
+      return false;
+
+   if (!bSparse)
+   {
+      std::vector<ValueType> values;
+      FactorPool::Acquire(values, mFactorSize);
+      FactorPool::Acquire(mValuePresent, mFactorSize);
+      for (size_t n = 0; n < mSparseRows.size(); n++)
+      {
+         values[mSparseRows[n]] = mValues[n];
+         mValuePresent[mSparseRows[n]] = true;
+      }
+      FactorPool::Release(mValues);
+      mValues.swap(values);
+      std::vector<u32>().swap(mSparseRows);
+      mSparse = false;
+      return true;
+   }
+
+   // extended clauses are kept per row of full table
+   if (HasExtendedInfo() || !FitsSparseRows(mFactorSize))
+      return false;
+
+   size_t nNonZero = 0;
+   for (InstanceId n = 0; n < mFactorSize; n++)
+   {
+      if (mValues[n] < 0)
+         return false;
+      if (mValues[n] != 0)
+         nNonZero++;
+   }
+   std::vector<ValueType> values;
+   values.reserve(nNonZero);
+   mSparseRows.reserve(nNonZero);
+   for (InstanceId n = 0; n < mFactorSize; n++)
+   {
+      if (mValues[n] != 0)
+      {
+         mSparseRows.push_back((u32) n);
+         values.push_back(mValues[n]);
+      }
+   }
+   FactorPool::Release(mValues);
+   FactorPool::Release(mValuePresent);
+   mValues.swap(values);
+   mSparse = true;
+   return true;
+}
+
+double
+Factor::GetFill() const
+{
+   size_t nNonZero = mSparseRows.size();
+   if (!mSparse)
+   {
+      ValueReader values(*this);
+      for (InstanceId n = 0; n < mFactorSize; n++)
+      {
+         if (values[n] != 0)
+            nNonZero++;
+      }
+   }
+   return mFactorSize ? (double) nNonZero / mFactorSize : 0;
+}
+
+bool
+Factor::SelectStorage(double maxFill)
+{
+   SetSparse(GetFill() <= maxFill);
+   return mSparse;
 }
 
 Factor::Factor(const VarSet &vset) : 
@@ -76,6 +310,12 @@ Factor::Factor(const VarDb &db, std::initializer_list<VarId> varset, std::initia
    Init();
 }
 
+Factor::Factor(const VarSet &vset, const VarSet &clauseHead, bool bSparse) :
+   mSet(vset), mClauseHead(clauseHead), mExtendedVarSet(vset.GetDb())
+{
+   Init(bSparse);
+}
+
 Factor::FactorLoader Factor::operator << (ValueType v)
 {
 	FactorLoader fl( shared_from_this());
@@ -88,35 +328,36 @@ void Factor::CompleteProbabilities()
 {
 	VarSet vsTail = mSet.Substract(mClauseHead);
 	Clause cTail(vsTail);
+	std::vector<InstanceId> headOffs = ProjectInstances(mClauseHead, mSet);
 
 	do
 	{
-		Clause cHead(mClauseHead);
+		InstanceId base = cTail.GetInstanceId(mSet);
 		ValueType v = 0.;
 		bool bUpdateClauseFound = false;    // found unidentified member in the sequence
-		Clause cFullUpdateClause(mSet);
-		do
+		InstanceId idFullUpdateClause = 0;
+		for (InstanceId offs : headOffs)
 		{
-			Clause tryClause = Clause::Append(mSet, cHead, cTail);
-			if (HasVal(tryClause.GetInstanceId()))
+			InstanceId tryId = base + offs;
+			if (HasVal(tryId))
 			{
-				v += Get(tryClause.GetInstanceId());
+				v += Get(tryId);
 			}
 			else
 			{
 				if (!bUpdateClauseFound)
 				{
 					bUpdateClauseFound = true;
-					cFullUpdateClause = tryClause;
+					idFullUpdateClause = tryId;
 				}
 			}
 
-		} while (!cHead.Incr());
+		}
 
 		if (v < 1.0 && bUpdateClauseFound)
 		{
 			v = 1.0F - v;
-			AddInstance(cFullUpdateClause.GetInstanceId(), v);
+			AddInstance(idFullUpdateClause, v);
 		}
 
 	} while (!cTail.Incr());
@@ -126,6 +367,31 @@ void Factor::CompleteProbabilities()
 void
 Factor::AddInstance(InstanceId instance, ValueType val)
 {
+    DBC_CHECK(mQuantMode == QuantMode_None, "quantized Factor is immutable");
+    if (mSparse && val < 0)
+        SetSparse(false);
+    if (mSparse && instance < mFactorSize)
+    {
+        // sparse table holds nonzero rows only
+        auto it = std::lower_bound(mSparseRows.begin(), mSparseRows.end(), instance);
+        size_t pos = it - mSparseRows.begin();
+        bool bStored = it != mSparseRows.end() && *it == instance;
+        if (bStored && val != 0)
+        {
+            mValues[pos] = val;
+        }
+        else if (bStored)
+        {
+            mSparseRows.erase(it);
+            mValues.erase(mValues.begin() + pos);
+        }
+        else if (val != 0)
+        {
+            mSparseRows.insert(it, (u32) instance);
+            mValues.insert(mValues.begin() + pos, val);
+        }
+        return;
+    }
     if (instance < mFactorSize)
     {
         mValues[instance] = (ValueType) val;
@@ -137,6 +403,8 @@ Factor::AddInstance(InstanceId instance, ValueType val)
 bool 
 Factor::HasVal(InstanceId id)
 {
+    if (mSparse)
+        return SparsePos(id) < mSparseRows.size();
     if (id < mFactorSize)
         return mValuePresent[id]; 
     return false;   
@@ -144,8 +412,13 @@ Factor::HasVal(InstanceId id)
 
 ValueType Factor::Get(InstanceId id)
 {
+    if (mSparse)
+    {
+        size_t pos = SparsePos(id);
+        return pos < mSparseRows.size() ? mValues[pos] : 0;
+    }
     if(HasVal(id))
-        return mValues[id];
+        return mQuantMode ? ValueReader(*this)[id] : mValues[id];
     else
         return 0; 
 }
@@ -162,57 +435,188 @@ Factor::Merge(std::shared_ptr<Factor> f)
    vsHead = vsHead.Substract(vsTail1);
    vsHead = vsHead.Substract(vsTail2);
 
+    // result too large for rows of sparse table is built full
+    if ((mSparse || f->mSparse) && FitsSparseRows(h.mVr.GetInstances()))
+        return MergeSparse(f, h.mVr, vsHead);
+
     std::shared_ptr<Factor> res(new Factor(h.mVr, vsHead));
     VarSet newExtendedVs = GetExtendedVarSet().Disjuction(f->GetExtendedVarSet());
     res->SetExtendedVarSet(newExtendedVs);
 
     InstanceId maxRes = h.mVr.GetInstances();
-    for(InstanceId i = 0; i < maxRes; i++)
+    int nSize = h.mVr.GetSize();
+
+    // odometer over merged varset, operand indices are updated by strides only
+    std::vector<int> digits(nSize, 0);
+    InstanceId id1 = 0;
+    InstanceId id2 = 0;
+
+    // rows not assigned with AddInstance hold 0 so values can be read directly
+    std::vector<ValueType> scratch1, scratch2;
+    ValueReader pVal1 = GetReader(scratch1);
+    ValueReader pVal2 = f->GetReader(scratch2);
+    ValueType *pRes = res->mValues.data();
+    res->mValuePresent.assign(maxRes, true);
+
+    // sum-product Factors have no ExtendedVarSet and skip backtracking entirely
+    bool bExtended = !newExtendedVs.IsEmpty();
+    ExtendedMap map1, map2;
+    if (bExtended)
     {
-        InstanceId id1=0;
-        InstanceId id2=0;
-        int nSize = h.mVr.GetSize();
-        for(int n=0; n<nSize; n++)
-        {
-            int nOffs1 = h.MapOffsRTo1(n);
-            int nOffs2 = h.MapOffsRTo2(n);
-
-            VarState valInRes = h.mVr.FetchVarStateByOffs(n, i);
-            
-            if(nOffs1 >=0)
-                id1 +=  h.mV1.GetInstanceComponentByOffs(nOffs1, valInRes);
-
-            if(nOffs2 >=0)
-                id2 +=  h.mV2.GetInstanceComponentByOffs(nOffs2, valInRes);
-        }
-
-        ValueType v = Get(id1) * f->Get(id2);
-        res->AddInstance(i, v);
-        Clause newExtendedClause(newExtendedVs);
-        Clause cl1(GetExtendedVarSet(), GetExtendedClause(id1));
-        Clause cl2(f->GetExtendedVarSet(), f->GetExtendedClause(id2));
+       map1.Init(GetExtendedVarSet(), newExtendedVs, f->GetExtendedVarSet());
+       map2.Init(f->GetExtendedVarSet(), newExtendedVs, VarSet(newExtendedVs.GetDb()));
+       FactorPool::Acquire(res->mExtendedClauseVector, maxRes);
+    }
 
-        for (VarId id1 = cl1.GetVarSet().GetFirst();
-           id1 != 0; id1 = cl1.GetVarSet().GetNext(id1))
+    for(InstanceId i = 0; i < maxRes; i++)
+    {
+        pRes[i] = pVal1[id1] * pVal2[id2];
+        if (bExtended)
         {
-           newExtendedClause.SetVar(id1, cl1.GetVar(id1));
+           res->mExtendedClauseVector[i] = map1.Map(GetExtendedClause(id1)) +
+              map2.Map(f->GetExtendedClause(id2));
         }
 
-        for (VarId id2 = cl2.GetVarSet().GetFirst();
-           id2 != 0; id2 = cl2.GetVarSet().GetNext(id2))
+        for(int n = 0; n < nSize; n++)
         {
-           newExtendedClause.SetVar(id2, cl2.GetVar(id2));
+            if(++digits[n] < h.mDomain[n])
+            {
+                id1 += h.mStride1[n];
+                id2 += h.mStride2[n];
+                break;
+            }
+            digits[n] = 0;
+            id1 -= h.mRewind1[n];
+            id2 -= h.mRewind2[n];
         }
-
-        res->AddExtendedClause(i, newExtendedClause.GetInstanceId());
     }
+    if (mSparse)
+       FactorPool::Release(scratch1);
+    if (f->mSparse)
+       FactorPool::Release(scratch2);
     return res;
 }
 
+std::shared_ptr<Factor>
+Factor::MergeSparse(std::shared_ptr<Factor> f, const VarSet &vsRes, const VarSet &vsHead)
+{
+   // stored rows of the operand with fewer of them per result row drive the product
+   bool bDriveThis = mSparse && (!f->mSparse || GetFill() <= f->GetFill());
+   const Factor &d = bDriveThis ? *this : *f;
+   const Factor &o = bDriveThis ? *f : *this;
+   std::vector<ValueType> scratch;
+   ValueReader other = o.GetReader(scratch);
+
+   // variables of driver are decoded from its row, the others are walked by odometer
+   std::vector<int> domDrive, domRest;
+   std::vector<InstanceId> mulDrive, resDrive, otherDrive, resRest, otherRest;
+   for (VarId id = vsRes.GetFirst(); id != 0; id = vsRes.GetNext(id))
+   {
+      InstanceId mulOther = o.mSet.HasVar(id) ? o.mSet.GetInstanceComponent(id, 1) : 0;
+      if (d.mSet.HasVar(id))
+      {
+         domDrive.push_back(d.mSet.GetDb().GetDomainSize(id));
+         mulDrive.push_back(d.mSet.GetInstanceComponent(id, 1));
+         resDrive.push_back(vsRes.GetInstanceComponent(id, 1));
+         otherDrive.push_back(mulOther);
+      }
+      else
+      {
+         domRest.push_back(vsRes.GetDb().GetDomainSize(id));
+         resRest.push_back(vsRes.GetInstanceComponent(id, 1));
+         otherRest.push_back(mulOther);
+      }
+   }
+
+   VarSet newExtendedVs = GetExtendedVarSet().Disjuction(f->GetExtendedVarSet());
+   bool bExtended = !newExtendedVs.IsEmpty();
+   ExtendedMap map1, map2;
+   if (bExtended)
+   {
+      map1.Init(GetExtendedVarSet(), newExtendedVs, f->GetExtendedVarSet());
+      map2.Init(f->GetExtendedVarSet(), newExtendedVs, VarSet(newExtendedVs.GetDb()));
+   }
+
+   struct Entry { InstanceId mRow; ValueType mVal; InstanceId mExt; };
+   std::vector<Entry> entries;
+   std::vector<int> digits(domRest.size());
+   for (size_t n = 0; n < d.mSparseRows.size(); n++)
+   {
+      InstanceId row = d.mSparseRows[n];
+      InstanceId rowRes = 0;
+      InstanceId rowOther = 0;
+      for (size_t v = 0; v < domDrive.size(); v++)
+      {
+         InstanceId state = row / mulDrive[v] % domDrive[v];
+         rowRes += state * resDrive[v];
+         rowOther += state * otherDrive[v];
+      }
+
+      std::fill(digits.begin(), digits.end(), 0);
+      for (;;)
+      {
+         ValueType val = d.mValues[n] * other[rowOther];
+         if (val != 0)
+         {
+            InstanceId ext = 0;
+            if (bExtended)
+            {
+               ext = bDriveThis ? map1.Map(GetExtendedClause(row)) + map2.Map(f->GetExtendedClause(rowOther)) :
+                  map1.Map(GetExtendedClause(rowOther)) + map2.Map(f->GetExtendedClause(row));
+            }
+            entries.push_back({ rowRes, val, ext });
+         }
+
+         size_t v = 0;
+         for (; v < domRest.size(); v++)
+         {
+            if (++digits[v] < domRest[v])
+            {
+               rowRes += resRest[v];
+               rowOther += otherRest[v];
+               break;
+            }
+            digits[v] = 0;
+            rowRes -= resRest[v] * (domRest[v] - 1);
+            rowOther -= otherRest[v] * (domRest[v] - 1);
+         }
+         if (v == domRest.size())
+            break;
+      }
+   }
+   if (o.mSparse)
+      FactorPool::Release(scratch);
+
+   std::sort(entries.begin(), entries.end(),
+      [](const Entry &e1, const Entry &e2) { return e1.mRow < e2.mRow; });
+   std::shared_ptr<Factor> res(new Factor(vsRes, vsHead, true));
+   DBC_CHECK(FitsSparseRows(res->mFactorSize), "rows of sparse table are u32");
+   res->SetExtendedVarSet(newExtendedVs);
+   res->mSparseRows.reserve(entries.size());
+   res->mValues.reserve(entries.size());
+   for (auto &e : entries)
+   {
+      res->mSparseRows.push_back((u32) e.mRow);
+      res->mValues.push_back(e.mVal);
+   }
+   if (!bExtended)
+   {
+      res->SelectStorage();
+      return res;
+   }
+
+   // extended clauses are kept per row of full table, so is the result
+   res->SetSparse(false);
+   FactorPool::Acquire(res->mExtendedClauseVector, res->mFactorSize);
+   for (auto &e : entries)
+      res->mExtendedClauseVector[e.mRow] = e.mExt;
+   return res;
+}
+
 std::shared_ptr<Factor> 
 Factor::EliminateVar(VarId id)
 {
-    if (!mBsPresent[id])
+    if (!mSet.HasVar(id))
     {
         // variable is not present
         return shared_from_this();
@@ -232,19 +636,28 @@ Factor::EliminateVar(VarId id)
     mSet.GetVarParams(id, rightMultiplier, eliminateSize);
     InstanceId leftMultiplier = rightMultiplier*eliminateSize;
 
-   for(InstanceId nLoop=0; nLoop < vsRes.GetInstances(); nLoop++)
-   {
-      // calc base part of InstanceId in old VarSet
-      InstanceId oldInstanceBase = nLoop%rightMultiplier + (nLoop/rightMultiplier)*leftMultiplier;
-      ValueType valSum = 0;
+    // zero rows add nothing, every stored row goes to its row of result
+    if (mSparse)
+    {
+        std::vector<AccumType> acc(res->mFactorSize, 0);
+        for (size_t n = 0; n < mSparseRows.size(); n++)
+        {
+            InstanceId row = mSparseRows[n];
+            acc[row / leftMultiplier * rightMultiplier + row % rightMultiplier] += mValues[n];
+        }
+        for (InstanceId n = 0; n < res->mFactorSize; n++)
+            res->mValues[n] = (ValueType) acc[n];
+        res->mValuePresent.assign(res->mFactorSize, true);
+        res->SelectStorage();
+        return res;
+    }
 
-      for(VarState elimState=0; elimState < eliminateSize; ++elimState)
-      {
-         InstanceId oldInstance = oldInstanceBase + elimState*rightMultiplier;
-         valSum += mValues[oldInstance];
-      }
-      res->AddInstance(nLoop, valSum);
-   }
+    // table is [left][eliminated][right], reduce middle dimension
+    std::vector<ValueType> scratch;
+    FactorKernels::SumOut(GetDenseValues(scratch), res->mValues.data(),
+       mFactorSize / leftMultiplier, eliminateSize, rightMultiplier);
+    FactorPool::Release(scratch);
+    res->mValuePresent.assign(res->mFactorSize, true);
     return res;
 }
 
@@ -263,22 +676,68 @@ Factor::EliminateVar(const VarSet &ids)
 std::shared_ptr<Factor> 
 Factor::PruneEdge(VarId v, VarState val)
 {
-	VarSet newVs = mSet.Substract({GetDb(), v });
-   std::shared_ptr<Factor> res = std::make_shared<Factor>(newVs);
-   Clause clNew(newVs);
-   Clause clOld(mSet);
+   Clause c(VarSet(GetDb(), v));
+   c.SetVar(v, val);
+   return Slice(c);
+}
 
-   do
+std::shared_ptr<Factor> 
+Factor::Slice(const Clause &c)
+{
+   if (!mSet.HasVar(c.GetVarSet()))
+      return shared_from_this();
+
+   VarSet vsNew = mSet.Substract(c.GetVarSet());
+   InstanceId base = c.GetInstanceId(mSet);
+   if (mSparse)
    {
-      for (VarId v = newVs.GetFirst(); v != 0; v = newVs.GetNext(v))
+      std::shared_ptr<Factor> res(new Factor(vsNew, mClauseHead.Substract(c.GetVarSet()), true));
+      DBC_CHECK(FitsSparseRows(res->mFactorSize), "rows of sparse table are u32");
+      res->SetFactorType(mFactorType);
+
+      // stored row is kept when its observed states give base, removing them keeps rows ascending
+      std::vector<int> domain;
+      std::vector<InstanceId> mul, mulNew;
+      for (VarId id = mSet.GetFirst(); id != 0; id = mSet.GetNext(id))
       {
-         
-         clOld.SetVar(v, clNew.GetVar(v));
+         domain.push_back(mSet.GetDb().GetDomainSize(id));
+         mul.push_back(mSet.GetInstanceComponent(id, 1));
+         mulNew.push_back(vsNew.HasVar(id) ? vsNew.GetInstanceComponent(id, 1) : 0);
       }
-      clOld.SetVar(v, val);
-      res->AddInstance(clNew.GetInstanceId(), Get(clOld.GetInstanceId()));
+      for (size_t n = 0; n < mSparseRows.size(); n++)
+      {
+         InstanceId row = mSparseRows[n];
+         InstanceId rowObserved = 0;
+         InstanceId rowNew = 0;
+         for (size_t v = 0; v < domain.size(); v++)
+         {
+            InstanceId state = row / mul[v] % domain[v];
+            if (mulNew[v])
+               rowNew += state * mulNew[v];
+            else
+               rowObserved += state * mul[v];
+         }
+         if (rowObserved == base)
+         {
+            res->mSparseRows.push_back((u32) rowNew);
+            res->mValues.push_back(mValues[n]);
+         }
+      }
+      res->SelectStorage();
+      return res;
+   }
+
+   std::shared_ptr<Factor> res = std::make_shared<Factor>(vsNew, mClauseHead.Substract(c.GetVarSet()));
+   res->SetFactorType(mFactorType);
 
-   } while (!clNew.Incr());
+   // row in this factor is the row of vsNew projected on mSet plus observed states
+   std::vector<InstanceId> oldOffs = ProjectInstances(vsNew, mSet);
+   ValueReader values(*this);
+   for (InstanceId n = 0; n < oldOffs.size(); n++)
+   {
+      res->mValues[n] = values[base + oldOffs[n]];
+      res->mValuePresent[n] = mValuePresent[base + oldOffs[n]];
+   }
    return res;
 }
 
@@ -295,13 +754,13 @@ Factor::ApplyClause(const Clause &c)
     
     std::shared_ptr<Factor> res = std::make_shared<Factor>(mSet, mClauseHead); 
 
-    Clause resClause(vsNew);
-    do 
+    // matching rows are the rows of vsNew shifted by the applied part of c
+    InstanceId base = c.GetInstanceId(mSet);
+    std::vector<InstanceId> newOffs = ProjectInstances(vsNew, mSet);
+    for (InstanceId offs : newOffs)
     {
-       Clause old = Clause::Append(mSet, resClause, c);
-       res->AddInstance(old.GetInstanceId(), Get(old.GetInstanceId()));        
-
-    } while(!resClause.Incr());
+       res->AddInstance(base + offs, Get(base + offs));
+    }
 
     return res;
 }
@@ -312,25 +771,24 @@ Factor::Normalize()
    VarSet vsTail = mSet.Substract(mClauseHead);
    Clause cHead(mClauseHead);
    std::shared_ptr<Factor> resFactor = std::make_shared<Factor>(mSet, mClauseHead);
+   std::vector<InstanceId> tailOffs = ProjectInstances(vsTail, mSet);
 
    do
    {
-      Clause cTail(vsTail);
-      ValueType v = 0.f;
-      do
+      InstanceId base = cHead.GetInstanceId(mSet);
+      AccumType v = 0;
+      for (InstanceId offs : tailOffs)
       {
-         Clause res = Clause::Append(mSet, cHead, cTail);
-         v += Get(res.GetInstanceId());
-      } while (!cTail.Incr());
+         v += Get(base + offs);
+      }
 
-      if (v == 0.f)
-         v = 1.f;
+      if (v == 0)
+         v = 1;
       // start loop over tail vars again, this time normalizing results
-      do
+      for (InstanceId offs : tailOffs)
       {
-         Clause res = Clause::Append(mSet, cHead, cTail);
-         resFactor->AddInstance(res.GetInstanceId(), Get(res.GetInstanceId()) / v);
-      } while (!cTail.Incr());
+         resFactor->AddInstance(base + offs, (ValueType) (Get(base + offs) / v));
+      }
       
    } while (!cHead.Incr());
    return resFactor;
@@ -339,7 +797,7 @@ Factor::Normalize()
 std::shared_ptr<Factor> 
 Factor::MaximizeVar(VarId id)
 {
-   if (!mBsPresent[id])
+   if (!mSet.HasVar(id))
    {
       // B.A. consider creating new factor
       // variable is not present
@@ -365,29 +823,49 @@ Factor::MaximizeVar(VarId id)
    res->SetExtendedVarSet(newExtendedVs);
 
 
-   for(InstanceId nLoop=0; nLoop < vsRes.GetInstances(); nLoop++)
+   InstanceId nOuter = mFactorSize / leftMultiplier;
+   std::vector<VarState> argMax(res->mFactorSize);
+   if (mSparse)
    {
-      // calc base part of InstanceId in old VarSet
-      InstanceId oldInstanceBase = nLoop%rightMultiplier + (nLoop/rightMultiplier)*leftMultiplier;
-      ValueType valMax = -std::numeric_limits<float>::max();
-      
-      VarState varStateMax = 0;
-      InstanceId oldInstanceMax = 0;
-
-      for(VarState elimState=0; elimState < eliminateSize; ++elimState)
+      // stored rows are nonzero, rows without any keep 0 and highest state as in MaxOut
+      argMax.assign(res->mFactorSize, (VarState) (eliminateSize - 1));
+      for (size_t n = 0; n < mSparseRows.size(); n++)
       {
-         InstanceId oldInstance = oldInstanceBase + elimState*rightMultiplier;
-         if(valMax <= mValues[oldInstance])
+         InstanceId row = mSparseRows[n];
+         InstanceId rowRes = row / leftMultiplier * rightMultiplier + row % rightMultiplier;
+         VarState state = (VarState) (row / rightMultiplier % eliminateSize);
+         ValueType v = mValues[n];
+         if (v > res->mValues[rowRes] || (v == res->mValues[rowRes] && state > argMax[rowRes]))
          {
-            valMax = mValues[oldInstance];
-            varStateMax = elimState;
-            oldInstanceMax = oldInstance;
+            res->mValues[rowRes] = v;
+            argMax[rowRes] = state;
          }
       }
-      res->AddInstance(nLoop, valMax);
-      Clause cl(newExtendedVs, GetExtendedClause(oldInstanceMax));
-      cl.SetVar(id, varStateMax);
-      res->AddExtendedClause(nLoop, cl.GetInstanceId());
+   }
+   else
+   {
+      std::vector<ValueType> scratch;
+      FactorKernels::MaxOut(GetDenseValues(scratch), res->mValues.data(), argMax.data(),
+         nOuter, eliminateSize, rightMultiplier);
+      FactorPool::Release(scratch);
+   }
+   res->mValuePresent.assign(res->mFactorSize, true);
+
+   ExtendedMap map;
+   map.Init(mExtendedVarSet, newExtendedVs, VarSet(mSet.GetDb(), id));
+   InstanceId multiplierMax = newExtendedVs.GetInstanceComponent(id, 1);
+   FactorPool::Acquire(res->mExtendedClauseVector, res->mFactorSize);
+
+   InstanceId nLoop = 0;
+   for(InstanceId nOuterLoop = 0; nOuterLoop < nOuter; nOuterLoop++)
+   {
+      for(InstanceId nInnerLoop = 0; nInnerLoop < rightMultiplier; nInnerLoop++, nLoop++)
+      {
+         VarState varStateMax = argMax[nLoop];
+         InstanceId oldInstanceMax = nOuterLoop*leftMultiplier + varStateMax*rightMultiplier + nInnerLoop;
+         res->mExtendedClauseVector[nLoop] = map.Map(GetExtendedClause(oldInstanceMax)) +
+            varStateMax * multiplierMax;
+      }
    }
 
    return res;
@@ -396,11 +874,33 @@ Factor::MaximizeVar(VarId id)
 void 
 Factor::AddExtendedClause(InstanceId instance, InstanceId extendedInstance)
 {
-   if(mExtendedClauseVector.size() <= extendedInstance)
-      mExtendedClauseVector.resize(mSet.GetInstances());
+   if(mExtendedClauseVector.size() <= instance)
+   {
+      SetSparse(false);
+      FactorPool::Acquire(mExtendedClauseVector, mFactorSize);
+   }
    mExtendedClauseVector[instance] = extendedInstance;
 }
 
+void
+Factor::ExtendedMap::Init(const VarSet &vsFrom, const VarSet &vsTo, const VarSet &vsSkip)
+{
+   mFrom.clear();
+   mDomain.clear();
+   mTo.clear();
+   for (VarId id = vsFrom.GetFirst(); id != 0; id = vsFrom.GetNext(id))
+   {
+      if (vsSkip.HasVar(id))
+         continue;
+      InstanceId multiplier = 0;
+      int varSize = 0;
+      vsFrom.GetVarParams(id, multiplier, varSize);
+      mFrom.push_back(multiplier);
+      mDomain.push_back(varSize);
+      mTo.push_back(vsTo.GetInstanceComponent(id, 1));
+   }
+}
+
 InstanceId 
 Factor::GetExtendedClause(InstanceId instance)
 {
@@ -429,13 +929,16 @@ Factor::GetJson(const VarDb &db) const
    s += mExtendedVarSet.GetJson(db);
    s += ",vals:[ ";
 
+   std::vector<ValueType> scratch;
+   ValueReader values = GetReader(scratch);
    for(InstanceId id = 0; id < mFactorSize; id++)
    {
       char sz[20];
-      snprintf(sz, sizeof(sz), "%f", mValues[id] );
+      snprintf(sz, sizeof(sz), "%f", values[id] );
       s += sz;
       s += ",";
    }   
+   FactorPool::Release(scratch);
    s.erase(s.length()-1);
    s += "],";
 
@@ -0,0 +1,580 @@
+/*
+* Copyright (C) 2017 Boris Altshul.
+* All rights reserved.
+*
+* The software in this package is published under the terms of the BSD
+* style license a copy of which has been included with this distribution in
+* the LICENSE.txt file.
+*/
+
+#include "factor.h"
+#include "FactorKernels.h"
+#include "json/json.h"
+#include <cassert>
+#include <limits>
+
+
+using namespace bayeslib;
+
+// smallest value used as starting point of max-out, same as in Factor::MaximizeVar
+static const AccumType kMinAccum = -std::numeric_limits<AccumType>::max();
+static const ValueType kMinValue = -std::numeric_limits<ValueType>::max();
+
+FactorContraction::FactorContraction(const std::vector<std::shared_ptr<Factor> > &factors,
+   const VarSet &vsEliminate) : mFactors(factors), mVOut(vsEliminate.GetDb()),
+   mVHead(vsEliminate.GetDb()), mVElim(vsEliminate.GetDb())
+{
+   // fold varsets and heads in the same way as FactorSet::Merge
+   VarSet vsAll(vsEliminate.GetDb());
+   bool bFirst = true;
+   for (auto &f : mFactors)
+   {
+      if (bFirst)
+      {
+         vsAll = f->GetVarSet();
+         mVHead = f->GetClauseHead();
+         bFirst = false;
+         continue;
+      }
+      VarSet vsTail1 = vsAll.Substract(mVHead);
+      mVHead = mVHead.Disjuction(f->GetClauseHead());
+      mVHead = mVHead.Substract(vsTail1);
+      mVHead = mVHead.Substract(f->GetVarSetTail());
+      vsAll.Add(f->GetVarSet());
+   }
+
+   for (VarId id = vsEliminate.GetFirst(); id != 0; id = vsEliminate.GetNext(id))
+   {
+      if (vsAll.HasVar(id))
+         mVElim.Add(id);
+   }
+   mVOut = vsAll.Substract(mVElim);
+   mVHead = mVHead.Substract(mVElim);
+
+   // strides of result variables in every input
+   size_t nInputs = mFactors.size();
+   int nOut = mVOut.GetSize();
+   mOutDomain.resize(nOut);
+   mOutStride.assign(nOut * nInputs, 0);
+   mOutRewind.assign(nOut * nInputs, 0);
+
+   std::vector<VarSet> vsInputs;
+   for (auto &f : mFactors)
+      vsInputs.push_back(f->GetVarSet());
+
+   int n = 0;
+   for (VarId id = mVOut.GetFirst(); id != 0; id = mVOut.GetNext(id), n++)
+   {
+      InstanceId multiplier = 0;
+      int varSize = 0;
+      mVOut.GetVarParams(id, multiplier, varSize);
+      mOutDomain[n] = varSize;
+
+      for (size_t k = 0; k < nInputs; k++)
+      {
+         VarSet &vs = vsInputs[k];
+         if (!vs.HasVar(id))
+            continue;
+         vs.GetVarParams(id, mOutStride[n * nInputs + k], varSize);
+         mOutRewind[n * nInputs + k] = mOutStride[n * nInputs + k] * (mOutDomain[n] - 1);
+      }
+   }
+
+   // offset of every clause of eliminated vars in every input
+   InstanceId nElim = mVElim.GetInstances();
+   mElimOffs.assign(nElim * nInputs, 0);
+   for (InstanceId e = 0; e < nElim; e++)
+   {
+      for (VarId id = mVElim.GetFirst(); id != 0; id = mVElim.GetNext(id))
+      {
+         VarState state = mVElim.FetchVarState(id, e);
+         for (size_t k = 0; k < nInputs; k++)
+         {
+            mElimOffs[e * nInputs + k] += vsInputs[k].GetInstanceComponent(id, state);
+         }
+      }
+   }
+}
+
+std::shared_ptr<Factor>
+FactorContraction::Sum()
+{
+   if (mFactors.empty())
+      return std::make_shared<Factor>(VarSet(mVOut.GetDb()));
+
+   // single input reduced by single variable, use vectorized kernels
+   if (mFactors.size() == 1 && mVElim.GetSize() == 1)
+      return mFactors[0]->EliminateVar(mVElim.GetFirst());
+
+   std::shared_ptr<Factor> res = CreateResult();
+   Run(false, *res);
+   // product of a sparse input stays mostly zero
+   for (auto &f : mFactors)
+   {
+      if (f->IsSparse())
+      {
+         res->SelectStorage();
+         break;
+      }
+   }
+   return res;
+}
+
+std::shared_ptr<Factor>
+FactorContraction::Max()
+{
+   if (mFactors.empty())
+      return std::make_shared<Factor>(VarSet(mVOut.GetDb()));
+
+   if (mFactors.size() == 1 && mVElim.GetSize() == 1)
+      return mFactors[0]->MaximizeVar(mVElim.GetFirst());
+
+   std::shared_ptr<Factor> res = CreateResult();
+   Run(true, *res);
+   // product of a sparse input stays mostly zero
+   for (auto &f : mFactors)
+   {
+      if (f->IsSparse())
+      {
+         res->SelectStorage();
+         break;
+      }
+   }
+   return res;
+}
+
+void
+FactorContraction::Sum(Factor &res)
+{
+   Run(false, res);
+}
+
+void
+FactorContraction::Max(Factor &res)
+{
+   Run(true, res);
+}
+
+void
+FactorContraction::Max(Factor &res, std::vector<VarState> &argMax)
+{
+   DBC_CHECK(mVElim.GetSize() == 1, "Backpointer table needs single eliminated variable");
+   argMax.resize(mVOut.GetInstances());
+
+   // single input keeps order of its VarSet, use vectorized kernel
+   if (mFactors.size() == 1 && !mFactors[0]->IsSparse())
+   {
+      const Factor &f = *mFactors[0];
+      InstanceId rightMultiplier = 0;
+      int eliminateSize = 0;
+      f.GetVarSet().GetVarParams(mVElim.GetFirst(), rightMultiplier, eliminateSize);
+      InstanceId nOuter = f.mFactorSize / (rightMultiplier * eliminateSize);
+      std::vector<ValueType> scratch;
+      FactorKernels::MaxOut(f.GetDenseValues(scratch), res.mValues.data(), argMax.data(),
+         nOuter, eliminateSize, rightMultiplier);
+      FactorPool::Release(scratch);
+      res.mValuePresent.assign(res.mFactorSize, true);
+      return;
+   }
+   Run(true, res, argMax.data());
+}
+
+std::shared_ptr<Factor>
+FactorContraction::CreateResult() const
+{
+   return std::make_shared<Factor>(mVOut, mVHead);
+}
+
+void
+FactorContraction::Run(bool bMax, Factor &res, VarState *pArgMax)
+{
+   DBC_CHECK(!mFactors.empty(), "Contraction has no inputs");
+   DBC_CHECK(res.mFactorSize == mVOut.GetInstances(), "Result Factor does not match contraction");
+   DBC_CHECK(!res.IsSparse(), "Result Factor has full table");
+
+   size_t nInputs = mFactors.size();
+   int nOut = mVOut.GetSize();
+   InstanceId maxRes = mVOut.GetInstances();
+   InstanceId nElim = mVElim.GetInstances();
+
+   VarSet newExtendedVs(mVOut.GetDb());
+   bool bExtended = false;
+   bool bClauses = bMax && !pArgMax;
+   if (bClauses)
+   {
+      for (auto &f : mFactors)
+      {
+         if (!f->GetExtendedVarSet().IsEmpty())
+            bExtended = true;
+         newExtendedVs = newExtendedVs.Disjuction(f->GetExtendedVarSet());
+      }
+      newExtendedVs.Add(mVElim);
+      res.SetExtendedVarSet(newExtendedVs);
+   }
+   // later inputs overwrite states of earlier ones, eliminated variables come last
+   std::vector<Factor::ExtendedMap> maps(bExtended ? nInputs : 0);
+   for (size_t k = 0; k < maps.size(); k++)
+   {
+      VarSet vsSkip = mVElim;
+      for (size_t k2 = k + 1; k2 < nInputs; k2++)
+         vsSkip.Add(mFactors[k2]->GetExtendedVarSet());
+      maps[k].Init(mFactors[k]->GetExtendedVarSet(), newExtendedVs, vsSkip);
+   }
+   std::vector<InstanceId> elimExtended;
+   for (InstanceId e = 0; bClauses && e < nElim; e++)
+   {
+      InstanceId ext = 0;
+      for (VarId vid = mVElim.GetFirst(); vid != 0; vid = mVElim.GetNext(vid))
+         ext += newExtendedVs.GetInstanceComponent(vid, mVElim.FetchVarState(vid, e));
+      elimExtended.push_back(ext);
+   }
+   if (bClauses)
+      FactorPool::Acquire(res.mExtendedClauseVector, maxRes);
+
+   // sparse input with fewest stored rows per result row drives the product
+   int nDriver = -1;
+   for (size_t k = 0; k < nInputs; k++)
+   {
+      if (mFactors[k]->IsSparse() && (nDriver < 0 || mFactors[k]->GetFill() < mFactors[nDriver]->GetFill()))
+         nDriver = (int) k;
+   }
+   // zero of rows missing in driver wins max only over nonnegative products
+   if (nDriver >= 0 && (!bMax || !HasNegativeInput()))
+   {
+      RunSparse(bMax, res, pArgMax, (size_t) nDriver, maps, elimExtended);
+      return;
+   }
+
+   // rows not assigned with AddInstance hold 0 so values can be read directly,
+   // quantized and sparse inputs are decoded per row
+   std::vector<std::vector<ValueType> > scratch(nInputs);
+   std::vector<Factor::ValueReader> pVals;
+   for (size_t k = 0; k < nInputs; k++)
+      pVals.push_back(mFactors[k]->GetReader(scratch[k]));
+   ValueType *pRes = res.mValues.data();
+   res.mValuePresent.assign(maxRes, true);
+
+   const InstanceId *pElimOffs = mElimOffs.data();
+   std::vector<int> digits(nOut, 0);
+   std::vector<InstanceId> base(nInputs, 0);
+
+   for (InstanceId i = 0; i < maxRes; i++)
+   {
+      AccumType acc = bMax ? kMinAccum : 0;
+      InstanceId eBest = 0;
+
+      for (InstanceId e = 0; e < nElim; e++)
+      {
+         const InstanceId *pOffs = pElimOffs + e * nInputs;
+         AccumType v = pVals[0][base[0] + pOffs[0]];
+         for (size_t k = 1; k < nInputs; k++)
+            v *= pVals[k][base[k] + pOffs[k]];
+
+         if (!bMax)
+         {
+            acc += v;
+         }
+         else if (acc <= v)
+         {
+            acc = v;
+            eBest = e;
+         }
+      }
+      pRes[i] = (ValueType) acc;
+
+      if (pArgMax)
+      {
+         pArgMax[i] = (VarState) eBest;
+      }
+      else if (bMax)
+      {
+         InstanceId ext = elimExtended[eBest];
+         const InstanceId *pOffs = pElimOffs + eBest * nInputs;
+         for (size_t k = 0; k < maps.size(); k++)
+         {
+            if (!maps[k].mFrom.empty())
+               ext += maps[k].Map(mFactors[k]->GetExtendedClause(base[k] + pOffs[k]));
+         }
+         res.mExtendedClauseVector[i] = ext;
+      }
+
+      NextOutRow(digits, base);
+   }
+   for (auto &v : scratch)
+      FactorPool::Release(v);
+}
+
+bool
+FactorContraction::HasNegativeInput() const
+{
+   // sparse tables never hold negative values
+   for (auto &f : mFactors)
+   {
+      if (f->IsSparse())
+         continue;
+      Factor::ValueReader values(*f);
+      for (InstanceId n = 0; n < f->GetVarSet().GetInstances(); n++)
+      {
+         if (values[n] < 0)
+            return true;
+      }
+   }
+   return false;
+}
+
+void
+FactorContraction::NextOutRow(std::vector<int> &digits, std::vector<InstanceId> &base) const
+{
+   size_t nInputs = mFactors.size();
+   for (size_t n = 0; n < digits.size(); n++)
+   {
+      const InstanceId *pStride = &mOutStride[n * nInputs];
+      if (++digits[n] < mOutDomain[n])
+      {
+         for (size_t k = 0; k < nInputs; k++)
+            base[k] += pStride[k];
+         return;
+      }
+      digits[n] = 0;
+      const InstanceId *pRewind = &mOutRewind[n * nInputs];
+      for (size_t k = 0; k < nInputs; k++)
+         base[k] -= pRewind[k];
+   }
+}
+
+void
+FactorContraction::RunSparse(bool bMax, Factor &res, VarState *pArgMax, size_t nDriver,
+   const std::vector<Factor::ExtendedMap> &maps, const std::vector<InstanceId> &elimExtended)
+{
+   size_t nInputs = mFactors.size();
+   InstanceId maxRes = mVOut.GetInstances();
+   InstanceId nElim = mVElim.GetInstances();
+   const Factor &d = *mFactors[nDriver];
+   const VarDb &db = mVOut.GetDb();
+
+   // multiplier of every variable in result, in eliminated clause and in every input;
+   // variables of driver are decoded from its row, the others are walked by odometer
+   struct Axis
+   {
+      int mDomain;
+      InstanceId mDrive;
+      InstanceId mOut;
+      InstanceId mElim;
+      std::vector<InstanceId> mIn;
+   };
+   std::vector<Axis> driven, rest;
+   VarSet vsAll = mVOut.Disjuction(mVElim);
+   for (VarId id = vsAll.GetFirst(); id != 0; id = vsAll.GetNext(id))
+   {
+      Axis a;
+      a.mDomain = db.GetDomainSize(id);
+      a.mOut = mVOut.HasVar(id) ? mVOut.GetInstanceComponent(id, 1) : 0;
+      a.mElim = mVElim.HasVar(id) ? mVElim.GetInstanceComponent(id, 1) : 0;
+      a.mIn.assign(nInputs, 0);
+      for (size_t k = 0; k < nInputs; k++)
+      {
+         const VarSet &vs = mFactors[k]->GetVarSet();
+         if (vs.HasVar(id))
+            a.mIn[k] = vs.GetInstanceComponent(id, 1);
+      }
+      a.mDrive = a.mIn[nDriver];
+      if (a.mDrive)
+         driven.push_back(a);
+      else
+         rest.push_back(a);
+   }
+
+   std::vector<std::vector<ValueType> > scratch(nInputs);
+   std::vector<Factor::ValueReader> pVals;
+   for (size_t k = 0; k < nInputs; k++)
+      pVals.push_back(k == nDriver ? Factor::ValueReader(d.mValues.data()) : mFactors[k]->GetReader(scratch[k]));
+
+   // rows no stored row reaches keep 0 and the last eliminated clause, as in Run
+   std::vector<AccumType> acc(maxRes, 0);
+   std::vector<InstanceId> best(bMax ? maxRes : 0, nElim - 1);
+   std::vector<InstanceId> base(nInputs);
+   std::vector<int> digits(rest.size());
+   for (size_t n = 0; n < d.mSparseRows.size(); n++)
+   {
+      InstanceId row = d.mSparseRows[n];
+      InstanceId out = 0;
+      InstanceId e = 0;
+      std::fill(base.begin(), base.end(), 0);
+      for (auto &a : driven)
+      {
+         InstanceId state = row / a.mDrive % a.mDomain;
+         out += state * a.mOut;
+         e += state * a.mElim;
+         for (size_t k = 0; k < nInputs; k++)
+            base[k] += state * a.mIn[k];
+      }
+
+      std::fill(digits.begin(), digits.end(), 0);
+      for (;;)
+      {
+         AccumType v = d.mValues[n];
+         for (size_t k = 0; k < nInputs; k++)
+         {
+            if (k != nDriver)
+               v *= pVals[k][base[k]];
+         }
+         if (!bMax)
+         {
+            acc[out] += v;
+         }
+         else if (v > acc[out] || (v == acc[out] && e > best[out]))
+         {
+            acc[out] = v;
+            best[out] = e;
+         }
+
+         size_t j = 0;
+         for (; j < rest.size(); j++)
+         {
+            Axis &a = rest[j];
+            if (++digits[j] < a.mDomain)
+            {
+               out += a.mOut;
+               e += a.mElim;
+               for (size_t k = 0; k < nInputs; k++)
+                  base[k] += a.mIn[k];
+               break;
+            }
+            digits[j] = 0;
+            out -= a.mOut * (a.mDomain - 1);
+            e -= a.mElim * (a.mDomain - 1);
+            for (size_t k = 0; k < nInputs; k++)
+               base[k] -= a.mIn[k] * (a.mDomain - 1);
+         }
+         if (j == rest.size())
+            break;
+      }
+   }
+   for (auto &v : scratch)
+      FactorPool::Release(v);
+
+   for (InstanceId i = 0; i < maxRes; i++)
+      res.mValues[i] = (ValueType) acc[i];
+   res.mValuePresent.assign(maxRes, true);
+   if (!bMax)
+      return;
+   if (pArgMax)
+   {
+      for (InstanceId i = 0; i < maxRes; i++)
+         pArgMax[i] = (VarState) best[i];
+      return;
+   }
+
+   // extended clauses of winning rows, inputs are walked as in Run
+   std::vector<int> digitsOut(mVOut.GetSize(), 0);
+   std::fill(base.begin(), base.end(), 0);
+   for (InstanceId i = 0; i < maxRes; i++)
+   {
+      InstanceId ext = elimExtended[best[i]];
+      const InstanceId *pOffs = mElimOffs.data() + best[i] * nInputs;
+      for (size_t k = 0; k < maps.size(); k++)
+      {
+         if (!maps[k].mFrom.empty())
+            ext += maps[k].Map(mFactors[k]->GetExtendedClause(base[k] + pOffs[k]));
+      }
+      res.mExtendedClauseVector[i] = ext;
+      NextOutRow(digitsOut, base);
+   }
+}
+
+void
+FactorContraction::RunBatch(bool bMax, const std::vector<const ValueType *> &inputs,
+   const std::vector<bool> &batched, size_t nBatch, ValueType *pRes, InstanceId *pArgMax) const
+{
+   DBC_CHECK(inputs.size() == mFactors.size(), "Batch inputs do not match contraction");
+
+   size_t nInputs = inputs.size();
+   int nOut = mVOut.GetSize();
+   InstanceId maxRes = mVOut.GetInstances();
+   InstanceId nElim = mVElim.GetInstances();
+
+   const InstanceId *pElimOffs = mElimOffs.data();
+   std::vector<int> digits(nOut, 0);
+   std::vector<InstanceId> base(nInputs, 0);
+   std::vector<ValueType> prod(nBatch);
+   ValueType *pProd = prod.data();
+
+   // shared quantized inputs are decoded once for the whole batch
+   std::vector<const ValueType *> pVals(inputs);
+   std::vector<std::vector<ValueType> > scratch(nInputs);
+   for (size_t k = 0; k < nInputs; k++)
+   {
+      if (!batched[k])
+         pVals[k] = mFactors[k]->GetDenseValues(scratch[k]);
+   }
+
+   for (InstanceId i = 0; i < maxRes; i++)
+   {
+      ValueType *pAcc = pRes + i * nBatch;
+      InstanceId *pArg = bMax ? pArgMax + i * nBatch : 0;
+      for (size_t b = 0; b < nBatch; b++)
+         pAcc[b] = bMax ? kMinValue : 0;
+      if (bMax)
+      {
+         for (size_t b = 0; b < nBatch; b++)
+            pArg[b] = 0;
+      }
+
+      for (InstanceId e = 0; e < nElim; e++)
+      {
+         // product of inputs for all batch elements, shared inputs are broadcast
+         const InstanceId *pOffs = pElimOffs + e * nInputs;
+         for (size_t k = 0; k < nInputs; k++)
+         {
+            InstanceId row = base[k] + pOffs[k];
+            if (batched[k])
+            {
+               const ValueType *pIn = pVals[k] + row * nBatch;
+               if (k == 0)
+               {
+                  for (size_t b = 0; b < nBatch; b++)
+                     pProd[b] = pIn[b];
+               }
+               else
+               {
+                  for (size_t b = 0; b < nBatch; b++)
+                     pProd[b] *= pIn[b];
+               }
+            }
+            else
+            {
+               ValueType v = pVals[k][row];
+               if (k == 0)
+               {
+                  for (size_t b = 0; b < nBatch; b++)
+                     pProd[b] = v;
+               }
+               else
+               {
+                  for (size_t b = 0; b < nBatch; b++)
+                     pProd[b] *= v;
+               }
+            }
+         }
+
+         if (!bMax)
+         {
+            for (size_t b = 0; b < nBatch; b++)
+               pAcc[b] += pProd[b];
+            continue;
+         }
+         for (size_t b = 0; b < nBatch; b++)
+         {
+            if (pAcc[b] <= pProd[b])
+            {
+               pAcc[b] = pProd[b];
+               pArg[b] = e;
+            }
+         }
+      }
+
+      NextOutRow(digits, base);
+   }
+   for (auto &v : scratch)
+      FactorPool::Release(v);
+}
@@ -47,6 +47,22 @@ FactorFactory::Create(VarDb &db, Json::Value &vFactorDescrJson)
        ValueType val = (*it).asFloat();
        fl << val;       
     }
+
+    // CPT can be kept in 8 or 16 bit codes after its values are loaded
+    if (vFactorDescrJson.isMember("quant"))
+    {
+       res->Quantize(GetQuantMode(vFactorDescrJson["quant"].asString()));
+    }
+
+    // deterministic and mostly zero CPTs keep their nonzero rows only, "sparse" forces the choice
+    if (vFactorDescrJson.isMember("sparse"))
+    {
+       res->SetSparse(vFactorDescrJson["sparse"].asBool());
+    }
+    else
+    {
+       res->SelectStorage();
+    }
     return res;
 } 
 
@@ -57,3 +73,24 @@ FactorFactory::EmptyFactor(VarDb &db)
    return std::make_shared<Factor>(vs);
 }
 
+std::shared_ptr<Factor>
+FactorFactory::OnesFactor(const VarSet &vs)
+{
+   std::shared_ptr<Factor> res = std::make_shared<Factor>(vs);
+   for (InstanceId n = 0; n < vs.GetInstances(); n++)
+      res->AddInstance(n, 1.0F);
+   return res;
+}
+
+
+QuantMode
+FactorFactory::GetQuantMode(const std::string &sMode)
+{
+   if (sMode == "linear8")
+      return QuantMode_Linear8;
+   if (sMode == "linear16")
+      return QuantMode_Linear16;
+   if (sMode == "log8")
+      return QuantMode_Log8;
+   return QuantMode_None;
+}
@@ -0,0 +1,430 @@
+/*
+* Copyright (C) 2017 Boris Altshul.
+* All rights reserved.
+*
+* The software in this package is published under the terms of the BSD
+* style license a copy of which has been included with this distribution in
+* the LICENSE.txt file.
+*/
+
+#include "FactorKernels.h"
+#include <limits>
+
+// vector kernels work on float tables, double tables use scalar ones
+#if defined(BAYES_VALUE_DOUBLE)
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define BAYES_SIMD_X86
+#define BAYES_TARGET_SSE2 __attribute__((target("sse2")))
+#define BAYES_TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define BAYES_SIMD_X86
+#define BAYES_TARGET_SSE2
+#define BAYES_TARGET_AVX2
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+using namespace bayeslib;
+
+// smallest value used as starting point of max-out, same as in scalar MaximizeVar
+static const ValueType kMinValue = -std::numeric_limits<ValueType>::max();
+
+///////////////////////////////////////////////////////////////////////////////
+// Scalar kernels
+
+static void
+SumOutScalar(const ValueType *pIn, ValueType *pOut,
+   InstanceId nOuter, int nElim, InstanceId nInner)
+{
+   InstanceId rowSize = nInner * nElim;
+   for (InstanceId o = 0; o < nOuter; o++, pIn += rowSize, pOut += nInner)
+   {
+      for (InstanceId i = 0; i < nInner; i++)
+      {
+         AccumType valSum = 0;
+         const ValueType *p = pIn + i;
+         for (int e = 0; e < nElim; e++, p += nInner)
+         {
+            valSum += *p;
+         }
+         pOut[i] = (ValueType) valSum;
+      }
+   }
+}
+
+// max of one column of nElim values placed nStride apart
+static inline void
+MaxOutColumn(const ValueType *p, InstanceId nStride, int nElim, ValueType *pOut, VarState *pArgMax)
+{
+   ValueType valMax = kMinValue;
+   VarState varStateMax = 0;
+   for (int e = 0; e < nElim; e++, p += nStride)
+   {
+      if (valMax <= *p)
+      {
+         valMax = *p;
+         varStateMax = (VarState)e;
+      }
+   }
+   *pOut = valMax;
+   *pArgMax = varStateMax;
+}
+
+static void
+MaxOutScalar(const ValueType *pIn, ValueType *pOut, VarState *pArgMax,
+   InstanceId nOuter, int nElim, InstanceId nInner)
+{
+   InstanceId rowSize = nInner * nElim;
+   for (InstanceId o = 0; o < nOuter; o++, pIn += rowSize, pOut += nInner, pArgMax += nInner)
+   {
+      for (InstanceId i = 0; i < nInner; i++)
+      {
+         MaxOutColumn(pIn + i, nInner, nElim, pOut + i, pArgMax + i);
+      }
+   }
+}
+
+#ifdef BAYES_SIMD_X86
+
+///////////////////////////////////////////////////////////////////////////////
+// SSE2 kernels, 4 lanes
+
+#ifndef BAYES_ACCUM_DOUBLE
+BAYES_TARGET_SSE2 static void
+SumOutSse2(const ValueType *pIn, ValueType *pOut,
+   InstanceId nOuter, int nElim, InstanceId nInner)
+{
+   if (nInner < 4 && !(nInner == 1 && nElim >= 8))
+   {
+      SumOutScalar(pIn, pOut, nOuter, nElim, nInner);
+      return;
+   }
+
+   InstanceId rowSize = nInner * nElim;
+   for (InstanceId o = 0; o < nOuter; o++, pIn += rowSize, pOut += nInner)
+   {
+      if (nInner == 1)
+      {
+         // contiguous: reduce whole row horizontally
+         __m128 acc = _mm_setzero_ps();
+         int e = 0;
+         for (; e + 4 <= nElim; e += 4)
+         {
+            acc = _mm_add_ps(acc, _mm_loadu_ps(pIn + e));
+         }
+         float lanes[4];
+         _mm_storeu_ps(lanes, acc);
+         ValueType valSum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+         for (; e < nElim; e++)
+         {
+            valSum += pIn[e];
+         }
+         pOut[0] = valSum;
+         continue;
+      }
+
+      // strided: add rows of nInner values vertically
+      InstanceId i = 0;
+      for (; i + 4 <= nInner; i += 4)
+      {
+         __m128 acc = _mm_setzero_ps();
+         const ValueType *p = pIn + i;
+         for (int e = 0; e < nElim; e++, p += nInner)
+         {
+            acc = _mm_add_ps(acc, _mm_loadu_ps(p));
+         }
+         _mm_storeu_ps(pOut + i, acc);
+      }
+      for (; i < nInner; i++)
+      {
+         ValueType valSum = 0;
+         const ValueType *p = pIn + i;
+         for (int e = 0; e < nElim; e++, p += nInner)
+         {
+            valSum += *p;
+         }
+         pOut[i] = valSum;
+      }
+   }
+}
+#endif
+
+BAYES_TARGET_SSE2 static void
+MaxOutSse2(const ValueType *pIn, ValueType *pOut, VarState *pArgMax,
+   InstanceId nOuter, int nElim, InstanceId nInner)
+{
+   if (nInner < 4 && !(nInner == 1 && nElim >= 8))
+   {
+      MaxOutScalar(pIn, pOut, pArgMax, nOuter, nElim, nInner);
+      return;
+   }
+
+   InstanceId rowSize = nInner * nElim;
+   for (InstanceId o = 0; o < nOuter; o++, pIn += rowSize, pOut += nInner, pArgMax += nInner)
+   {
+      if (nInner == 1)
+      {
+         // contiguous: per lane maximum, then pick best lane
+         __m128 vMax = _mm_set1_ps(kMinValue);
+         __m128i vArg = _mm_setzero_si128();
+         int e = 0;
+         for (; e + 4 <= nElim; e += 4)
+         {
+            __m128 v = _mm_loadu_ps(pIn + e);
+            __m128 mask = _mm_cmple_ps(vMax, v);
+            __m128i maskI = _mm_castps_si128(mask);
+            vMax = _mm_or_ps(_mm_and_ps(mask, v), _mm_andnot_ps(mask, vMax));
+            vArg = _mm_or_si128(_mm_and_si128(maskI, _mm_set_epi32(e + 3, e + 2, e + 1, e)), _mm_andnot_si128(maskI, vArg));
+         }
+         float lanes[4];
+         s32 args[4];
+         _mm_storeu_ps(lanes, vMax);
+         _mm_storeu_si128((__m128i *) args, vArg);
+         ValueType valMax = lanes[0];
+         s32 varStateMax = args[0];
+         for (int l = 1; l < 4; l++)
+         {
+            // equal values resolved to highest state as in scalar kernel
+            if (valMax < lanes[l] || (valMax == lanes[l] && varStateMax < args[l]))
+            {
+               valMax = lanes[l];
+               varStateMax = args[l];
+            }
+         }
+         for (; e < nElim; e++)
+         {
+            if (valMax <= pIn[e])
+            {
+               valMax = pIn[e];
+               varStateMax = e;
+            }
+         }
+         pOut[0] = valMax;
+         pArgMax[0] = (VarState)varStateMax;
+         continue;
+      }
+
+      InstanceId i = 0;
+      for (; i + 4 <= nInner; i += 4)
+      {
+         __m128 vMax = _mm_set1_ps(kMinValue);
+         __m128i vArg = _mm_setzero_si128();
+         const ValueType *p = pIn + i;
+         for (int e = 0; e < nElim; e++, p += nInner)
+         {
+            __m128 v = _mm_loadu_ps(p);
+            __m128 mask = _mm_cmple_ps(vMax, v);
+            __m128i maskI = _mm_castps_si128(mask);
+            vMax = _mm_or_ps(_mm_and_ps(mask, v), _mm_andnot_ps(mask, vMax));
+            vArg = _mm_or_si128(_mm_and_si128(maskI, _mm_set1_epi32(e)), _mm_andnot_si128(maskI, vArg));
+         }
+         _mm_storeu_ps(pOut + i, vMax);
+         s32 args[4];
+         _mm_storeu_si128((__m128i *) args, vArg);
+         for (int l = 0; l < 4; l++)
+         {
+            pArgMax[i + l] = (VarState)args[l];
+         }
+      }
+      for (; i < nInner; i++)
+      {
+         MaxOutColumn(pIn + i, nInner, nElim, pOut + i, pArgMax + i);
+      }
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AVX2 kernels, 8 lanes
+
+#ifndef BAYES_ACCUM_DOUBLE
+BAYES_TARGET_AVX2 static void
+SumOutAvx2(const ValueType *pIn, ValueType *pOut,
+   InstanceId nOuter, int nElim, InstanceId nInner)
+{
+   if (nInner < 8)
+   {
+      SumOutSse2(pIn, pOut, nOuter, nElim, nInner);
+      return;
+   }
+
+   InstanceId rowSize = nInner * nElim;
+   for (InstanceId o = 0; o < nOuter; o++, pIn += rowSize, pOut += nInner)
+   {
+      InstanceId i = 0;
+      for (; i + 8 <= nInner; i += 8)
+      {
+         __m256 acc = _mm256_setzero_ps();
+         const ValueType *p = pIn + i;
+         for (int e = 0; e < nElim; e++, p += nInner)
+         {
+            acc = _mm256_add_ps(acc, _mm256_loadu_ps(p));
+         }
+         _mm256_storeu_ps(pOut + i, acc);
+      }
+      for (; i < nInner; i++)
+      {
+         ValueType valSum = 0;
+         const ValueType *p = pIn + i;
+         for (int e = 0; e < nElim; e++, p += nInner)
+         {
+            valSum += *p;
+         }
+         pOut[i] = valSum;
+      }
+   }
+}
+#endif
+
+BAYES_TARGET_AVX2 static void
+MaxOutAvx2(const ValueType *pIn, ValueType *pOut, VarState *pArgMax,
+   InstanceId nOuter, int nElim, InstanceId nInner)
+{
+   if (nInner < 8)
+   {
+      MaxOutSse2(pIn, pOut, pArgMax, nOuter, nElim, nInner);
+      return;
+   }
+
+   InstanceId rowSize = nInner * nElim;
+   for (InstanceId o = 0; o < nOuter; o++, pIn += rowSize, pOut += nInner, pArgMax += nInner)
+   {
+      InstanceId i = 0;
+      for (; i + 8 <= nInner; i += 8)
+      {
+         __m256 vMax = _mm256_set1_ps(kMinValue);
+         __m256 vArg = _mm256_setzero_ps();    // integer lanes kept in float register
+         const ValueType *p = pIn + i;
+         for (int e = 0; e < nElim; e++, p += nInner)
+         {
+            __m256 v = _mm256_loadu_ps(p);
+            __m256 mask = _mm256_cmp_ps(vMax, v, _CMP_LE_OQ);
+            vMax = _mm256_blendv_ps(vMax, v, mask);
+            vArg = _mm256_blendv_ps(vArg, _mm256_castsi256_ps(_mm256_set1_epi32(e)), mask);
+         }
+         _mm256_storeu_ps(pOut + i, vMax);
+         s32 args[8];
+         _mm256_storeu_si256((__m256i *) args, _mm256_castps_si256(vArg));
+         for (int l = 0; l < 8; l++)
+         {
+            pArgMax[i + l] = (VarState)args[l];
+         }
+      }
+      for (; i < nInner; i++)
+      {
+         MaxOutColumn(pIn + i, nInner, nElim, pOut + i, pArgMax + i);
+      }
+   }
+}
+
+static KernelIsa
+DetectIsa()
+{
+#if defined(_MSC_VER)
+   int info[4];
+   __cpuid(info, 0);
+   int nIds = info[0];
+   __cpuid(info, 1);
+   bool bSse2 = (info[3] & (1 << 26)) != 0;
+   bool bOsXSave = (info[2] & (1 << 27)) != 0;
+   bool bAvx = (info[2] & (1 << 28)) != 0;
+   bool bAvx2 = false;
+   if (nIds >= 7 && bOsXSave && bAvx)
+   {
+      __cpuidex(info, 7, 0);
+      // ymm state has to be enabled by OS
+      bAvx2 = (info[1] & (1 << 5)) != 0 && (_xgetbv(0) & 6) == 6;
+   }
+#else
+   __builtin_cpu_init();
+   bool bSse2 = __builtin_cpu_supports("sse2") != 0;
+   bool bAvx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+   if (bAvx2)
+      return KernelIsa_Avx2;
+   if (bSse2)
+      return KernelIsa_Sse2;
+   return KernelIsa_Scalar;
+}
+
+#else
+
+static KernelIsa
+DetectIsa()
+{
+   return KernelIsa_Scalar;
+}
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// runtime dispatch
+
+static KernelIsa &
+CurrentIsa()
+{
+   static KernelIsa isa = FactorKernels::GetSupportedIsa();
+   return isa;
+}
+
+KernelIsa
+FactorKernels::GetSupportedIsa()
+{
+   static KernelIsa isa = DetectIsa();
+   return isa;
+}
+
+KernelIsa
+FactorKernels::GetIsa()
+{
+   return CurrentIsa();
+}
+
+KernelIsa
+FactorKernels::SetIsa(KernelIsa isa)
+{
+   if (isa > GetSupportedIsa())
+      isa = GetSupportedIsa();
+   CurrentIsa() = isa;
+   return isa;
+}
+
+void
+FactorKernels::SumOut(const ValueType *pIn, ValueType *pOut,
+   InstanceId nOuter, int nElim, InstanceId nInner)
+{
+   switch (CurrentIsa())
+   {
+#if defined(BAYES_SIMD_X86) && !defined(BAYES_ACCUM_DOUBLE)
+   case KernelIsa_Avx2:
+      SumOutAvx2(pIn, pOut, nOuter, nElim, nInner);
+      break;
+   case KernelIsa_Sse2:
+      SumOutSse2(pIn, pOut, nOuter, nElim, nInner);
+      break;
+#endif
+   default:
+      SumOutScalar(pIn, pOut, nOuter, nElim, nInner);
+      break;
+   }
+}
+
+void
+FactorKernels::MaxOut(const ValueType *pIn, ValueType *pOut, VarState *pArgMax,
+   InstanceId nOuter, int nElim, InstanceId nInner)
+{
+   switch (CurrentIsa())
+   {
+#ifdef BAYES_SIMD_X86
+   case KernelIsa_Avx2:
+      MaxOutAvx2(pIn, pOut, pArgMax, nOuter, nElim, nInner);
+      break;
+   case KernelIsa_Sse2:
+      MaxOutSse2(pIn, pOut, pArgMax, nOuter, nElim, nInner);
+      break;
+#endif
+   default:
+      MaxOutScalar(pIn, pOut, pArgMax, nOuter, nElim, nInner);
+      break;
+   }
+}
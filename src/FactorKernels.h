@@ -0,0 +1,69 @@
+/*
+* Copyright (C) 2017 Boris Altshul.
+* All rights reserved.
+*
+* The software in this package is published under the terms of the BSD
+* style license a copy of which has been included with this distribution in
+* the LICENSE.txt file.
+*/
+
+#ifndef __FACTOR_KERNELS_H
+#define __FACTOR_KERNELS_H
+
+#include "common.h"
+
+/**
+@file
+@brief Vectorized reduction kernels over Factor value tables
+*/
+
+namespace bayeslib
+{
+   /// Instruction set used by reduction kernels
+   /// @ingroup API
+   enum KernelIsa
+   {
+      KernelIsa_Scalar = 0,      ///< portable C++ implementation
+      KernelIsa_Sse2 = 1,        ///< 4 lanes, x86 SSE2
+      KernelIsa_Avx2 = 2         ///< 8 lanes, x86 AVX2
+   };
+
+   /// Reduction kernels used by Factor::EliminateVar and Factor::MaximizeVar.
+   /// Factor table is viewed as 3 dimensional array [outer][elim][inner] where
+   /// elim is the domain of the variable being reduced and inner is its multiplier
+   /// in the VarSet. Result is 2 dimensional array [outer][inner].
+   /// inner == 1 is contiguous case (reduced variable is first in the VarSet),
+   /// otherwise rows of #inner values are reduced vertically.
+   /// Best instruction set is selected at runtime
+   /// @ingroup API
+   class FactorKernels
+   {
+   public:
+      /// Sum out the elim dimension
+      /// @param pIn input table of nOuter*nElim*nInner values
+      /// @param pOut output table of nOuter*nInner values
+      static void SumOut(const ValueType *pIn, ValueType *pOut,
+         InstanceId nOuter, int nElim, InstanceId nInner);
+
+      /// Max out the elim dimension and record winning state of the eliminated variable.
+      /// Ties are resolved to the highest state
+      /// @param pIn input table of nOuter*nElim*nInner values
+      /// @param pOut output table of nOuter*nInner values
+      /// @param pArgMax output table of nOuter*nInner states of eliminated variable
+      static void MaxOut(const ValueType *pIn, ValueType *pOut, VarState *pArgMax,
+         InstanceId nOuter, int nElim, InstanceId nInner);
+
+      /// Get instruction set currently used by the kernels
+      static KernelIsa GetIsa();
+
+      /// Best instruction set supported by this CPU
+      static KernelIsa GetSupportedIsa();
+
+      /// Force instruction set, value is clamped to what is supported by the CPU
+      /// @param isa requested instruction set
+      /// @return instruction set that will be used
+      static KernelIsa SetIsa(KernelIsa isa);
+   };
+}
+
+#endif
@@ -19,61 +19,68 @@ FactorMergeHelper::FactorMergeHelper(const VarSet &v1,
 {
     int offs1=0;
     int offs2=0;
-    int offsr=0;
-    
 
     for(VarId id = mV1.GetFirst(); id != 0; id = mV1.GetNext(id))
     {
         mVr.Add(id);
-        mMap_Offs1_OffsR[offs1]=offsr;
-        mMap_OffsR_Offs1[offsr]=offs1;
-        
-        offs2 = mV2.GetOffs(id);
-        if(offs2 >= 0)
-        {
-            mMap_Offs1_Offs2[offs1] = offs2;
-            mMap_Offs2_OffsR[offs2] = offsr;
-            mMap_OffsR_Offs2[offsr] = offs2;
-        }
-        
-        offsr++;
+        mOffsR_Offs1.push_back(offs1);
+        mOffsR_Offs2.push_back(mV2.GetOffs(id));
         offs1++;
     }
 
     offs2 = 0;
     for(VarId id = mV2.GetFirst(); id!=0; id=mV2.GetNext(id))
     {
-        offs1 = mV1.GetOffs(id);
-        if (offs1 >= 0)
-        {
-            // already taken care of
-            ;
-        }
-        else
+        if (mV1.GetOffs(id) < 0)
         {
             mVr.Add(id);
-            mMap_Offs2_OffsR[offs2] = offsr;
-            mMap_OffsR_Offs2[offsr] = offs2;
-            offsr++;
+            mOffsR_Offs1.push_back(-1);
+            mOffsR_Offs2.push_back(offs2);
         }
         offs2++;
-        
     }
 
+    // compile strides of both operands in order of merged varset
+    int nSize = mVr.GetSize();
+    mDomain.resize(nSize);
+    mStride1.resize(nSize);
+    mStride2.resize(nSize);
+    mRewind1.resize(nSize);
+    mRewind2.resize(nSize);
+
+    int n = 0;
+    for(VarId id = mVr.GetFirst(); id != 0; id = mVr.GetNext(id), n++)
+    {
+        InstanceId multiplier = 0;
+        int varSize = 0;
+        mVr.GetVarParams(id, multiplier, varSize);
+        mDomain[n] = varSize;
+
+        mStride1[n] = 0;
+        if (mOffsR_Offs1[n] >= 0)
+           mV1.GetVarParams(id, mStride1[n], varSize);
+
+        mStride2[n] = 0;
+        if (mOffsR_Offs2[n] >= 0)
+           mV2.GetVarParams(id, mStride2[n], varSize);
+
+        mRewind1[n] = mStride1[n] * (mDomain[n] - 1);
+        mRewind2[n] = mStride2[n] * (mDomain[n] - 1);
+    }
 }
 
 int 
 FactorMergeHelper::MapOffsRTo1(int n)
 {
-    if(mMap_OffsR_Offs1.count(n))
-        return mMap_OffsR_Offs1[n];
+    if(n >= 0 && n < (int) mOffsR_Offs1.size())
+        return mOffsR_Offs1[n];
     return -1;    
 }
 
 int
 FactorMergeHelper::MapOffsRTo2(int n)
 {
-    if(mMap_OffsR_Offs2.count(n))
-        return mMap_OffsR_Offs2[n];
+    if(n >= 0 && n < (int) mOffsR_Offs2.size())
+        return mOffsR_Offs2[n];
     return -1;    
 }
@@ -0,0 +1,210 @@
+/*
+* Copyright (C) 2017 Boris Altshul.
+* All rights reserved.
+*
+* The software in this package is published under the terms of the BSD
+* style license a copy of which has been included with this distribution in
+* the LICENSE.txt file.
+*/
+
+#include "factor.h"
+#include <algorithm>
+
+using namespace bayeslib;
+
+/// Free tables of one element type, table of class c holds at least 2^c elements
+template<class T>
+using FreeLists = std::vector<std::vector<std::vector<T> > >;
+
+/// Pool of one thread
+struct PoolState
+{
+   PoolState();
+   ~PoolState();
+
+   FreeLists<ValueType> mValues;
+   FreeLists<bool> mPresent;
+   FreeLists<InstanceId> mIds;
+   size_t mBytes;
+   size_t mRetainedBytes;
+   u64 mHits;
+   u64 mMisses;
+};
+
+// plain pointer stays valid to read while thread local objects are destroyed
+static thread_local PoolState *tlpActive = nullptr;
+static thread_local int tlDepth = 0;
+
+static PoolState &
+LocalState()
+{
+   static thread_local PoolState state;
+   return state;
+}
+
+PoolState::PoolState() : mBytes(0), mRetainedBytes(64 << 20), mHits(0), mMisses(0)
+{
+}
+
+PoolState::~PoolState()
+{
+   tlpActive = nullptr;
+}
+
+template<class T> static FreeLists<T> &Lists(PoolState &state);
+template<> FreeLists<ValueType> &Lists<ValueType>(PoolState &state) { return state.mValues; }
+template<> FreeLists<bool> &Lists<bool>(PoolState &state) { return state.mPresent; }
+template<> FreeLists<InstanceId> &Lists<InstanceId>(PoolState &state) { return state.mIds; }
+
+template<class T> static size_t
+TableBytes(const std::vector<T> &v)
+{
+   return v.capacity() * sizeof(T);
+}
+
+template<> size_t
+TableBytes<bool>(const std::vector<bool> &v)
+{
+   return v.capacity() / 8;
+}
+
+/// Smallest c with 2^c >= n
+static size_t
+ClassOf(size_t n)
+{
+   size_t c = 0;
+   while (((size_t) 1 << c) < n)
+      c++;
+   return c;
+}
+
+/// Drop largest tables first until pool holds no more than bytes
+template<class T> static void
+Trim(PoolState &state, size_t bytes)
+{
+   FreeLists<T> &lists = Lists<T>(state);
+   for (size_t c = lists.size(); c-- > 0 && state.mBytes > bytes; )
+   {
+      while (!lists[c].empty() && state.mBytes > bytes)
+      {
+         state.mBytes -= TableBytes(lists[c].back());
+         lists[c].pop_back();
+      }
+   }
+}
+
+static void
+TrimAll(PoolState &state, size_t bytes)
+{
+   Trim<ValueType>(state, bytes);
+   Trim<InstanceId>(state, bytes);
+   Trim<bool>(state, bytes);
+}
+
+FactorPool::Scope::Scope()
+{
+   if (tlDepth++ == 0)
+      tlpActive = &LocalState();
+}
+
+FactorPool::Scope::~Scope()
+{
+   if (--tlDepth == 0)
+   {
+      TrimAll(LocalState(), LocalState().mRetainedBytes);
+      tlpActive = nullptr;
+   }
+}
+
+template<class T> void
+FactorPool::Acquire(std::vector<T> &v, size_t n)
+{
+   PoolState *pState = tlpActive;
+   if (!pState || v.capacity() >= n)
+   {
+      v.assign(n, T());
+      return;
+   }
+
+   // next class is taken too, so one table serves sizes a bit over its class;
+   // vector<bool> never holds less than a word, its small tables share one class
+   static const size_t minClass = ClassOf(std::vector<T>(1).capacity() + 1) - 1;
+   FreeLists<T> &lists = Lists<T>(*pState);
+   size_t c = std::max(ClassOf(n), minClass);
+   for (size_t cTry = c; cTry < c + 2 && cTry < lists.size(); cTry++)
+   {
+      if (!lists[cTry].empty())
+      {
+         v.swap(lists[cTry].back());
+         lists[cTry].pop_back();
+         pState->mBytes -= TableBytes(v);
+         pState->mHits++;
+         v.assign(n, T());
+         return;
+      }
+   }
+   pState->mMisses++;
+   v.clear();
+   v.reserve((size_t) 1 << c);
+   v.assign(n, T());
+}
+
+template<class T> void
+FactorPool::Release(std::vector<T> &v)
+{
+   PoolState *pState = tlpActive;
+   if (!pState || v.capacity() == 0)
+   {
+      std::vector<T>().swap(v);
+      return;
+   }
+
+   // largest c with 2^c <= capacity
+   size_t c = ClassOf(v.capacity() + 1) - 1;
+   FreeLists<T> &lists = Lists<T>(*pState);
+   if (lists.size() <= c)
+      lists.resize(c + 1);
+   pState->mBytes += TableBytes(v);
+   lists[c].push_back(std::vector<T>());
+   lists[c].back().swap(v);
+   v.clear();
+}
+
+template void FactorPool::Acquire<ValueType>(std::vector<ValueType> &, size_t);
+template void FactorPool::Acquire<bool>(std::vector<bool> &, size_t);
+template void FactorPool::Acquire<InstanceId>(std::vector<InstanceId> &, size_t);
+template void FactorPool::Release<ValueType>(std::vector<ValueType> &);
+template void FactorPool::Release<bool>(std::vector<bool> &);
+template void FactorPool::Release<InstanceId>(std::vector<InstanceId> &);
+
+void
+FactorPool::SetRetainedBytes(size_t bytes)
+{
+   LocalState().mRetainedBytes = bytes;
+   if (!tlDepth)
+      TrimAll(LocalState(), bytes);
+}
+
+size_t
+FactorPool::GetFreeBytes()
+{
+   return LocalState().mBytes;
+}
+
+u64
+FactorPool::GetHits()
+{
+   return LocalState().mHits;
+}
+
+u64
+FactorPool::GetMisses()
+{
+   return LocalState().mMisses;
+}
+
+void
+FactorPool::Clear()
+{
+   TrimAll(LocalState(), 0);
+}
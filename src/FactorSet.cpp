@@ -10,26 +10,161 @@
 
 #include "factor.h"
 #include "json/json.h"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
 
 using namespace bayeslib;
 
+/// Rows of Factor over VarSet, in double as bad orders do not fit InstanceId
+static double
+InstancesOf(const VarSet &vs)
+{
+   double res = 1;
+   for (VarId id = vs.GetFirst(); id != 0; id = vs.GetNext(id))
+      res *= vs.GetDb().GetDomainSize(id);
+   return res;
+}
 
-FactorSet::FactorSet(VarDb &db) : mDb(db), mDebugLevel(0)
+/// Components whose summed largest cliques stay below this many rows are solved inline,
+/// spawning workers costs more than contracting them
+static const double kMinParallelInstances = 65536;
+
+/// Run jobs 0..nTasks-1 on up to nThreads workers, calling thread is one of them
+static void
+RunOnPool(size_t nTasks, int nThreads, const std::function<void(size_t)> &job)
 {
+   if (nThreads <= 0)
+      nThreads = (int) std::thread::hardware_concurrency();
+   size_t nWorkers = std::min(nTasks, (size_t) std::max(nThreads, 1));
 
+   std::atomic<size_t> next(0);
+   auto worker = [&]()
+   {
+      FactorPool::Scope poolScope;
+      for (size_t n = next++; n < nTasks; n = next++)
+         job(n);
+   };
+
+   std::vector<std::thread> threads;
+   for (size_t n = 1; n < nWorkers; n++)
+      threads.emplace_back(worker);
+   worker();
+   for (auto &t : threads)
+      t.join();
+}
+
+
+FactorSet::FactorSet(VarDb &db) : mDb(db), mDebugLevel(0), mElimPlanning(true),
+   mElimOrder(db), mPredictedPeakInstances(0), mFrontOrdinal(0), mBackOrdinal(0), mDagValid(false)
+{
+
+}
+
+FactorSet::FactorSet(const FactorSet &fs) : mDb(fs.mDb), mDebugLevel(fs.mDebugLevel),
+   mElimPlanning(fs.mElimPlanning), mElimOrder(fs.mElimOrder),
+   mPredictedPeakInstances(fs.mPredictedPeakInstances), mFrontOrdinal(0), mBackOrdinal(0),
+   mArgMaxSteps(fs.mArgMaxSteps), mDagValid(false)
+{
+   for (auto &f : fs.mFactors)
+      PushFactor(f);
 }
 
 
 void 
 FactorSet::AddFactor(std::shared_ptr<Factor> f)
 {
-   mFactors.push_back(f);
+   PushFactor(f);
+}
+
+void
+FactorSet::PushFactor(std::shared_ptr<Factor> f, bool bFront)
+{
+   ListFactors::iterator iter;
+   s64 ordinal;
+   mDagValid = false;
+   if (bFront)
+   {
+      iter = mFactors.insert(mFactors.begin(), f);
+      ordinal = --mFrontOrdinal;
+   }
+   else
+   {
+      iter = mFactors.insert(mFactors.end(), f);
+      ordinal = mBackOrdinal++;
+   }
+
+   const VarSet &vs = f->GetVarSet();
+   for (VarId id = vs.GetFirst(); id != 0; id = vs.GetNext(id))
+   {
+      std::vector<BucketEntry> &bucket = mBuckets[id];
+      if (bFront)
+         bucket.insert(bucket.begin(), BucketEntry(ordinal, iter));
+      else
+         bucket.push_back(BucketEntry(ordinal, iter));
+   }
+}
+
+FactorSet::ListFactors::iterator
+FactorSet::EraseFactor(ListFactors::iterator iter)
+{
+   mDagValid = false;
+   const VarSet &vs = (*iter)->GetVarSet();
+   for (VarId id = vs.GetFirst(); id != 0; id = vs.GetNext(id))
+   {
+      std::vector<BucketEntry> &bucket = mBuckets[id];
+      for (auto it = bucket.begin(); it != bucket.end(); ++it)
+      {
+         if (it->second == iter)
+         {
+            bucket.erase(it);
+            break;
+         }
+      }
+   }
+   return mFactors.erase(iter);
+}
+
+std::vector<FactorSet::ListFactors::iterator>
+FactorSet::GetBucket(const VarSet &vs) const
+{
+   std::vector<BucketEntry> entries;
+   for (VarId id = vs.GetFirst(); id != 0; id = vs.GetNext(id))
+   {
+      auto itBucket = mBuckets.find(id);
+      if (itBucket != mBuckets.end())
+         entries.insert(entries.end(), itBucket->second.begin(), itBucket->second.end());
+   }
+   if (vs.GetSize() > 1)
+   {
+      std::sort(entries.begin(), entries.end(),
+         [](const BucketEntry &e1, const BucketEntry &e2) { return e1.first < e2.first; });
+      entries.erase(std::unique(entries.begin(), entries.end(),
+         [](const BucketEntry &e1, const BucketEntry &e2) { return e1.first == e2.first; }),
+         entries.end());
+   }
+
+   std::vector<ListFactors::iterator> res;
+   for (auto &e : entries)
+      res.push_back(e.second);
+   return res;
+}
+
+std::vector<std::shared_ptr<Factor> >
+FactorSet::GetFactors(VarId id) const
+{
+   std::vector<std::shared_ptr<Factor> > res;
+   for (auto iter : GetBucket(VarSet(mDb, id)))
+      res.push_back(*iter);
+   return res;
 }
 
 // multiply all variables
 std::shared_ptr<Factor> 
 FactorSet::Merge()
 {
+    FactorPool::Scope poolScope;
     std::shared_ptr<Factor> res;
     bool bFirst = true;
 
@@ -52,9 +187,57 @@ FactorSet::Merge()
 
     if (!res)
        res = std::make_shared<Factor>(VarSet(mDb)); 
+
+    // single Factor is shared with the list, clauses go to a copy
+    if (!mArgMaxSteps.empty())
+    {
+       res = std::make_shared<Factor>(*res);
+       TraceBack(*res);
+    }
     return res;
 }
 
+void
+FactorSet::TraceBack(Factor &res) const
+{
+   // Factors maximized outside of FactorSet keep their own extended clauses
+   const VarSet vsOld = res.GetExtendedVarSet();
+   const VarSet &vsRes = res.GetVarSet();
+   VarSet vsExt = vsOld;
+   for (auto &step : mArgMaxSteps)
+      vsExt.Add(step.mVar);
+
+   std::vector<VarState> states(mDb.GetVarSet().GetSize() + 1, 0);
+   std::vector<InstanceId> clauses(vsRes.GetInstances());
+   for (InstanceId r = 0; r < vsRes.GetInstances(); r++)
+   {
+      std::fill(states.begin(), states.end(), 0);
+      for (VarId id = vsRes.GetFirst(); id != 0; id = vsRes.GetNext(id))
+         states[id] = vsRes.FetchVarState(id, r);
+      InstanceId e = res.GetExtendedClause(r);
+      for (VarId id = vsOld.GetFirst(); id != 0; id = vsOld.GetNext(id))
+         states[id] = vsOld.FetchVarState(id, e);
+
+      // last maximized variable depends only on variables left in result
+      for (auto it = mArgMaxSteps.rbegin(); it != mArgMaxSteps.rend(); ++it)
+      {
+         InstanceId n = 0;
+         for (VarId id = it->mScope.GetFirst(); id != 0; id = it->mScope.GetNext(id))
+            n += it->mScope.GetInstanceComponent(id, states[id]);
+         states[it->mVar] = it->mArgMax[n];
+      }
+
+      InstanceId ext = 0;
+      for (VarId id = vsExt.GetFirst(); id != 0; id = vsExt.GetNext(id))
+         ext += vsExt.GetInstanceComponent(id, states[id]);
+      clauses[r] = ext;
+   }
+
+   res.SetExtendedVarSet(vsExt);
+   for (InstanceId r = 0; r < vsRes.GetInstances(); r++)
+      res.AddExtendedClause(r, clauses[r]);
+}
+
 
 std::shared_ptr<VarSet>
 FactorSet::GetTypedVarSet(VarId vid, VarType vartype, VarDb &db)
@@ -85,41 +268,121 @@ FactorSet::GetVarSet() const
 	return res;
 }
 
-std::shared_ptr<VarSet> 
-FactorSet::GetAncestors(VarId vid)
+void
+FactorSet::BuildDagIndex()
 {
-	Factor *pTestFactor = 0;
+   mDagParents.clear();
+   mDagChildren.clear();
+   mDagAncestors.clear();
+   mDagOrder.clear();
 
-	for (ListFactors::iterator iter = mFactors.begin();
-		iter != mFactors.end(); ++iter)
-	{
-		const VarSet &vs = iter->get()->GetClauseHead();
-		if (vs.HasVar(vid))
-		{
-			pTestFactor = iter->get();
-			break;
-		}
-	}
+   // first Factor with variable in its head defines the parents
+   for (auto &f : mFactors)
+   {
+      const VarSet &vsHead = f->GetClauseHead();
+      for (VarId id = vsHead.GetFirst(); id != 0; id = vsHead.GetNext(id))
+      {
+         if (mDagParents.find(id) == mDagParents.end())
+            mDagParents.emplace(id, f->GetVarSetTail());
+      }
+   }
+   for (auto &parents : mDagParents)
+   {
+      const VarSet &vsParents = parents.second;
+      for (VarId p = vsParents.GetFirst(); p != 0; p = vsParents.GetNext(p))
+      {
+         auto iter = mDagChildren.find(p);
+         if (iter == mDagChildren.end())
+            iter = mDagChildren.emplace(p, VarSet(mDb)).first;
+         iter->second.Add(parents.first);
+      }
+   }
 
+   // depth first walk to parents, variable is finished after all its parents,
+   // variables on the stack are not entered again so a cycle can not loop forever
+   std::shared_ptr<VarSet> vsAll = GetVarSet();
+   std::map<VarId, bool> finished;
+   std::vector<std::pair<VarId, VarId> > stack;   // variable and last visited parent
+   for (VarId root = vsAll->GetFirst(); root != 0; root = vsAll->GetNext(root))
+   {
+      if (finished.count(root))
+         continue;
+      finished[root] = false;
+      stack.push_back(std::make_pair(root, (VarId) 0));
 
+      while (!stack.empty())
+      {
+         VarId id = stack.back().first;
+         auto itParents = mDagParents.find(id);
+         VarId next = 0;
+         if (itParents != mDagParents.end())
+         {
+            const VarSet &vsParents = itParents->second;
+            VarId last = stack.back().second;
+            next = last == 0 ? vsParents.GetFirst() : vsParents.GetNext(last);
+            while (next != 0 && finished.count(next))
+               next = vsParents.GetNext(next);
+         }
+         if (next != 0)
+         {
+            stack.back().second = next;
+            finished[next] = false;
+            stack.push_back(std::make_pair(next, (VarId) 0));
+            continue;
+         }
 
-	std::shared_ptr<VarSet> res(new VarSet(mDb));
+         // same VarSet as recursive walk: parents, then ancestors of every parent
+         VarSet vsAncestors(mDb);
+         if (itParents != mDagParents.end())
+         {
+            const VarSet &vsParents = itParents->second;
+            vsAncestors.Add(vsParents);
+            for (VarId p = vsParents.GetFirst(); p != 0; p = vsParents.GetNext(p))
+            {
+               auto itAncestors = mDagAncestors.find(p);
+               if (itAncestors != mDagAncestors.end())
+                  vsAncestors.Add(itAncestors->second);
+            }
+         }
+         mDagAncestors.emplace(id, vsAncestors);
+         mDagOrder.push_back(id);
+         finished[id] = true;
+         stack.pop_back();
+      }
+   }
+   mDagValid = true;
+}
 
-	if (!pTestFactor)
-	{
-		return res;
-	}
+std::shared_ptr<VarSet> 
+FactorSet::GetAncestors(VarId vid)
+{
+   if (!mDagValid)
+      BuildDagIndex();
+
+   auto iter = mDagAncestors.find(vid);
+   if (iter == mDagAncestors.end())
+      return std::make_shared<VarSet>(mDb);
+   return std::make_shared<VarSet>(iter->second);
+}
 
-	// Walk up the tree
-	VarSet vsLookup = pTestFactor->GetVarSetTail();
-	res->MergeIn(vsLookup);
+VarSet
+FactorSet::GetParents(VarId vid)
+{
+   if (!mDagValid)
+      BuildDagIndex();
 
-	// B.A. need optimization not to run through the Vars already in the varset 
-	for (VarId v = vsLookup.GetFirst(); v != 0; v = vsLookup.GetNext(v))
-	{
-		res->MergeIn(*(GetAncestors(v).get()));
-	}
-	return res;
+   auto iter = mDagParents.find(vid);
+   if (iter == mDagParents.end())
+      return VarSet(mDb);
+   return iter->second;
+}
+
+const std::vector<VarId> &
+FactorSet::GetTopologicalOrder()
+{
+   if (!mDagValid)
+      BuildDagIndex();
+   return mDagOrder;
 }
 
 
@@ -150,10 +413,192 @@ FactorSet::GetAncestors(VarId vid, VarType vartype)
 
 
 
+VarSet
+FactorSet::PlanElimOrder(const VarSet &vs, bool bMax)
+{
+   if (vs.GetSize() == 0)
+   {
+      mElimOrder = vs;
+      mPredictedPeakInstances = 0;
+      return mElimOrder;
+   }
+
+   std::vector<VarSet> scopes;
+   std::vector<bool> skip;
+   for (auto &f : mFactors)
+   {
+      scopes.push_back(f->GetVarSet());
+      skip.push_back(!bMax && f->GetFactorType() == VarType_Decision);
+   }
+
+   std::vector<VarSet> candidates = { vs };
+
+   // a single variable has one order, only its bucket is replayed for the peak;
+   // variables kept by the caller stay in the graph, orders cover #vs only
+   if (vs.GetSize() > 1)
+   {
+      InteractionGraph ig(this);
+      for (int h = ElimHeuristic_MinDegree; h <= ElimHeuristic_MinSize; h++)
+      {
+         VarSet vsOrder = ig.GetElimOrder((ElimHeuristic) h, vs);
+         vsOrder.Add(vs);
+         candidates.push_back(vsOrder);
+      }
+   }
+
+   // replay buckets of EliminateVar on VarSets only, cost is rows visited by contractions
+   size_t nBest = 0;
+   double bestCost = 0;
+   double bestPeak = 0;
+   for (size_t n = 0; n < candidates.size(); n++)
+   {
+      std::vector<VarSet> live(scopes);
+      std::vector<bool> liveSkip(skip);
+      std::vector<bool> alive(scopes.size(), true);
+      std::map<VarId, std::vector<size_t> > scopesOfVar;
+      for (size_t k = 0; k < live.size(); k++)
+      {
+         for (VarId id = live[k].GetFirst(); id != 0; id = live[k].GetNext(id))
+            scopesOfVar[id].push_back(k);
+      }
+
+      double cost = 0;
+      double peak = 0;
+      const VarSet &vsOrder = candidates[n];
+      for (VarId id = vsOrder.GetFirst(); id != 0; id = vsOrder.GetNext(id))
+      {
+         VarSet vsBucket(mDb);
+         bool bFound = false;
+         for (size_t k : scopesOfVar[id])
+         {
+            if (!alive[k] || liveSkip[k])
+               continue;
+            vsBucket.Add(live[k]);
+            alive[k] = false;
+            bFound = true;
+         }
+         if (!bFound)
+            continue;
+         cost += InstancesOf(vsBucket);
+         vsBucket.Remove(id);
+         peak = std::max(peak, InstancesOf(vsBucket));
+
+         for (VarId idB = vsBucket.GetFirst(); idB != 0; idB = vsBucket.GetNext(idB))
+            scopesOfVar[idB].push_back(live.size());
+         live.push_back(vsBucket);
+         liveSkip.push_back(false);
+         alive.push_back(true);
+      }
+
+      if (n == 0 || cost < bestCost)
+      {
+         nBest = n;
+         bestCost = cost;
+         bestPeak = peak;
+      }
+   }
+
+   mElimOrder = candidates[nBest];
+   mPredictedPeakInstances = bestPeak;
+   return mElimOrder;
+}
+
+std::vector<std::shared_ptr<FactorSet> >
+FactorSet::GetComponents() const
+{
+   // union find over Factors, first Factor of every variable joins the others
+   std::vector<size_t> parent;
+   std::map<VarId, size_t> owner;
+   std::function<size_t(size_t)> find = [&parent, &find](size_t n)
+   {
+      return parent[n] == n ? n : parent[n] = find(parent[n]);
+   };
+
+   std::vector<std::shared_ptr<Factor> > factors(mFactors.begin(), mFactors.end());
+   for (size_t n = 0; n < factors.size(); n++)
+   {
+      parent.push_back(n);
+      const VarSet &vs = factors[n]->GetVarSet();
+      for (VarId id = vs.GetFirst(); id != 0; id = vs.GetNext(id))
+      {
+         auto iter = owner.find(id);
+         if (iter == owner.end())
+         {
+            owner[id] = n;
+            continue;
+         }
+         size_t r1 = find(iter->second);
+         size_t r2 = find(n);
+         if (r1 != r2)
+            parent[std::max(r1, r2)] = std::min(r1, r2);
+      }
+   }
+
+   // root is the first Factor of its component
+   std::vector<std::shared_ptr<FactorSet> > res;
+   std::map<size_t, size_t> componentOfRoot;
+   for (size_t n = 0; n < factors.size(); n++)
+   {
+      size_t r = find(n);
+      if (componentOfRoot.find(r) == componentOfRoot.end())
+      {
+         componentOfRoot[r] = res.size();
+         std::shared_ptr<FactorSet> fs = std::make_shared<FactorSet>(mDb);
+         fs->SetElimPlanning(mElimPlanning);
+         fs->SetDebugLevel(mDebugLevel);
+         res.push_back(fs);
+      }
+      res[componentOfRoot[r]]->AddFactor(factors[n]);
+   }
+   return res;
+}
+
+std::shared_ptr<Factor>
+FactorSet::SolveComponents(const VarSet &vsEliminate, const VarSet &vsMaximize, 
+   int nThreads) const
+{
+   std::vector<std::shared_ptr<FactorSet> > components = GetComponents();
+   std::vector<std::shared_ptr<Factor> > results(components.size());
+
+   if (components.size() > 1 && nThreads <= 0)
+   {
+      double work = 0;
+      for (size_t n = 0; n < components.size() && work < kMinParallelInstances; n++)
+      {
+         InteractionGraph ig(components[n].get());
+         ig.GetElimOrder();
+         work += ig.GetMaxCliqueInstances();
+      }
+      if (work < kMinParallelInstances)
+         nThreads = 1;
+   }
+
+   // components share no variables, so workers never touch the same Factor
+   RunOnPool(components.size(), nThreads, [&](size_t n)
+   {
+      FactorSet &fs = *components[n];
+      std::shared_ptr<VarSet> vsComponent = fs.GetVarSet();
+      fs.EliminateVar(vsEliminate.Conjuction(*vsComponent));
+      fs.MaximizeVar(vsMaximize.Conjuction(*vsComponent));
+      results[n] = fs.Merge();
+   });
+
+   if (results.empty())
+      return std::make_shared<Factor>(VarSet(mDb));
+   std::shared_ptr<Factor> res = results[0];
+   for (size_t n = 1; n < results.size(); n++)
+      res = res->Merge(results[n]);
+   return res;
+}
+
 void  
-FactorSet::EliminateVar(const VarSet &vs)
+FactorSet::EliminateVar(const VarSet &vsEliminate)
 {
-   std::string s = vs.GetJson(mDb);
+   // merged Factors of every bucket give their tables to the next bucket
+   FactorPool::Scope poolScope;
+   mElimOrder = mElimPlanning ? PlanElimOrder(vsEliminate, false) : vsEliminate;
+   const VarSet &vs = mElimOrder;
+
 	if(mDebugLevel >= DebugLevel_Details) 
 	{
       std::string s = vs.GetJson(mDb);
@@ -162,38 +607,29 @@ FactorSet::EliminateVar(const VarSet &vs)
 
     for(VarId id = vs.GetFirst(); id != 0; id = vs.GetNext(id))
     {
-        FactorSet fs(mDb);
-        for(ListFactors::iterator iter = mFactors.begin();
-            iter != mFactors.end(); )
+        std::vector<std::shared_ptr<Factor> > bucket;
+        for(ListFactors::iterator iter : GetBucket(VarSet(mDb, id)))
         {
-            std::shared_ptr<Factor> f = *iter;
-            if(f->GetFactorType() != VarType_Decision && f->GetVarSet().HasVar(id))
-            {
-                fs.AddFactor(f);
-                iter = mFactors.erase(iter);
-            } 
-            else
+            if((*iter)->GetFactorType() != VarType_Decision)
             {
-                ++iter;
+                bucket.push_back(*iter);
+                EraseFactor(iter);
             }
         }
 
-        if (fs.IsEmpty())
+        if (bucket.empty())
         {
            continue;
         }
 
-        std::shared_ptr<Factor> f = fs.Merge();
-
-        //std::string s = f->GetJson();
-        //printf("===SubMerge %d ===\n%s\n", id, s.c_str());
-
-        std::shared_ptr<Factor> f2 = f->EliminateVar(id);
-        // s = f2->GetJson();
+        // multiply and sum out in one pass, product of the bucket is never built
+        FactorContraction contraction(bucket, VarSet(mDb, id));
+        std::shared_ptr<Factor> f2 = contraction.Sum();
+        // std::string s = f2->GetJson();
         // printf("===SubEliminate %d ===\n%s\n", id, s.c_str());
 
 
-        mFactors.push_back(f2);
+        PushFactor(f2);
 
 		if (mDebugLevel >= DebugLevel_Details)
 		{
@@ -208,41 +644,51 @@ FactorSet::EliminateVar(const VarSet &vs)
 }
 
 void 
-FactorSet::MaximizeVar(const VarSet &vs)
+FactorSet::MaximizeVar(const VarSet &vsMaximize)
 {
+   FactorPool::Scope poolScope;
+   mElimOrder = mElimPlanning ? PlanElimOrder(vsMaximize, true) : vsMaximize;
+   const VarSet &vs = mElimOrder;
+
    for (VarId id = vs.GetFirst(); id != 0; id = vs.GetNext(id))
    {
-      FactorSet fs(mDb);
-      for (ListFactors::iterator iter = mFactors.begin();
-         iter != mFactors.end(); )
+      std::vector<std::shared_ptr<Factor> > bucket;
+      for (ListFactors::iterator iter : GetBucket(VarSet(mDb, id)))
       {
-         if (iter->get()->GetVarSet().HasVar(id))
-         {
-            fs.AddFactor(*iter);
-            iter = mFactors.erase(iter);
-         }
-         else
-         {
-            ++iter;
-         }
+         bucket.push_back(*iter);
+         EraseFactor(iter);
       }
 
-      if (fs.IsEmpty())
+      if (bucket.empty())
       {
          continue;
       }
 
-      std::shared_ptr<Factor> f = fs.Merge();
-
-      // std::string s = f->GetJson();
-      // printf("===SubMerge %d ===\n%s\n", id, s.c_str());
-
-      std::shared_ptr<Factor> f2 = f->MaximizeVar(id);
+      // multiply and max out in one pass, Factors maximized outside of FactorSet 
+      // carry extended clauses further, others record backpointer table only
+      FactorContraction contraction(bucket, VarSet(mDb, id));
+      bool bExtended = false;
+      for (auto &f : bucket)
+      {
+         if (f->HasExtendedInfo() || !f->GetExtendedVarSet().IsEmpty())
+            bExtended = true;
+      }
+      std::shared_ptr<Factor> f2;
+      if (bExtended)
+      {
+         f2 = contraction.Max();
+      }
+      else
+      {
+         f2 = contraction.CreateResult();
+         mArgMaxSteps.push_back(ArgMaxStep(id, f2->GetVarSet()));
+         contraction.Max(*f2, mArgMaxSteps.back().mArgMax);
+      }
       // s = f2->GetJson();
       // printf("===SubEliminate %d ===\n%s\n", id, s.c_str());
 
 
-      mFactors.push_back(f2);
+      PushFactor(f2);
 
       //s = this->GetJson();
       // printf("===Eliminate %d ===\n%s\n", id, s.c_str());
@@ -400,8 +846,8 @@ FactorSet::BuildDecision()
             // Remove maxed VarId from pResult and insert this 
             // factor into this FactorSet
             pResult->EraseExtendedInfo();
-            mFactors.erase(iter2);
-            mFactors.push_back(pResult);
+            EraseFactor(iter2);
+            PushFactor(pResult);
 			break;
          }
       }
@@ -412,7 +858,7 @@ FactorSet::BuildDecision()
 	  {
 		if ((*iter2)->GetClauseHead().HasVar(vidDecision))
 		{
-			iter2 = mFactors.erase(iter2);
+			iter2 = EraseFactor(iter2);
 			break;
 		}
 	  }
@@ -429,20 +875,78 @@ FactorSet::BuildDecision()
 void 
 FactorSet::RemoveVars(const VarSet &vs)
 {
-    for(ListFactors::iterator iter = mFactors.begin();
-                iter != mFactors.end(); )
+    // head is part of VarSet, only buckets of vs are checked
+    for(ListFactors::iterator iter : GetBucket(vs))
     {
         if ((*iter)->GetClauseHead().HasVar(vs))            
         {
-            iter = mFactors.erase(iter);
+            EraseFactor(iter);
         } 
-        else
-        {
-            ++iter;
-        }
     }
 } 
 
+VarSet
+FactorSet::PruneRequisite(const VarSet &vsQuery, const Clause &evidence)
+{
+   if (!mDagValid)
+      BuildDagIndex();
+   const VarSet &vsEvidence = evidence.GetVarSet();
+
+   // Bayes-Ball: ball passes through unobserved variables and bounces back from 
+   // observed ones reached from a parent, top mark makes Factor of variable requisite
+   VarSet vsTop(mDb);
+   VarSet vsBottom(mDb);
+   std::vector<std::pair<VarId, bool> > schedule;   // variable and visit from child
+   for (VarId id = vsQuery.GetFirst(); id != 0; id = vsQuery.GetNext(id))
+      schedule.push_back(std::make_pair(id, true));
+
+   while (!schedule.empty())
+   {
+      VarId id = schedule.back().first;
+      bool bFromChild = schedule.back().second;
+      schedule.pop_back();
+
+      bool bObserved = vsEvidence.HasVar(id);
+      if (bFromChild != bObserved && !vsTop.HasVar(id))
+      {
+         vsTop.Add(id);
+         auto iter = mDagParents.find(id);
+         if (iter != mDagParents.end())
+         {
+            const VarSet &vs = iter->second;
+            for (VarId p = vs.GetFirst(); p != 0; p = vs.GetNext(p))
+               schedule.push_back(std::make_pair(p, true));
+         }
+      }
+      if (!bObserved && !vsBottom.HasVar(id))
+      {
+         vsBottom.Add(id);
+         auto iter = mDagChildren.find(id);
+         if (iter != mDagChildren.end())
+         {
+            const VarSet &vs = iter->second;
+            for (VarId c = vs.GetFirst(); c != 0; c = vs.GetNext(c))
+               schedule.push_back(std::make_pair(c, false));
+         }
+      }
+   }
+
+   // Factors without head are results of earlier eliminations and always kept
+   VarSet res(mDb);
+   for (ListFactors::iterator iter = mFactors.begin(); iter != mFactors.end(); )
+   {
+      const VarSet &vsHead = (*iter)->GetClauseHead();
+      if (vsHead.IsEmpty() || vsHead.HasVar(vsTop))
+      {
+         ++iter;
+         continue;
+      }
+      res.Add(vsHead);
+      iter = EraseFactor(iter);
+   }
+   return res;
+}
+
 void
 FactorSet::PruneVars(const VarSet &vs)
 {
@@ -461,7 +965,7 @@ FactorSet::PruneVars(const VarSet &vs)
          if (!vsF.HasVar(vs) && vsLeafNodes->HasVar(vsF) )
          {
             bPruned = true;
-            iter = mFactors.erase(iter);
+            iter = EraseFactor(iter);
          }
          else
          {
@@ -476,36 +980,79 @@ void
 FactorSet::PruneEdges(const Clause &c)
 {
    VarSet vs = c.GetVarSet();
-   ListFactors tmpListNewFactors;
+   std::vector<std::shared_ptr<Factor> > newFactors;
 
-   for (ListFactors::iterator iter = mFactors.begin();
-      iter != mFactors.end(); )
+   for (ListFactors::iterator iter : GetBucket(vs))
    {
       std::shared_ptr<Factor> pFactor = *iter;
-      VarSet vsTail = pFactor->GetVarSetTail();
+      VarSet vsTail = pFactor->GetVarSetTail().Conjuction(vs);
 
-      if (vsTail.HasVar(vs))
+      // all observed parents are sliced at once, observed head keeps its rows
+      if (!vsTail.IsEmpty())
       {
-         std::shared_ptr<Factor> newFactor = pFactor;
-         iter = mFactors.erase(iter);
-         for (VarId v = vs.GetFirst(); v != 0; v = vs.GetNext(v))
-         {
-            if (vsTail.HasVar(v))
-
-            {
-               newFactor = newFactor->PruneEdge(v, c.GetVar(v));
-            }
-         }
-        
-         tmpListNewFactors.push_back(newFactor);
+         EraseFactor(iter);
+         newFactors.push_back(pFactor->Slice(Clause(vsTail, c.GetInstanceId(vsTail))));
       }
-      else
+   }
+
+   // pruned Factors go in front, in their original order
+   for (auto it = newFactors.rbegin(); it != newFactors.rend(); ++it)
+      PushFactor(*it, true);
+
+}
+
+void
+FactorSet::SliceEvidence(const Clause &c)
+{
+   mDagValid = false;
+   const VarSet &vs = c.GetVarSet();
+   for (ListFactors::iterator iter : GetBucket(vs))
+   {
+      *iter = (*iter)->Slice(c);
+   }
+
+   // no Factor keeps observed variables, other buckets hold the same iterators
+   for (VarId id = vs.GetFirst(); id != 0; id = vs.GetNext(id))
+      mBuckets.erase(id);
+}
+
+int
+FactorSet::Quantize(QuantMode mode)
+{
+   int nRes = 0;
+   for (ListFactors::iterator iter = mFactors.begin(); iter != mFactors.end(); ++iter)
+   {
+      if ((*iter)->GetFactorType() == VarType_Decision || (*iter)->GetQuantMode() != QuantMode_None)
+         continue;
+      std::shared_ptr<Factor> q = std::make_shared<Factor>(**iter);
+      if (q->Quantize(mode))
       {
-         ++iter;
+         *iter = q;
+         nRes++;
       }
    }
-   mFactors.insert(mFactors.begin(), tmpListNewFactors.begin(), tmpListNewFactors.end());
+   return nRes;
+}
 
+int
+FactorSet::SelectStorage(double maxFill)
+{
+   int nRes = 0;
+   for (ListFactors::iterator iter = mFactors.begin(); iter != mFactors.end(); ++iter)
+   {
+      if ((*iter)->GetFactorType() == VarType_Decision)
+         continue;
+      bool bSparse = maxFill >= 0 && (*iter)->GetFill() <= maxFill;
+      if (bSparse == (*iter)->IsSparse())
+         continue;
+      std::shared_ptr<Factor> f = std::make_shared<Factor>(**iter);
+      if (f->SetSparse(bSparse))
+      {
+         *iter = f;
+         nRes++;
+      }
+   }
+   return nRes;
 }
 
 
@@ -513,27 +1060,199 @@ FactorSet::PruneEdges(const Clause &c)
 void 
 FactorSet::ApplyClause(const Clause &c)
 {
-
-    ListFactors tmpF;
-
-    for(ListFactors::iterator iter = mFactors.begin();
-                iter != mFactors.end(); ++iter)
+    // reduced Factor keeps VarSet of original one, so it replaces it in place
+    mDagValid = false;
+    for(ListFactors::iterator iter : GetBucket(c.GetVarSet()))
     {
-        std::shared_ptr<Factor>  &f(*iter);
-        if(f->GetVarSet().HasVar(c.GetVarSet()))
-        {
-            std::shared_ptr<Factor> f1 = f->ApplyClause(c);
-            if(!f1->IsEmpty())
-               tmpF.push_back(f1);
-        }
+        std::shared_ptr<Factor> f1 = (*iter)->ApplyClause(c);
+        if(f1->IsEmpty())
+            EraseFactor(iter);
         else
-        {
-            tmpF.push_back(f);
-        }
+            *iter = f1;
     }        
+}
+
+
+/// K best rows of a bucket result, inputs of model have single entry per row
+struct TopKTable
+{
+   TopKTable(const VarSet &vs, int nK) : mVs(vs), mK(nK), mVar(0),
+      mVals(vs.GetInstances() * nK, 0) {}
+
+   /// Row of this table selected by states of its variables
+   InstanceId Row(const std::vector<VarState> &states) const
+   {
+      InstanceId res = 0;
+      for (VarId id = mVs.GetFirst(); id != 0; id = mVs.GetNext(id))
+         res += mVs.GetInstanceComponent(id, states[id]);
+      return res;
+   }
 
-    mFactors = tmpF;
+   VarSet mVs;
+   int mK;
+   VarId mVar;                   // maximized variable, 0 for Factor of model
+   std::vector<size_t> mInputs;  // tables multiplied by this bucket
+   std::vector<ValueType> mVals; // [row][rank] descending, missing ranks hold 0
+   std::vector<int> mBack;       // [row][rank] state of mVar followed by rank in every input
+};
 
+/// Candidate product with ranks of its factors
+struct TopKCandidate
+{
+   ValueType mVal;
+   std::vector<int> mBack;
+};
+
+/// Multiply candidates by every nonzero entry of row and keep K best
+static void
+TopKExtend(std::vector<TopKCandidate> &cands, const TopKTable &t, InstanceId row, int nK)
+{
+   std::vector<TopKCandidate> res;
+   for (auto &c : cands)
+   {
+      for (int r = 0; r < t.mK; r++)
+      {
+         ValueType v = c.mVal * t.mVals[row * t.mK + r];
+         if (v <= 0)
+            break;
+         res.push_back(c);
+         res.back().mVal = v;
+         res.back().mBack.push_back(r);
+      }
+   }
+   auto better = [](const TopKCandidate &c1, const TopKCandidate &c2) { return c1.mVal > c2.mVal; };
+   if (res.size() > (size_t) nK)
+   {
+      std::partial_sort(res.begin(), res.begin() + nK, res.end(), better);
+      res.resize(nK);
+   }
+   else
+   {
+      std::sort(res.begin(), res.end(), better);
+   }
+   cands.swap(res);
+}
+
+std::vector<std::shared_ptr<Factor> >
+FactorSet::TopKMPE(int nK)
+{
+   std::vector<std::shared_ptr<Factor> > res;
+   if (nK <= 0)
+      return res;
+
+   // every Factor of model is a table with one rank
+   std::vector<TopKTable> tables;
+   std::list<size_t> live;
+   for (auto &f : mFactors)
+   {
+      TopKTable t(f->GetVarSet(), 1);
+      for (InstanceId n = 0; n < t.mVs.GetInstances(); n++)
+         t.mVals[n] = f->Get(n);
+      live.push_back(tables.size());
+      tables.push_back(t);
+   }
+
+   std::shared_ptr<VarSet> vsAll = GetVarSet();
+   VarSet vsOrder = mElimPlanning ? PlanElimOrder(*vsAll, true) : *vsAll;
+   std::vector<VarState> states(mDb.GetVarSet().GetSize() + 1, 0);
+
+   for (VarId id = vsOrder.GetFirst(); id != 0; id = vsOrder.GetNext(id))
+   {
+      std::vector<size_t> bucket;
+      VarSet vsBucket(mDb);
+      for (auto iter = live.begin(); iter != live.end(); )
+      {
+         if (tables[*iter].mVs.HasVar(id))
+         {
+            bucket.push_back(*iter);
+            vsBucket.Add(tables[*iter].mVs);
+            iter = live.erase(iter);
+         }
+         else
+         {
+            ++iter;
+         }
+      }
+      if (bucket.empty())
+         continue;
+
+      int domain = mDb.GetDomainSize(id);
+      TopKTable t(vsBucket.Substract(VarSet(mDb, id)), nK);
+      t.mVar = id;
+      t.mInputs = bucket;
+      t.mBack.assign(t.mVals.size() * (1 + bucket.size()), 0);
+
+      for (InstanceId row = 0; row < t.mVs.GetInstances(); row++)
+      {
+         for (VarId vid = t.mVs.GetFirst(); vid != 0; vid = t.mVs.GetNext(vid))
+            states[vid] = t.mVs.FetchVarState(vid, row);
+
+         std::vector<TopKCandidate> best;
+         for (int state = 0; state < domain; state++)
+         {
+            states[id] = (VarState) state;
+            TopKCandidate start = { 1, std::vector<int>(1, state) };
+            std::vector<TopKCandidate> cands(1, start);
+            for (size_t k : bucket)
+               TopKExtend(cands, tables[k], tables[k].Row(states), nK);
+            best.insert(best.end(), cands.begin(), cands.end());
+         }
+         std::stable_sort(best.begin(), best.end(),
+            [](const TopKCandidate &c1, const TopKCandidate &c2) { return c1.mVal > c2.mVal; });
+
+         for (int r = 0; r < nK && r < (int) best.size(); r++)
+         {
+            t.mVals[row * nK + r] = best[r].mVal;
+            std::copy(best[r].mBack.begin(), best[r].mBack.end(),
+               t.mBack.begin() + (row * nK + r) * (1 + bucket.size()));
+         }
+      }
+      live.push_back(tables.size());
+      tables.push_back(t);
+   }
+
+   // remaining tables have empty VarSet, their product is the final bucket
+   std::vector<size_t> roots(live.begin(), live.end());
+   TopKCandidate start = { 1, std::vector<int>() };
+   std::vector<TopKCandidate> finals(1, start);
+   for (size_t k : roots)
+      TopKExtend(finals, tables[k], 0, nK);
+
+   for (auto &c : finals)
+   {
+      if (c.mVal <= 0)
+         continue;
+
+      // walk from roots to Factors of model, variables of table are set by its consumers
+      std::fill(states.begin(), states.end(), 0);
+      std::vector<std::pair<size_t, int> > stack;
+      for (size_t n = 0; n < roots.size(); n++)
+         stack.push_back(std::make_pair(roots[n], c.mBack[n]));
+      while (!stack.empty())
+      {
+         const TopKTable &t = tables[stack.back().first];
+         int rank = stack.back().second;
+         stack.pop_back();
+         if (t.mVar == 0)
+            continue;
+
+         size_t nBack = 1 + t.mInputs.size();
+         const int *pBack = &t.mBack[(t.Row(states) * t.mK + rank) * nBack];
+         states[t.mVar] = (VarState) pBack[0];
+         for (size_t n = 0; n < t.mInputs.size(); n++)
+            stack.push_back(std::make_pair(t.mInputs[n], pBack[1 + n]));
+      }
+
+      std::shared_ptr<Factor> f = std::make_shared<Factor>(VarSet(mDb));
+      f->AddInstance(0, c.mVal);
+      f->SetExtendedVarSet(vsOrder);
+      InstanceId ext = 0;
+      for (VarId id = vsOrder.GetFirst(); id != 0; id = vsOrder.GetNext(id))
+         ext += vsOrder.GetInstanceComponent(id, states[id]);
+      f->AddExtendedClause(0, ext);
+      res.push_back(f);
+   }
+   return res;
 }
 
 
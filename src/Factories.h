@@ -20,6 +20,10 @@ namespace bayeslib
       public:
         static std::shared_ptr<Factor> Create(VarDb &db,  Json::Value &vFactorDescrJson);
         static std::shared_ptr<Factor> EmptyFactor(VarDb &db);
+        /// Factor with 1.0 in every row, neutral operand of Merge and FactorContraction
+        static std::shared_ptr<Factor> OnesFactor(const VarSet &vs);
+        /// QuantMode by name "linear8", "linear16" or "log8", QuantMode_None for any other
+        static QuantMode GetQuantMode(const std::string &sMode);
     };
 
     class VarSetFactory
@@ -9,12 +9,57 @@
 
 #include "factor.h"
 #include "json/json.h"
+#include <bitset>
+#include <cmath>
+#include <algorithm>
 
 using namespace bayeslib;
 
-InteractionGraph::InteractionGraph(FactorSet *pFs) : mVarSet(pFs->GetDb())
+static inline int
+BitCount(u64 w)
+{
+   return (int) std::bitset<64>(w).count();
+}
+
+/// Index of lowest set bit of non zero word, de Bruijn multiplication
+static inline int
+LowestBit(u64 w)
+{
+   static const int table[64] = {
+      0, 47, 1, 56, 48, 27, 2, 60, 57, 49, 41, 37, 28, 16, 3, 61,
+      54, 58, 35, 52, 50, 42, 21, 44, 38, 32, 29, 23, 17, 11, 4, 62,
+      46, 55, 26, 59, 40, 36, 15, 53, 34, 51, 20, 43, 31, 22, 10, 45,
+      25, 39, 14, 33, 19, 30, 9, 24, 13, 18, 8, 12, 7, 6, 5, 63 };
+   return table[((w ^ (w - 1)) * 0x03f79d71b4cb0a89ULL) >> 58];
+}
+
+/// Rows of set bits of bitset row
+static void
+SetBits(const u64 *pRow, size_t nWords, std::vector<size_t> &rows)
+{
+   rows.clear();
+   for (size_t w = 0; w < nWords; w++)
+   {
+      for (u64 m = pRow[w]; m; m &= m - 1)
+         rows.push_back(w * 64 + LowestBit(m));
+   }
+}
+
+InteractionGraph::InteractionGraph(FactorSet *pFs) : mVarSet(pFs->GetDb()),
+   mInducedWidth(0), mMaxCliqueInstances(1)
 {
     mVarSet = *pFs->GetVarSet().get();
+
+    std::map<VarId, size_t> rowOfVar;
+    for (VarId id = mVarSet.GetFirst(); id != 0; id = mVarSet.GetNext(id))
+    {
+        rowOfVar[id] = mIds.size();
+        mIds.push_back(id);
+        mLogDomain.push_back(std::log((double) mVarSet.GetDb().GetDomainSize(id)));
+    }
+    mWords = (mIds.size() + 63) / 64;
+    mAdjacency.assign(mIds.size() * mWords, 0);
+
     for(FactorSet::ListFactors::const_iterator iter = pFs->GetFactors().begin();
         iter != pFs->GetFactors().end();
         ++iter)
@@ -22,119 +67,167 @@ InteractionGraph::InteractionGraph(FactorSet *pFs) : mVarSet(pFs->GetDb())
         const VarSet &vs = iter->get()->GetVarSet();
         for(VarId id1 = vs.GetFirst(); id1 != 0; id1 = vs.GetNext(id1))
         {
+            u64 *pRow = &mAdjacency[rowOfVar[id1] * mWords];
             for(VarId id2 = vs.GetFirst(); id2 != 0; id2 = vs.GetNext(id2))
             {
                 if(id1 != id2)
                 {
-                    if(!FindEdge(id1, id2))
-                    {
-                        std::pair<VarId, VarId> v1(id1, id2);
-                        std::pair<VarId, VarId> v2(id2, id1);
-
-                        // insert both definition of edges
-                        mEdges.insert(v1);
-                        mEdges.insert(v2);
-                    }
+                    size_t n2 = rowOfVar[id2];
+                    pRow[n2 / 64] |= (u64) 1 << (n2 % 64);
                 }
             }
-
         }
     }
+}
+
+
+double
+InteractionGraph::ElimCost(ElimHeuristic heuristic, const std::vector<u64> &adj, size_t n,
+   int &nDegree, std::vector<size_t> &neighbours) const
+{
+    const u64 *pRow = &adj[n * mWords];
+    nDegree = 0;
+    for(size_t w = 0; w < mWords; w++)
+        nDegree += BitCount(pRow[w]);
+    if(nDegree == 0 || heuristic == ElimHeuristic_MinDegree)
+        return nDegree;
+
+    SetBits(pRow, mWords, neighbours);
+    double cost = 0;
+    if(heuristic == ElimHeuristic_MinSize)
+    {
+        cost = mLogDomain[n];
+        for(size_t u : neighbours)
+            cost += mLogDomain[u];
+        return cost;
+    }
 
+    // every missing edge between two neighbours is counted from both ends
+    for(size_t u : neighbours)
+    {
+        const u64 *pRowU = &adj[u * mWords];
+        for(size_t w = 0; w < mWords; w++)
+        {
+            u64 missing = pRow[w] & ~pRowU[w];
+            if(w == u / 64)
+                missing &= ~((u64) 1 << (u % 64));
+            if(heuristic == ElimHeuristic_MinFill)
+            {
+                cost += BitCount(missing) * 0.5;
+                continue;
+            }
+            for(; missing; missing &= missing - 1)
+                cost += (mLogDomain[u] + mLogDomain[w * 64 + LowestBit(missing)]) * 0.5;
+        }
+    }
+    return cost;
 }
 
+VarSet
+InteractionGraph::GetElimOrder(ElimHeuristic heuristic)
+{
+    return GetElimOrder(heuristic, mVarSet);
+}
 
 VarSet
-InteractionGraph::GetElimOrder()
+InteractionGraph::GetElimOrder(ElimHeuristic heuristic, const VarSet &vsElim)
 {
     VarSet res(mVarSet.GetDb());
+    size_t nRows = mIds.size();
+    std::vector<u64> adj(mAdjacency);
+
+    // variables kept in the graph are never picked, they only add to costs and cliques
+    std::vector<bool> eliminated(nRows, false);
+    for(size_t n = 0; n < nRows; n++)
+        eliminated[n] = !vsElim.HasVar(mIds[n]);
+    std::vector<size_t> neighbours;
 
-    while(!mEdges.empty())
+    // costs change only within two edges of eliminated variable
+    std::vector<double> costs(nRows, 0);
+    std::vector<int> degrees(nRows, 0);
+    std::vector<bool> dirty(nRows, true);
+
+    mInducedWidth = 0;
+    mMaxCliqueInstances = 1;
+
+    while(true)
     {
-        VarId idMinInteraction = 0;
-        int nMinInteractions = 99999;
-
-        for(VarId idCheck = mVarSet.GetFirst(); idCheck != 0; idCheck = mVarSet.GetNext(idCheck)) {
-            int nCount = mEdges.count(idCheck);
-            if (nCount > 0 && nCount < nMinInteractions) {
-                nMinInteractions = nCount;
-                idMinInteraction = idCheck;
-            }
-        }
-        if(idMinInteraction)
+        // pick row with smallest cost, rows without edges are left for the end
+        size_t nBest = nRows;
+        double bestCost = 0;
+        for(size_t n = 0; n < nRows; n++)
         {
-            mVarSet.Remove(idMinInteraction);
-            res.Add(idMinInteraction);
-            std::pair<EdgesMap::iterator, EdgesMap::iterator> range = mEdges.equal_range(idMinInteraction);
-            std::list<VarId> listRemove;
-            for(EdgesMap::iterator it1 = range.first;
-                it1 != range.second; ++it1)
+            if(eliminated[n])
+                continue;
+            if(dirty[n])
             {
-                // list of merge neighbours
-                listRemove.push_back(it1->second);
+                costs[n] = ElimCost(heuristic, adj, n, degrees[n], neighbours);
+                dirty[n] = false;
             }
-            //remove old edges
-            mEdges.erase(idMinInteraction);
+            if(degrees[n] == 0)
+                continue;
 
-            for(EdgesMap::iterator it2 = mEdges.begin();
-                it2 != mEdges.end(); )
+            if(nBest == nRows || costs[n] < bestCost)
             {
-                if(it2->second == idMinInteraction)
-                {
-                    // merge edges
-                    it2  = mEdges.erase(it2);
-                    // it2 = mEdges.begin();
-                }
-                else
-                {
-                    ++it2;
-                }
+                nBest = n;
+                bestCost = costs[n];
             }
+        }
+        if(nBest == nRows)
+            break;
+
+        // neighbours of eliminated variable become a clique
+        std::vector<u64> clique(adj.begin() + nBest * mWords, adj.begin() + (nBest + 1) * mWords);
+        SetBits(clique.data(), mWords, neighbours);
+        int nCliqueSize = 1 + (int) neighbours.size();
+        double cliqueInstances = mVarSet.GetDb().GetDomainSize(mIds[nBest]);
+        for(size_t u : neighbours)
+        {
+            cliqueInstances *= mVarSet.GetDb().GetDomainSize(mIds[u]);
 
-            // create new edges
-            for(std::list<VarId>::iterator itEdges1 = listRemove.begin(); itEdges1 != listRemove.end(); ++itEdges1)
-            {
-                for(std::list<VarId>::iterator itEdges2 = itEdges1; itEdges2 != listRemove.end(); ++itEdges2)
-                {
-                    if(*itEdges1!=*itEdges2 && !FindEdge(*itEdges1, *itEdges2))
-                    {
-                        mEdges.insert(EdgesMap::value_type(*itEdges1, *itEdges2));
-                    }
-                    if(*itEdges1!=*itEdges2 && !FindEdge(*itEdges2, *itEdges1))
-                    {
-                        mEdges.insert(EdgesMap::value_type(*itEdges2, *itEdges1));
-                    }
-
-
+            u64 *pRowU = &adj[u * mWords];
+            for(size_t w = 0; w < mWords; w++)
+                pRowU[w] |= clique[w];
+            pRowU[u / 64] &= ~((u64) 1 << (u % 64));
+            pRowU[nBest / 64] &= ~((u64) 1 << (nBest % 64));
+        }
+        std::fill(adj.begin() + nBest * mWords, adj.begin() + (nBest + 1) * mWords, 0);
+        eliminated[nBest] = true;
 
-                }
+        for(size_t u : neighbours)
+        {
+            dirty[u] = true;
+            if(heuristic == ElimHeuristic_MinDegree || heuristic == ElimHeuristic_MinSize)
+                continue;
+            const u64 *pRowU = &adj[u * mWords];
+            for(size_t w = 0; w < mWords; w++)
+            {
+                for(u64 m = pRowU[w]; m; m &= m - 1)
+                    dirty[w * 64 + LowestBit(m)] = true;
             }
-
         }
+        res.Add(mIds[nBest]);
 
+        mInducedWidth = std::max(mInducedWidth, nCliqueSize - 1);
+        mMaxCliqueInstances = std::max(mMaxCliqueInstances, cliqueInstances);
     }
-    if(mVarSet.GetSize() == 1)
+
+    // variables without neighbours form cliques of their own
+    size_t nLeft = 0;
+    size_t nLast = 0;
+    for(size_t n = 0; n < nRows; n++)
     {
-        res.Add(mVarSet.GetFirst());
+        if(eliminated[n])
+            continue;
+        nLeft++;
+        nLast = n;
+        mMaxCliqueInstances = std::max(mMaxCliqueInstances,
+            (double) mVarSet.GetDb().GetDomainSize(mIds[n]));
     }
-
-    return res;
-}
-
-bool
-InteractionGraph::FindEdge(VarId id1, VarId id2)
-{
-    std::pair<EdgesMap::iterator, EdgesMap::iterator> range = mEdges.equal_range(id1);
-    for(EdgesMap::iterator it1 = range.first;
-        it1 != range.second; ++it1)
+    if(nLeft == 1)
     {
-        // list of merge neighbours
-        if (it1->second == id2)
-            return true;
+        res.Add(mIds[nLast]);
     }
 
-    return false;
-
+    return res;
 }
-
-
@@ -0,0 +1,318 @@
+/*
+* Copyright (C) 2017 Boris Altshul.
+* All rights reserved.
+*
+* The software in this package is published under the terms of the BSD
+* style license a copy of which has been included with this distribution in
+* the LICENSE.txt file.
+*/
+
+#include "Factories.h"
+#include "json/json.h"
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+using namespace bayeslib;
+
+JunctionTree::JunctionTree(FactorSet &fs) : mDb(fs.GetDb()), mLogEvidence(0)
+{
+   std::vector<std::shared_ptr<Factor> > factors;
+   VarSet vsAll(mDb);
+   for (auto &f : fs.GetFactors())
+   {
+      if (f->GetFactorType() == VarType_Decision)
+         continue;
+      factors.push_back(f);
+      vsAll.Add(f->GetVarSet());
+   }
+
+   // variables without edges are not in elimination order, they go last
+   InteractionGraph ig(&fs);
+   VarSet vsOrder(mDb);
+   VarSet vsElimOrder = ig.GetElimOrder();
+   for (VarId id = vsElimOrder.GetFirst(); id != 0; id = vsElimOrder.GetNext(id))
+   {
+      if (vsAll.HasVar(id))
+         vsOrder.Add(id);
+   }
+   vsOrder.Add(vsAll);
+
+   // moral graph, every variable is its own neighbour
+   std::map<VarId, VarSet> adj;
+   for (VarId id = vsAll.GetFirst(); id != 0; id = vsAll.GetNext(id))
+      adj.emplace(id, VarSet(mDb));
+   for (auto &f : factors)
+   {
+      const VarSet &vs = f->GetVarSet();
+      for (VarId id = vs.GetFirst(); id != 0; id = vs.GetNext(id))
+         adj.at(id).Add(vs);
+   }
+
+   // eliminate variables, clique i is formed by i-th variable in the order
+   std::map<VarId, int> cliqueOfVar;
+   std::vector<VarId> elimVar;
+   for (VarId id = vsOrder.GetFirst(); id != 0; id = vsOrder.GetNext(id))
+   {
+      Clique c(mDb);
+      c.mVars.Add(id);
+      c.mVars.Add(adj.at(id));
+      cliqueOfVar[id] = (int) mCliques.size();
+      elimVar.push_back(id);
+
+      for (VarId idN = c.mVars.GetNext(id); idN != 0; idN = c.mVars.GetNext(idN))
+      {
+         VarSet &vsN = adj.at(idN);
+         vsN.Add(c.mVars);
+         vsN.Remove(id);
+      }
+      mCliques.push_back(c);
+   }
+
+   // parent is the clique of first eliminated neighbour
+   int nCliques = (int) mCliques.size();
+   for (int i = 0; i < nCliques; i++)
+   {
+      Clique &c = mCliques[i];
+      for (VarId id = c.mVars.GetFirst(); id != 0; id = c.mVars.GetNext(id))
+      {
+         int n = cliqueOfVar[id];
+         if (n > i && (c.mParent < 0 || n < c.mParent))
+            c.mParent = n;
+      }
+   }
+
+   // absorb parents that are subsets of a child
+   std::vector<int> absorbedInto(nCliques, -1);
+   for (int i = 0; i < nCliques; i++)
+   {
+      Clique &c = mCliques[i];
+      while (c.mParent >= 0 && mCliques[c.mParent].mVars.Substract(c.mVars).IsEmpty())
+      {
+         int p = c.mParent;
+         absorbedInto[p] = i;
+         c.mParent = mCliques[p].mParent;
+         for (int k = 0; k < nCliques; k++)
+         {
+            if (k != i && absorbedInto[k] < 0 && mCliques[k].mParent == p)
+               mCliques[k].mParent = i;
+         }
+      }
+   }
+
+   // compact remaining cliques
+   std::vector<int> newIndex(nCliques, -1);
+   std::vector<Clique> cliques;
+   for (int i = 0; i < nCliques; i++)
+   {
+      if (absorbedInto[i] >= 0)
+         continue;
+      newIndex[i] = (int) cliques.size();
+      cliques.push_back(mCliques[i]);
+   }
+   for (auto &c : cliques)
+   {
+      if (c.mParent >= 0)
+         c.mParent = newIndex[c.mParent];
+   }
+   mCliques.swap(cliques);
+
+   std::vector<int> roots;
+   for (int i = 0; i < (int) mCliques.size(); i++)
+   {
+      Clique &c = mCliques[i];
+      if (c.mParent < 0)
+      {
+         roots.push_back(i);
+         continue;
+      }
+      mCliques[c.mParent].mChildren.push_back(i);
+      c.mSeparator = c.mVars.Conjuction(mCliques[c.mParent].mVars);
+   }
+
+   // factor goes to the clique of its first eliminated variable
+   for (auto &f : factors)
+   {
+      const VarSet &vs = f->GetVarSet();
+      int nFirst = -1;
+      for (VarId id = vs.GetFirst(); id != 0; id = vs.GetNext(id))
+      {
+         int n = cliqueOfVar[id];
+         if (nFirst < 0 || n < nFirst)
+            nFirst = n;
+      }
+      if (nFirst < 0)
+         continue;
+      while (absorbedInto[nFirst] >= 0)
+         nFirst = absorbedInto[nFirst];
+      mCliques[newIndex[nFirst]].mFactors.push_back(f);
+   }
+
+   for (auto &c : mCliques)
+   {
+      std::vector<std::shared_ptr<Factor> > inputs = { FactorFactory::OnesFactor(c.mVars) };
+      inputs.insert(inputs.end(), c.mFactors.begin(), c.mFactors.end());
+      c.mPotential = FactorContraction(inputs, VarSet(mDb)).Sum();
+   }
+
+   // breadth first from roots, reversed so children come before parents
+   mOrder = roots;
+   for (size_t n = 0; n < mOrder.size(); n++)
+   {
+      const Clique &c = mCliques[mOrder[n]];
+      mOrder.insert(mOrder.end(), c.mChildren.begin(), c.mChildren.end());
+   }
+   std::reverse(mOrder.begin(), mOrder.end());
+}
+
+double
+JunctionTree::NormalizeFactor(std::shared_ptr<Factor> f)
+{
+   InstanceId nSize = f->GetVarSet().GetInstances();
+   double sum = 0;
+   for (InstanceId n = 0; n < nSize; n++)
+      sum += f->Get(n);
+   if (sum > 0)
+   {
+      for (InstanceId n = 0; n < nSize; n++)
+         f->AddInstance(n, (ValueType) (f->Get(n) / sum));
+   }
+   return sum;
+}
+
+std::shared_ptr<Factor>
+JunctionTree::MessageProduct(int nClique, int nExcludeChild, const VarSet &vsEliminate)
+{
+   Clique &c = mCliques[nClique];
+   std::vector<std::shared_ptr<Factor> > inputs = { c.mEvidencePotential };
+   if (c.mDownMessage)
+      inputs.push_back(c.mDownMessage);
+   for (int nChild : c.mChildren)
+   {
+      if (nChild != nExcludeChild)
+         inputs.push_back(mCliques[nChild].mUpMessage);
+   }
+   return FactorContraction(inputs, vsEliminate).Sum();
+}
+
+void
+JunctionTree::Calibrate(const Clause &evidence)
+{
+   const VarSet &vsEvidence = evidence.GetVarSet();
+   for (auto &c : mCliques)
+   {
+      c.mEvidencePotential = c.mPotential;
+      if (c.mVars.HasVar(vsEvidence))
+         c.mEvidencePotential = c.mPotential->ApplyClause(evidence);
+      c.mDownMessage.reset();
+      c.mUpMessage.reset();
+   }
+
+   // collect, messages are normalized and their scale is kept in log domain
+   mLogEvidence = 0;
+   for (int i : mOrder)
+   {
+      Clique &c = mCliques[i];
+      if (c.mParent < 0)
+         continue;
+      c.mUpMessage = MessageProduct(i, -1, c.mVars.Substract(c.mSeparator));
+      double sum = NormalizeFactor(c.mUpMessage);
+      mLogEvidence += sum > 0 ? std::log(sum) : -std::numeric_limits<double>::infinity();
+   }
+
+   // distribute from roots
+   for (auto it = mOrder.rbegin(); it != mOrder.rend(); ++it)
+   {
+      Clique &c = mCliques[*it];
+      for (int nChild : c.mChildren)
+      {
+         Clique &child = mCliques[nChild];
+         child.mDownMessage = MessageProduct(*it, nChild, c.mVars.Substract(child.mSeparator));
+         NormalizeFactor(child.mDownMessage);
+      }
+      c.mBelief = MessageProduct(*it, -1, VarSet(mDb));
+
+      if (c.mParent < 0)
+      {
+         double sum = 0;
+         for (InstanceId n = 0; n < c.mBelief->GetVarSet().GetInstances(); n++)
+            sum += c.mBelief->Get(n);
+         mLogEvidence += sum > 0 ? std::log(sum) : -std::numeric_limits<double>::infinity();
+      }
+   }
+}
+
+std::shared_ptr<Factor>
+JunctionTree::GetMarginal(VarId id)
+{
+   return GetMarginal(VarSet(mDb, id));
+}
+
+std::shared_ptr<Factor>
+JunctionTree::GetMarginal(const VarSet &vs)
+{
+   int nBest = -1;
+   for (int i = 0; i < (int) mCliques.size(); i++)
+   {
+      const VarSet &vsClique = mCliques[i].mVars;
+      if (!vs.Substract(vsClique).IsEmpty())
+         continue;
+      if (nBest < 0 || vsClique.GetInstances() < mCliques[nBest].mVars.GetInstances())
+         nBest = i;
+   }
+   if (nBest < 0 || vs.IsEmpty())
+      return std::make_shared<Factor>(VarSet(mDb));
+
+   if (!mCliques[nBest].mBelief)
+      Calibrate(Clause(mDb));
+
+   Clique &c = mCliques[nBest];
+   std::shared_ptr<Factor> res = FactorContraction({ FactorFactory::OnesFactor(vs), c.mBelief },
+      c.mVars.Substract(vs)).Sum();
+   NormalizeFactor(res);
+   res->SetClauseHead(vs);
+   return res;
+}
+
+ValueType
+JunctionTree::GetEvidenceProbability() const
+{
+   return (ValueType) std::exp(mLogEvidence);
+}
+
+VarSet
+JunctionTree::GetLargestClique() const
+{
+   VarSet res(mDb);
+   for (auto &c : mCliques)
+   {
+      if (c.mVars.GetSize() > res.GetSize() ||
+         (c.mVars.GetSize() == res.GetSize() && c.mVars.GetInstances() > res.GetInstances()))
+         res = c.mVars;
+   }
+   return res;
+}
+
+std::string
+JunctionTree::GetJson(const VarDb &db) const
+{
+   std::string s;
+   s = "{cliques:[ ";
+   for (auto &c : mCliques)
+   {
+      char sz[40];
+      s += "{vars:";
+      s += c.mVars.GetJson(db);
+      snprintf(sz, sizeof(sz), ",parent:%d,factors:%d},", c.mParent, (int) c.mFactors.size());
+      s += sz;
+   }
+   s.erase(s.length() - 1);
+   s += "]}";
+   return s;
+}
+
+std::string
+JunctionTree::GetType() const
+{
+   return "JunctionTree";
+}
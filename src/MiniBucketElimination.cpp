@@ -0,0 +1,290 @@
+/*
+* Copyright (C) 2017 Boris Altshul.
+* All rights reserved.
+*
+* The software in this package is published under the terms of the BSD
+* style license a copy of which has been included with this distribution in
+* the LICENSE.txt file.
+*/
+
+#include "Factories.h"
+#include "json/json.h"
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+using namespace bayeslib;
+
+MiniBucketElimination::MiniBucketElimination(FactorSet &fs, int nIBound, InstanceId maxCells,
+   ElimHeuristic heuristic) :
+   mDb(fs.GetDb()), mIBound(nIBound), mMaxCells(maxCells), mQuery(0),
+   mLogUpper(0), mLogLower(0), mLogScaleGap(0), mMaxMessageSize(0), mMaxMessageCells(0)
+{
+   VarSet vsAll(mDb);
+   for (auto &f : fs.GetFactors())
+   {
+      if (f->GetFactorType() == VarType_Decision)
+         continue;
+      mFactors.push_back(f);
+      vsAll.Add(f->GetVarSet());
+   }
+
+   // variables without edges are not in elimination order, they go last
+   VarSet vsOrder(mDb);
+   VarSet vsElimOrder = InteractionGraph(&fs).GetElimOrder(heuristic);
+   for (VarId id = vsElimOrder.GetFirst(); id != 0; id = vsElimOrder.GetNext(id))
+   {
+      if (vsAll.HasVar(id))
+         vsOrder.Add(id);
+   }
+   vsOrder.Add(vsAll);
+   for (VarId id = vsOrder.GetFirst(); id != 0; id = vsOrder.GetNext(id))
+      mOrder.push_back(id);
+}
+
+void
+MiniBucketElimination::Run(VarId idQuery)
+{
+   mQuery = idQuery;
+   mMaxMessageSize = 0;
+   mMaxMessageCells = 0;
+   double logScaleUpper = Eliminate(true, idQuery, mQueryUpper);
+   double logScaleLower = Eliminate(false, idQuery, mQueryLower);
+
+   double sumUpper = 0;
+   double sumLower = 0;
+   for (size_t n = 0; n < mQueryUpper.size(); n++)
+   {
+      sumUpper += mQueryUpper[n];
+      sumLower += mQueryLower[n];
+   }
+   mLogUpper = sumUpper > 0 ? logScaleUpper + std::log(sumUpper) : -std::numeric_limits<double>::infinity();
+   mLogLower = sumLower > 0 ? logScaleLower + std::log(sumLower) : -std::numeric_limits<double>::infinity();
+   mLogScaleGap = logScaleUpper - logScaleLower;
+}
+
+double
+MiniBucketElimination::Eliminate(bool bUpper, VarId idQuery, std::vector<ValueType> &query)
+{
+   std::map<VarId, int> posOf;
+   for (size_t n = 0; n < mOrder.size(); n++)
+      posOf[mOrder[n]] = (int) n;
+   auto placeOf = [&posOf, idQuery](const VarSet &vs)
+   {
+      int place = -1;
+      for (VarId id = vs.GetFirst(); id != 0; id = vs.GetNext(id))
+      {
+         if (id != idQuery && (place < 0 || posOf[id] < place))
+            place = posOf[id];
+      }
+      return place;
+   };
+
+   // Factor goes to bucket of its variable eliminated first, the rest is over query only
+   std::vector<std::vector<std::shared_ptr<Factor> > > buckets(mOrder.size());
+   std::vector<std::shared_ptr<Factor> > rest;
+   for (auto &f : mFactors)
+   {
+      int place = placeOf(f->GetVarSet());
+      if (place < 0)
+         rest.push_back(f);
+      else
+         buckets[place].push_back(f);
+   }
+
+   double logScale = 0;
+   for (size_t d = 0; d < mOrder.size(); d++)
+   {
+      std::vector<std::shared_ptr<Factor> > &bucket = buckets[d];
+      if (bucket.empty())
+         continue;
+      std::stable_sort(bucket.begin(), bucket.end(),
+         [](const std::shared_ptr<Factor> &f1, const std::shared_ptr<Factor> &f2)
+         { return f1->GetVarSet().GetSize() > f2->GetVarSet().GetSize(); });
+
+      // largest scopes are placed first, a Factor opens new mini-bucket if it fits nowhere
+      std::vector<std::vector<std::shared_ptr<Factor> > > minis;
+      std::vector<VarSet> scopes;
+      for (auto &f : bucket)
+      {
+         size_t m = 0;
+         for (; m < minis.size(); m++)
+         {
+            VarSet vs = scopes[m];
+            vs.Add(f->GetVarSet());
+            if ((int) vs.GetSize() <= mIBound + 1 && (!mMaxCells || vs.GetInstances() <= mMaxCells))
+               break;
+         }
+         if (m == minis.size())
+         {
+            minis.push_back(std::vector<std::shared_ptr<Factor> >());
+            scopes.push_back(VarSet(mDb));
+         }
+         minis[m].push_back(f);
+         scopes[m].Add(f->GetVarSet());
+      }
+
+      VarId id = mOrder[d];
+      int nMinis = (int) minis.size();
+      for (int m = 0; m < nMinis; m++)
+      {
+         std::shared_ptr<Factor> fMsg;
+         if (nMinis == 1)
+            fMsg = FactorContraction(minis[m], VarSet(mDb, id)).Sum();
+         else
+            fMsg = Reduce(minis[m], id, bUpper ? nMinis : (m == 0 ? 1 : 0));
+         mMaxMessageSize = std::max(mMaxMessageSize, (int) fMsg->GetVarSet().GetSize());
+         mMaxMessageCells = std::max(mMaxMessageCells, scopes[m].GetInstances());
+
+         // rescale to largest value so long products do not underflow
+         ValueType maxVal = 0;
+         InstanceId nRows = fMsg->GetVarSet().GetInstances();
+         for (InstanceId row = 0; row < nRows; row++)
+            maxVal = std::max(maxVal, fMsg->Get(row));
+         if (maxVal <= 0)
+         {
+            query.assign(idQuery ? mDb.GetDomainSize(idQuery) : 1, 0);
+            return -std::numeric_limits<double>::infinity();
+         }
+         for (InstanceId row = 0; row < nRows; row++)
+            fMsg->AddInstance(row, fMsg->Get(row) / maxVal);
+         logScale += std::log((double) maxVal);
+
+         int place = placeOf(fMsg->GetVarSet());
+         if (place < 0)
+            rest.push_back(fMsg);
+         else
+            buckets[place].push_back(fMsg);
+      }
+      bucket.clear();
+   }
+
+   query.assign(idQuery ? mDb.GetDomainSize(idQuery) : 1, 1);
+   for (auto &f : rest)
+   {
+      for (size_t state = 0; state < query.size(); state++)
+         query[state] *= f->Get(f->GetVarSet().GetInstanceComponent(idQuery, (VarState) state));
+   }
+   ValueType maxVal = *std::max_element(query.begin(), query.end());
+   if (maxVal <= 0)
+      return -std::numeric_limits<double>::infinity();
+   for (auto &v : query)
+      v /= maxVal;
+   return logScale + std::log((double) maxVal);
+}
+
+std::shared_ptr<Factor>
+MiniBucketElimination::Reduce(const std::vector<std::shared_ptr<Factor> > &mini, VarId id, int nPower)
+{
+   std::shared_ptr<Factor> fProd = FactorContraction(mini, VarSet(mDb)).Sum();
+   const VarSet &vsProd = fProd->GetVarSet();
+   VarSet vsRes = vsProd.Substract(VarSet(mDb, id));
+
+   // power sum for weighted mini-bucket, minimum for nPower 0
+   std::vector<double> acc(vsRes.GetInstances(), nPower ? 0 : std::numeric_limits<double>::infinity());
+   for (InstanceId row = 0; row < vsProd.GetInstances(); row++)
+   {
+      InstanceId rowRes = 0;
+      for (VarId v = vsRes.GetFirst(); v != 0; v = vsRes.GetNext(v))
+         rowRes += vsRes.GetInstanceComponent(v, vsProd.FetchVarState(v, row));
+      double val = fProd->Get(row);
+      if (nPower)
+         acc[rowRes] += nPower == 1 ? val : std::pow(val, nPower);
+      else
+         acc[rowRes] = std::min(acc[rowRes], val);
+   }
+
+   std::shared_ptr<Factor> res = std::make_shared<Factor>(vsRes);
+   for (InstanceId row = 0; row < acc.size(); row++)
+      res->AddInstance(row, (ValueType) (nPower > 1 ? std::pow(acc[row], 1.0 / nPower) : acc[row]));
+   return res;
+}
+
+ValueType
+MiniBucketElimination::GetEvidenceProbability() const
+{
+   if (mLogLower == -std::numeric_limits<double>::infinity())
+      return (ValueType) std::exp(mLogUpper);
+   return (ValueType) std::exp((mLogUpper + mLogLower) / 2);
+}
+
+std::shared_ptr<Factor>
+MiniBucketElimination::CreateMarginal(const std::vector<ValueType> &values) const
+{
+   if (!mQuery)
+      return std::make_shared<Factor>(VarSet(mDb));
+   std::shared_ptr<Factor> res = std::make_shared<Factor>(VarSet(mDb, mQuery), mQuery);
+   for (size_t state = 0; state < values.size(); state++)
+      res->AddInstance(state, values[state]);
+   return res;
+}
+
+std::shared_ptr<Factor>
+MiniBucketElimination::GetMarginal() const
+{
+   double sum = 0;
+   for (auto v : mQueryUpper)
+      sum += v;
+   std::vector<ValueType> values;
+   for (auto v : mQueryUpper)
+      values.push_back(sum > 0 ? (ValueType) (v / sum) : 0);
+   return CreateMarginal(values);
+}
+
+// Posterior p(q)/(p(q) + p(rest)) grows with p(q) and falls with p(rest),
+// so lower bound of one over upper bound of the other bounds it
+std::shared_ptr<Factor>
+MiniBucketElimination::GetMarginalLower() const
+{
+   double sumUpper = 0;
+   for (auto v : mQueryUpper)
+      sumUpper += v;
+   std::vector<ValueType> values;
+   for (size_t state = 0; state < mQueryLower.size(); state++)
+   {
+      double lower = mQueryLower[state];
+      double restUpper = (sumUpper - mQueryUpper[state]) * std::exp(mLogScaleGap);
+      values.push_back(lower > 0 ? (ValueType) (1 / (1 + restUpper / lower)) : 0);
+   }
+   return CreateMarginal(values);
+}
+
+std::shared_ptr<Factor>
+MiniBucketElimination::GetMarginalUpper() const
+{
+   double sumLower = 0;
+   for (auto v : mQueryLower)
+      sumLower += v;
+   std::vector<ValueType> values;
+   for (size_t state = 0; state < mQueryUpper.size(); state++)
+   {
+      double upper = mQueryUpper[state];
+      double restLower = (sumLower - mQueryLower[state]) * std::exp(-mLogScaleGap);
+      values.push_back(upper > 0 ? (ValueType) (1 / (1 + restLower / upper)) : 0);
+   }
+   return CreateMarginal(values);
+}
+
+std::string
+MiniBucketElimination::GetJson(const VarDb &db) const
+{
+   VarSet vsOrder(db);
+   for (VarId id : mOrder)
+      vsOrder.Add(id);
+
+   char sz[200];
+   std::string s;
+   s = "{order:";
+   s += vsOrder.GetJson(db);
+   snprintf(sz, sizeof(sz), ",iBound:%d,maxCells:%llu,maxMessageVars:%d,maxMessageCells:%llu,lower:%g,upper:%g}",
+      mIBound, (unsigned long long) mMaxCells, mMaxMessageSize, (unsigned long long) mMaxMessageCells,
+      std::exp(mLogLower), std::exp(mLogUpper));
+   s += sz;
+   return s;
+}
+
+std::string
+MiniBucketElimination::GetType() const
+{
+   return "MiniBucketElimination";
+}
@@ -24,6 +24,8 @@ static std::string createErrorJson(const char *err)
 std::string
 SessionEntry::RunCommand(std::string sOp)
 {
+   // intermediate Factors of the query reuse tables of previous queries
+   FactorPool::Scope poolScope;
    Json::Value v;
    Json::Reader r;
    if (!r.parse(sOp, v))
@@ -47,6 +49,11 @@ SessionEntry::RunCommand(std::string sOp)
 
    VarSet opVarSet(*pVarDb);
    Clause opClause(*pVarDb);
+   bool bRequisite = false;
+   int nTopK = 5;
+   QuantMode quantMode = QuantMode_None;
+   bool bSparseFill = false;
+   double sparseFill = 0.5;
 
 
    for (Json::Value::iterator it = v.begin();
@@ -73,6 +80,23 @@ SessionEntry::RunCommand(std::string sOp)
       {
          op = it->asString();
       }
+      else if (it.name() == "Requisite")
+      {
+         bRequisite = it->asBool();
+      }
+      else if (it.name() == "K")
+      {
+         nTopK = it->asInt();
+      }
+      else if (it.name() == "Quantize")
+      {
+         quantMode = FactorFactory::GetQuantMode(it->asString());
+      }
+      else if (it.name() == "SparseFill")
+      {
+         bSparseFill = true;
+         sparseFill = it->asDouble();
+      }
    }
 
    if (op.empty())
@@ -80,13 +104,23 @@ SessionEntry::RunCommand(std::string sOp)
       return createErrorJson("No operation");
    }
 
+   if (pFs && bSparseFill)
+   {
+      pFs->SelectStorage(sparseFill);
+   }
+
+   if (pFs && quantMode != QuantMode_None)
+   {
+      pFs->Quantize(quantMode);
+   }
+
    if (op == "MPE")
    {
-      pFs->PruneEdges(opClause);
-      pFs->ApplyClause(opClause);
-      VarSet vsEliminate = pFs->GetVarSet()->Substract(opClause.GetVarSet());
-      pFs->MaximizeVar(vsEliminate);
-      std::shared_ptr<Factor> res1 = pFs->Merge();
+      // observed variables leave every Factor, so result has the single MPE row
+      // and parts no longer connected through them are solved apart
+      pFs->SliceEvidence(opClause);
+      VarSet vsMaximize = *pFs->GetVarSet();
+      std::shared_ptr<Factor> res1 = pFs->SolveComponents(VarSet(*pVarDb), vsMaximize);
 
       std::string sMpeVal = res1->GetJson(*pVarDb);
 
@@ -105,18 +139,46 @@ SessionEntry::RunCommand(std::string sOp)
       return sRes;
    }
 
+   if (op == "TopKMPE")
+   {
+      pFs->PruneEdges(opClause);
+      pFs->ApplyClause(opClause);
+
+      // evidence rows are zeroed, so evidence variables keep their observed states
+      std::vector<std::shared_ptr<Factor> > res = pFs->TopKMPE(nTopK);
+
+      std::string sRes = "{\"topk\":[";
+      for (size_t n = 0; n < res.size(); n++)
+      {
+         char sz[100];
+         Clause clMpe(res[n]->GetExtendedVarSet(), res[n]->GetExtendedClause(0));
+         sRes += n ? ",{" : "{";
+         sRes += AddJsonAttr(sz, sizeof(sz), "value", "%g", (double) res[n]->Get(0));
+         sRes += "\"clause\":";
+         sRes += clMpe.GetJson(*pVarDb);
+         sRes += "}";
+      }
+      sRes += "]}";
+      return sRes;
+   }
+
    if (op == "MAP")
    {
       VarSet vsEliminate = pFs->GetVarSet()->Substract(opVarSet);
 
-      // varset to prune networks
-      VarSet vsPrune = opVarSet.Disjuction(opClause.GetVarSet());
-      pFs->PruneVars(vsPrune);
-      pFs->PruneEdges(opClause.GetVarSet());
-      pFs->ApplyClause(opClause);
-      pFs->EliminateVar(vsEliminate);
-      pFs->MaximizeVar(opVarSet);
-      std::shared_ptr<Factor> res1 = pFs->Merge();
+      // varset to prune networks, requisite pruning also drops d-separated evidence
+      VarSet vsPruned(*pVarDb);
+      if (bRequisite)
+      {
+         vsPruned = pFs->PruneRequisite(opVarSet, opClause);
+      }
+      else
+      {
+         VarSet vsPrune = opVarSet.Disjuction(opClause.GetVarSet());
+         pFs->PruneVars(vsPrune);
+      }
+      pFs->SliceEvidence(opClause);
+      std::shared_ptr<Factor> res1 = pFs->SolveComponents(vsEliminate, opVarSet);
 
       std::string sMpeVal = res1->GetJson(*pVarDb);
 
@@ -131,6 +193,17 @@ SessionEntry::RunCommand(std::string sOp)
       sRes += sMpeVal;
       sRes += ",\"clause\":";
       sRes += sMpeClause;
+      if (bRequisite)
+      {
+         sRes += ",\"pruned\":[";
+         for (VarId id = vsPruned.GetFirst(); id != 0; id = vsPruned.GetNext(id))
+         {
+            if (id != vsPruned.GetFirst())
+               sRes += ",";
+            sRes += "\"" + (*pVarDb)[id] + "\"";
+         }
+         sRes += "]";
+      }
       sRes += "}";
       return sRes;
    }
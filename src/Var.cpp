@@ -10,6 +10,7 @@
 
 #include "factor.h"
 #include "json/json.h"
+#include <algorithm>
 
 using namespace bayeslib;
 
@@ -9,6 +9,7 @@
 
 #include "factor.h"
 #include "json/json.h"
+#include <cstring>
 
 using namespace bayeslib;
 
@@ -11,28 +11,29 @@
 #include "factor.h"
 #include "json/json.h"
 #include <cassert>
+#include <algorithm>
 
 using namespace bayeslib;
 
 
 
 VarSet::VarSet(const VarDb &db) :
-   mCachedInstances(0), mDb(db)
+   mMaxId(0), mSize(0), mInstances(1), mDb(db)
 {
-	mOffsetMapping.fill(-1);
+   mMask.fill(0);
 }
 
 VarSet::VarSet(const VarDb &db, const VarId v) :
-   mCachedInstances(0), mDb(db)
+   mMaxId(0), mSize(0), mInstances(1), mDb(db)
 {
-	mOffsetMapping.fill(-1);
+   mMask.fill(0);
 	Add(v);
 }
 
 VarSet::VarSet(const VarDb &db, std::initializer_list<VarId> initlist) :
-   mCachedInstances(0), mDb(db)
+   mMaxId(0), mSize(0), mInstances(1), mDb(db)
 {
-	mOffsetMapping.fill(-1);
+   mMask.fill(0);
 	for (auto iter = initlist.begin(); iter != initlist.end(); ++iter)
 	{
 		Add(*iter);
@@ -42,18 +43,18 @@ VarSet::VarSet(const VarDb &db, std::initializer_list<VarId> initlist) :
 
 bool VarSet::operator ==(const VarSet &another) const
 {
-	if (another.GetSize() != GetSize())
-		return false;
+   if (mMask != another.mMask || mSize != another.mSize)
+      return false;
+   if (_IsMaskExact() && another._IsMaskExact())
+      return true;
 
-	for (auto iter = mList.begin();
-		iter != mList.end(); ++iter)
-	{
-		if (!another.HasVar(iter->mId))
-		{
-			return false;
-		}
-	}
-	return true;
+   const VarOperator *pOps = _Ops();
+   for (unsigned int n = 0; n < mSize; n++)
+   {
+      if (!another.HasVar(pOps[n].mId))
+         return false;
+   }
+   return true;
 }
 
 
@@ -62,13 +63,29 @@ VarSet::_Add(VarId id)
 { 
 	if (!HasVar(id))
 	{
-      // instances until now
-      InstanceId inst = GetInstances();
-      Var v = mDb.GetVar(id);
-		mList.push_back({id,(VarState) v.GetDomainSize(), inst });
-		mOffsetMapping[id] = mList.size()-1;
-      // invalidate the cache
-      mCachedInstances = 0;
+      VarOperator op(id, (VarState) mDb.GetDomainSize(id), mInstances);
+      if (mSize < INLINE_SIZE)
+      {
+         mInline[mSize] = op;
+      }
+      else
+      {
+         if (mHeapOps.empty())
+         {
+            mHeapOps.assign(mInline.begin(), mInline.end());
+            for (unsigned int n = 0; n < mSize; n++)
+               mIndex.push_back(std::make_pair(mInline[n].mId, n));
+            std::sort(mIndex.begin(), mIndex.end());
+         }
+         mHeapOps.push_back(op);
+         auto pos = std::lower_bound(mIndex.begin(), mIndex.end(), std::make_pair(id, 0U));
+         mIndex.insert(pos, std::make_pair(id, mSize));
+      }
+      _SetMask(id);
+      if (id > mMaxId)
+         mMaxId = id;
+      mSize++;
+      mInstances *= op.mSize;
 	}
 }
 
@@ -83,9 +100,10 @@ VarSet::Add(VarId id)
 void
 VarSet::Add(const VarSet &vs)
 {
-	for (VarId vid = vs.GetFirst(); vid != 0; vid = vs.GetNext(vid))
+   const VarOperator *pOps = vs._Ops();
+	for (unsigned int n = 0; n < vs.mSize; n++)
 	{
-       _Add(vid);
+       _Add(pOps[n].mId);
 	}
 }
 
@@ -93,53 +111,66 @@ VarSet::Add(const VarSet &vs)
 void
 VarSet::Remove(VarId id)
 {
-   for(auto it = mList.begin(); 
-      it != mList.end(); ++it)
+   if (!HasVar(id))
+      return;
+
+   // rebuild remaining variables so multipliers stay consistent
+   VarSet res(mDb);
+   const VarOperator *pOps = _Ops();
+   for (unsigned int n = 0; n < mSize; n++)
    {
-	   if (it->mId == id)
-	   {
-		   mOffsetMapping[it->mId] = -1;
-		   it = mList.erase(it);		   
-		   // recalculate offsets of remaining variables
-		   for (; it != mList.end(); ++it)
-		   {
-			   mOffsetMapping[it->mId]--;
-		   }
-
-         mCachedInstances = 0;
-		 break;
-      }
+      if (pOps[n].mId != id)
+         res._Add(pOps[n].mId);
    }
+   *this = res;
 }
 
 
 void 
 VarSet::MergeIn(const VarSet &another)
 {
-   for( VarId id = another.GetFirst(); 
-            id!=0; 
-            id =another.GetNext(id))
-   {
-	   _Add(id);
-   }
+   Add(another);
 }
 
 
 bool 
 VarSet::HasVar(VarId id) const
 {
-	if (id < 1 || id > MAX_SET_SIZE)
+	if (id < 1 || id > mMaxId || !_TestMask(id))
 		return false;
+   if (_IsMaskExact())
+      return true;
+
+   return _Find(id) >= 0;
+}
+
+int
+VarSet::_Find(VarId id) const
+{
+   if (mIndex.empty())
+   {
+      const VarOperator *pOps = _Ops();
+      for (unsigned int n = 0; n < mSize; n++)
+      {
+         if (pOps[n].mId == id)
+            return (int) n;
+      }
+      return -1;
+   }
 
-    return mOffsetMapping[id] >= 0;
+   auto pos = std::lower_bound(mIndex.begin(), mIndex.end(), std::make_pair(id, 0U));
+   if (pos == mIndex.end() || pos->first != id)
+      return -1;
+   return (int) pos->second;
 }
 
 bool 
 VarSet::HasVarType(VarType vartype) const
 {
-   for(auto it = mList.begin(); it != mList.end(); ++it)
+   const VarOperator *pOps = _Ops();
+   for (unsigned int n = 0; n < mSize; n++)
    {
-      if (mDb.GetVarType(it->mId) == vartype)
+      if (mDb.GetVarType(pOps[n].mId) == vartype)
       {
          return true;
       }
@@ -152,11 +183,12 @@ VarSet
 VarSet::FilterVarSet(VarType vartype)
 {
 	VarSet res(mDb);
-	for (auto it = mList.begin(); it != mList.end(); ++it)
+   const VarOperator *pOps = _Ops();
+   for (unsigned int n = 0; n < mSize; n++)
 	{
-		if (mDb.GetVarType(it->mId) == vartype)
+		if (mDb.GetVarType(pOps[n].mId) == vartype)
 		{
-			res.Add(it->mId);
+			res._Add(pOps[n].mId);
 		}
 	}
 	return res;
@@ -166,14 +198,25 @@ VarSet::FilterVarSet(VarType vartype)
 bool 
 VarSet::HasVar(const VarSet &another) const
 {
-   for(auto it = mList.begin(); 
-            it != mList.end(); 
-            ++it)
+   bool bMaskIntersects = false;
+   for (unsigned int w = 0; w < MASK_WORDS; w++)
    {
-      if (another.HasVar(it->mId))
-      {
+      if (mMask[w] & another.mMask[w])
+         bMaskIntersects = true;
+   }
+   if (!bMaskIntersects)
+      return false;
+   if (_IsMaskExact() && another._IsMaskExact())
+      return true;
+
+   // test variables of smaller VarSet against the other one
+   const VarSet &vsSmall = mSize <= another.mSize ? *this : another;
+   const VarSet &vsLarge = mSize <= another.mSize ? another : *this;
+   const VarOperator *pOps = vsSmall._Ops();
+   for (unsigned int n = 0; n < vsSmall.mSize; n++)
+   {
+      if (vsLarge.HasVar(pOps[n].mId))
          return true;
-      }
    }
    return false;
 }
@@ -181,71 +224,52 @@ VarSet::HasVar(const VarSet &another) const
 unsigned int 
 VarSet::GetSize() const
 {
-   return mList.size();
+   return mSize;
 }
 
 
-
-InstanceId VarSet::_GetInstances() const
-{
-   InstanceId res = 1;
-   for(auto it = mList.begin(); 
-            it != mList.end(); 
-            ++it)
-   {
-      res *= it->mSize;
-   }
-   return res;
-}
-
 InstanceId VarSet::GetInstances() const
 {
-   if(!mCachedInstances)
-   {
-      mCachedInstances = _GetInstances();
-   }
-   return mCachedInstances;
+   return mInstances;
 }
 
 
 int 
 VarSet::GetOffs(VarId varid) const
 {
-	if (varid <= 0 && varid > MAX_SET_SIZE)
+	if (varid < 1 || varid > mMaxId || !_TestMask(varid))
 		return -1;
-	return mOffsetMapping[varid];
+	return _Find(varid);
 }
 
 
 void
-VarSet::GetVarParams(VarId varid, InstanceId &varMultiplier, int &varSize)
+VarSet::GetVarParams(VarId varid, InstanceId &varMultiplier, int &varSize) const
 {
-   int offs = 0;
-
-   if (varid <= 0 || varid > MAX_SET_SIZE || (offs = mOffsetMapping[varid]) < 0)
+   int offs = GetOffs(varid);
+   if (offs < 0)
    {
       varMultiplier = 0;
       varSize = 0;
+      return;
    }
 
-   VarOperator op = GetOpByOffset(offs);
+   const VarOperator &op = _GetByOffset(offs);
    varMultiplier = op.mMultiplier;
    varSize = op.mSize;
 }
 
 
 
-std::array<VarState, MAX_SET_SIZE>
-VarSet::ConvertVarArray(InstanceId instanceId)
+std::vector<VarState>
+VarSet::ConvertVarArray(InstanceId instanceId) const
 {
-   std::array<VarState, MAX_SET_SIZE> res;
-   res.fill(0);
+   std::vector<VarState> res(mMaxId + 1, 0);
 
-   for(auto it = mList.begin();
-       it != mList.end();
-       ++it)
+   const VarOperator *pOps = _Ops();
+   for (unsigned int n = 0; n < mSize; n++)
    {
-      VarOperator &op = *it;
+      const VarOperator &op = pOps[n];
       // fetch value from InstanceId
       InstanceId tmp = instanceId / op.mMultiplier;
       VarState var = (VarState) (tmp % op.mSize);
@@ -256,7 +280,7 @@ VarSet::ConvertVarArray(InstanceId instanceId)
 
 
 VarState
-VarSet::FetchVarState(VarId  id, InstanceId instanceId)
+VarSet::FetchVarState(VarId  id, InstanceId instanceId) const
 {
    int offs = GetOffs(id);
    if( offs < 0)
@@ -264,40 +288,35 @@ VarSet::FetchVarState(VarId  id, InstanceId instanceId)
       return 0;
    }
 
-   VarOperator op = GetOpByOffset(offs);
+   const VarOperator &op = _GetByOffset(offs);
    return (VarState) ((instanceId / op.mMultiplier)%op.mSize);
 }
 
 VarState
-VarSet::FetchVarStateByOffs(int offs, InstanceId instanceId) {
-   if (offs <0 || offs >= (int) mList.size())
+VarSet::FetchVarStateByOffs(int offs, InstanceId instanceId) const
+{
+   if (offs <0 || offs >= (int) mSize)
       return 0;
 
-   VarOperator op = GetOpByOffset(offs);
+   const VarOperator &op = _GetByOffset(offs);
    return (VarState) ((instanceId / op.mMultiplier)%op.mSize);
 }
 
 VarSet::VarOperator
-VarSet::GetOpByOffset(int offs)
+VarSet::GetOpByOffset(int offs) const
 {
-   // B.A. improve this for scalability
-   for (auto it = mList.begin(); it != mList.end();  ++it) {
-      VarOperator &op = *it;
-      if(!offs)
-         return op;
-      offs--;
-   }
-
-   return VarOperator(0,0,0);
+   if (offs < 0 || offs >= (int) mSize)
+      return VarOperator(0,0,0);
+   return _GetByOffset(offs);
 }
 
 
 VarId 
 VarSet::GetFirst() const
 {
-   if(GetSize())
+   if(mSize)
    {
-      return mList.begin()->mId;
+      return _Ops()[0].mId;
    }
    return 0;
 }
@@ -305,32 +324,25 @@ VarSet::GetFirst() const
 VarId 
 VarSet::GetNext(VarId id) const 
 {
-   for(auto it = mList.begin(); 
-      it != mList.end(); 
-      ++it)
-   {
-      if (it->mId == id)
-      {
-         ++it;
-         
-         if (it == mList.end())
-            return 0;
-         return it->mId;
-      }
-   }
-   return 0;
+   int offs = GetOffs(id);
+   if (offs < 0 || offs + 1 >= (int) mSize)
+      return 0;
+   return _Ops()[offs + 1].mId;
 }
 
 VarSet 
 VarSet::Conjuction(const VarSet &vs) const
 {
+   // result keeps order of vs
    VarSet res(mDb);
-   for(VarId id= vs.GetFirst(); 
-      id != 0; 
-      id = vs.GetNext(id))
+   if (!HasVar(vs))
+      return res;
+
+   const VarOperator *pOps = vs._Ops();
+   for (unsigned int n = 0; n < vs.mSize; n++)
    {
-      if(HasVar(id))
-         res.Add(id);      
+      if (HasVar(pOps[n].mId))
+         res._Add(pOps[n].mId);
    }
    return res;
 }
@@ -339,26 +351,22 @@ VarSet
 VarSet::Disjuction(const VarSet &vs) const
 {
    VarSet res = *this;
-   for(VarId id= vs.GetFirst(); 
-      id != 0; 
-      id = vs.GetNext(id))
-   {
-      if(!HasVar(id))
-            res.Add(id);      
-   }
+   res.Add(vs);
    return res;
 } 
 
 VarSet 
 VarSet::Substract(const VarSet &vs) const
 {
+   if (!HasVar(vs))
+      return *this;
+
    VarSet res(mDb);
-   for(VarId id= GetFirst(); 
-      id != 0; 
-      id = GetNext(id))
+   const VarOperator *pOps = _Ops();
+   for (unsigned int n = 0; n < mSize; n++)
    {
-      if(!vs.HasVar(id))
-            res.Add(id);      
+      if (!vs.HasVar(pOps[n].mId))
+         res._Add(pOps[n].mId);
    }
    return res;
       
@@ -370,10 +378,11 @@ VarSet::GetJson(const VarDb &) const
 {
    std::string s;
    s = "[ ";
-   for(auto it = mList.begin(); it != mList.end(); ++it)
+   const VarOperator *pOps = _Ops();
+   for (unsigned int n = 0; n < mSize; n++)
    {
       char sz[20];
-      snprintf(sz, sizeof(sz), "%s", mDb[it->mId].c_str() );
+      snprintf(sz, sizeof(sz), "%s", mDb[pOps[n].mId].c_str() );
       s += sz;
       s += ",";
    }   
@@ -388,10 +397,11 @@ VarSet::GetJsonAbbrev() const
 {
    std::string s;
    s = "[ ";
-   for(auto it = mList.begin(); it != mList.end(); ++it)
+   const VarOperator *pOps = _Ops();
+   for (unsigned int n = 0; n < mSize; n++)
    {
       char sz[20];
-      snprintf(sz, sizeof(sz), "%d", it->mId);
+      snprintf(sz, sizeof(sz), "%d", pOps[n].mId);
       s += sz;
       s += ",";
    }
@@ -406,17 +416,3 @@ VarSet::GetType() const
 {
    return "VarSet";
 }
-
-const VarSet::VarOperator &
-VarSet::_GetByOffset(int offs)
-{
-   for(auto it = mList.begin();
-       it != mList.end();
-       ++it)
-   {
-      if(!offs)
-         return *it;
-      offs--;
-   }
-   return *mList.begin();
-}
@@ -37,13 +37,28 @@ typedef uint64_t u64;
 
 
 
-#define MAX_SET_SIZE 128
-
-#define DBC_CHECK_VID(vid) DBC_CHECK(vid > 0 && vid < MAX_SET_SIZE, "VariableId is out of range")
+// VarIds are 1 based, capacity is defined by VarDb
+#define DBC_CHECK_VID(vid) DBC_CHECK(vid > 0, "VariableId is out of range")
 
 typedef u64 InstanceId;
 typedef unsigned int VarId;
+
+// Storage precision of Factor tables and precision of sums and long products taken
+// over them, selected at compile time by CMake options BAYES_VALUE_DOUBLE and
+// BAYES_ACCUM_DOUBLE. Float tables with double accumulation keep the memory of
+// float and the accuracy of double for reductions over many rows
+#ifdef BAYES_VALUE_DOUBLE
+typedef double ValueType;
+#else
 typedef float ValueType;
+#endif
+
+#if defined(BAYES_VALUE_DOUBLE) || defined(BAYES_ACCUM_DOUBLE)
+typedef double AccumType;
+#else
+typedef float AccumType;
+#endif
+
 // Value of variable within its domain definition
 typedef u8 VarState;
 
@@ -14,7 +14,6 @@
 #include <list>
 #include <map>
 #include <vector>
-#include <bitset>
 #include <memory>
 #include <array>
 
@@ -115,7 +114,10 @@ namespace bayeslib
    };
 
    /** Subset of Nodes on a Graph
-      Used as utility class throught out the library
+      Used as utility class throught out the library.
+      Variables are kept in insertion order in contiguous storage inside the object,
+      membership is a bitmask over VarId so set operations are word parallel.
+      VarIds above the mask size fold onto it, for them the mask only rules out membership
       @ingroup API
    */
    class VarSet : public UIElem
@@ -145,9 +147,13 @@ namespace bayeslib
 
      VarSet & operator=(const VarSet &another)
      {
-        mCachedInstances = another.mCachedInstances;
-        mList = another.mList;
-        mOffsetMapping = another.mOffsetMapping;
+        mMask = another.mMask;
+        mMaxId = another.mMaxId;
+        mSize = another.mSize;
+        mInstances = another.mInstances;
+        mInline = another.mInline;
+        mHeapOps = another.mHeapOps;
+        mIndex = another.mIndex;
         return *this;
      }
 
@@ -220,15 +226,15 @@ namespace bayeslib
       /// @param varid Id of variable in varset
       /// @param varMulriplier out parameter for multiplier of variable in this VarSet
       /// @param varSize domain size of this Variable
-      void GetVarParams(VarId varid, InstanceId &varMultiplier, int &varSize);
+      void GetVarParams(VarId varid, InstanceId &varMultiplier, int &varSize) const;
 
       /// Get contribution of VarId to the Instance value of VarSe
       /// @param id VarId id of variable
       /// @param v  VarState state of Variable in its domain
       /// @return contribution of this variable in InsecnceId value of clause based on this VarSet
-      InstanceId GetInstanceComponent(VarId id, VarState v)
+      InstanceId GetInstanceComponent(VarId id, VarState v) const
       {
-         int offs = mOffsetMapping[id];
+         int offs = GetOffs(id);
          if (offs < 0)
             return 0;
 
@@ -240,7 +246,7 @@ namespace bayeslib
       /// @param id int offs offset of variable
       /// @param v  VarState state of Variable in its domain
       /// @return contribution of this variable in InsecnceId value of clause based on this VarSet
-      InstanceId GetInstanceComponentByOffs(int offs, VarState v)
+      InstanceId GetInstanceComponentByOffs(int offs, VarState v) const
       {
          if (offs < 0)
             return 0;
@@ -252,17 +258,17 @@ namespace bayeslib
       /// Fetch individual Variable component from InstanceId  representation
       /// @param id variable id
       /// @param instanceId instanceId withi this varSet
-      VarState FetchVarState(VarId  id, InstanceId instanceId);
+      VarState FetchVarState(VarId  id, InstanceId instanceId) const;
 
       /// Fetch individual Variable component from InstanceId  representation
       /// @param id variable id
       /// @param instanceId instanceId withi this varSet
-      VarState FetchVarStateByOffs(int offs, InstanceId instanceId);
+      VarState FetchVarStateByOffs(int offs, InstanceId instanceId) const;
 
       /// Convert to clause array
       /// @param instanceId of clause
-      /// @return array of Variable states scaled to maximum allowed varset
-      std::array<VarState, MAX_SET_SIZE> ConvertVarArray(InstanceId instanceId);
+      /// @return array of Variable states indexed by VarId, sized to the largest VarId in this VarSet
+      std::vector<VarState> ConvertVarArray(InstanceId instanceId) const;
 
 
 
@@ -275,7 +281,7 @@ namespace bayeslib
 
       /// Test is VarSet is empty
       /// @return true if this VarSet is empty
-      bool IsEmpty() const { return mList.empty(); }
+      bool IsEmpty() const { return !mSize; }
 
       /// Create VarSet which is intersection of two VarSets
       /// @param vs VarSet intersects with this VarSet 
@@ -298,10 +304,14 @@ namespace bayeslib
 
    protected:
 
+      friend class Clause;
+
       class VarOperator
       {
       public:
 
+         VarOperator() : mId(0), mMultiplier(0), mSize(0) {}
+
          VarOperator(VarId id, u8 var_size, InstanceId multiplier) :
             mId(id), mMultiplier(multiplier), mSize(var_size) 
          {
@@ -316,16 +326,32 @@ namespace bayeslib
          int mSize;
       };
 
-      const VarOperator & _GetByOffset(int offs);
-      mutable InstanceId mCachedInstances;
-      std::list<VarOperator> mList;
+      /// number of variables stored inside VarSet object, larger VarSets spill to heap
+      static const unsigned int INLINE_SIZE = 8;
+      /// number of bits in membership mask. VarIds below MASK_BITS have own bit, 
+      /// larger VarIds share bits so the mask becomes a signature that only rules out membership
+      static const unsigned int MASK_BITS = 128;
+      static const unsigned int MASK_WORDS = MASK_BITS / 64;
 
-      VarOperator GetOpByOffset(int offs);
+      /// contiguous array of variables in insertion order
+      const VarOperator *_Ops() const { return mHeapOps.empty() ? mInline.data() : mHeapOps.data(); }
+      const VarOperator & _GetByOffset(int offs) const { return _Ops()[offs]; }
+      VarOperator GetOpByOffset(int offs) const;
 
-	   // optimization mapping of VarId to indexin mList
-      std::array<int, MAX_SET_SIZE> mOffsetMapping;
       void _Add(VarId id);
-      InstanceId _GetInstances() const;
+      int _Find(VarId id) const;
+      void _SetMask(VarId id) { id %= MASK_BITS; mMask[id >> 6] |= (u64)1 << (id & 63); }
+      bool _TestMask(VarId id) const { id %= MASK_BITS; return (mMask[id >> 6] >> (id & 63)) & 1; }
+      /// mask holds exact membership
+      bool _IsMaskExact() const { return mMaxId < MASK_BITS; }
+
+      std::array<u64, MASK_WORDS> mMask;              // membership bit per VarId modulo MASK_BITS
+      VarId mMaxId;                                   // largest VarId in this VarSet
+      unsigned int mSize;
+      InstanceId mInstances;                          // product of domain sizes
+      std::array<VarOperator, INLINE_SIZE> mInline;
+      std::vector<VarOperator> mHeapOps;              // used instead of mInline when size exceeds INLINE_SIZE
+      std::vector<std::pair<VarId, unsigned int> > mIndex;   // VarId to offset sorted by VarId, used with mHeapOps
       const VarDb &mDb;
 
    };
@@ -418,6 +444,18 @@ namespace bayeslib
          return NullVar();
       }
 
+      /// Domain size of variable without copying Var
+      /// @param id VarId of variable
+      /// @return number of states, 0 if variable is not found
+      size_t GetDomainSize(VarId id) const
+      {
+         if(id != 0 && mAr.size() >= id)
+         {
+            return mAr[id-1].GetDomainSize();
+         }
+         return 0;
+      }
+
       VarState JsonValToState(VarId id, const Json::Value &v) const;
 
        protected:
@@ -447,7 +485,9 @@ namespace bayeslib
    /// Internally, the Clause is defined by integral InstanceId value in which  
    /// the states of all Variables in the varset are binary 0 or 1 placed according to
    /// offset inside the VarSet. Therefore numeric value of InstanceId is only significant 
-   /// for Clauses constructed from identical VarSet
+   /// for Clauses constructed from identical VarSet.
+   /// VarSet is immutable and shared between copies of the Clause, states are packed 
+   /// in VarSet offset order
    /// @ingroup API
    class Clause : public UIElem
    {
@@ -473,7 +513,7 @@ namespace bayeslib
        /// @param vs VarSet of variavles in this VarSet
        /// @param clause is a bitset of with values for variables. This bitset is arranged in order of VarIds variables in domain
        ///        and therefore VarSet independent 
-       // Clause(const VarSet &vs, const std::bitset<MAX_SET_SIZE> &clause);
+       // Clause(const VarSet &vs, const std::bitset<> &clause);
 
        /// Construct Clause from VarSet and integral InstanceId 
        /// Since InstanceId is dependent on VarSet order it is usefull to constructing Clauses of same VarSets
@@ -482,6 +522,12 @@ namespace bayeslib
        ///            same VarSet
        Clause(const VarSet &vs, InstanceId id);
 
+       /// Construct Clause sharing VarSet with other Clauses. Use it to avoid copying 
+       /// VarSet when many Clauses of the same VarSet are constructed
+       /// @param pVs shared VarSet, must not be modified after construction 
+       /// @param id InstanceId defining values in this VarSet
+       Clause(std::shared_ptr<const VarSet> pVs, InstanceId id = 0);
+
        /// Construct Clause with list of ClauseInitializers
        /// @param initlist initializer list of ClauseInitializers 
        Clause(const VarDb &db, std::initializer_list<ClauseInitializer> initlist);
@@ -491,7 +537,7 @@ namespace bayeslib
       /// @param vs VarSet this varset is based on
       /// @param clause array of values.
       /// @note clause paramter doesn't have to exacltly match set in VarSet
-      Clause(const VarSet &vs, const std::array<VarState ,MAX_SET_SIZE> &clause);
+      Clause(const VarSet &vs, const std::vector<VarState> &clause);
 
 
 
@@ -511,6 +557,7 @@ namespace bayeslib
        VarState GetVar(VarId vid) const;
 
        /// Move this clause to next possible instance, wrappped around to 0 (all Variables are set to false)
+       /// Only the states that carry are updated
        /// @return true if wraparound has occured
        bool Incr();
 
@@ -526,7 +573,14 @@ namespace bayeslib
        /// @return VarSet subset of Domain Variables
        const VarSet &GetVarSet() const 
        {
-           return mVarSet;
+           return *mpVarSet;
+       }
+
+       /// Get shared VarSet of the Clause
+       /// @return VarSet that can be passed to other Clauses
+       std::shared_ptr<const VarSet> GetSharedVarSet() const
+       {
+           return mpVarSet;
        }
 
       // from UIElem
@@ -548,16 +602,23 @@ namespace bayeslib
 	  InstanceId GetInstanceId(const VarSet &vs) const;
 
       // static utility functions
-      static Clause Append(VarSet target, const Clause &cl1, const Clause &cl2);
+      static Clause Append(const VarSet &target, const Clause &cl1, const Clause &cl2);
     
 
 
        protected:
+       /// number of states stored inside Clause object, larger Clauses spill to heap
+       static const unsigned int INLINE_STATES = 16;
+
        void UpdateClause();
+       void _InitStates();
+       VarState *_States() { return mHeapStates.empty() ? mInline.data() : mHeapStates.data(); }
+       const VarState *_States() const { return mHeapStates.empty() ? mInline.data() : mHeapStates.data(); }
 
-       std::array<VarState, MAX_SET_SIZE> mClause;
        InstanceId mInstanceId;
-       VarSet mVarSet; 
+       std::shared_ptr<const VarSet> mpVarSet;
+       std::array<VarState, INLINE_STATES> mInline;    // state per offset in VarSet
+       std::vector<VarState> mHeapStates;              // used instead of mInline for large VarSets
 
    };
 
@@ -604,6 +665,62 @@ namespace bayeslib
    };
 
 
+   /// Storage of Factor table after Factor::Quantize
+   /// @ingroup API
+   enum QuantMode
+   {
+      QuantMode_None = 0,        ///< ValueType per row
+      QuantMode_Linear8 = 1,     ///< 8 bit code times per-factor scale
+      QuantMode_Linear16 = 2,    ///< 16 bit code times per-factor scale
+      QuantMode_Log8 = 3         ///< 8 bit code of log2 below largest value in 1/16 steps
+   };
+
+   /// Size class pool of value tables of Factors. Factors take their tables from the
+   /// pool of their thread and give them back when destroyed, so intermediate Factors
+   /// of elimination reuse the tables of the ones already merged instead of going to
+   /// the heap. Pool is active while a Scope lives on the thread, tables released
+   /// outside of any Scope are freed
+   /// @ingroup API
+   class FactorPool
+   {
+   public:
+      /// Activate pool of calling thread for one query, scopes may be nested. When the
+      /// outermost Scope ends pool is trimmed in bulk to retained bytes, what stays is
+      /// reused by next queries of the session
+      class Scope
+      {
+      public:
+         Scope();
+         ~Scope();
+         Scope(const Scope &) = delete;
+         Scope &operator=(const Scope &) = delete;
+      };
+
+      /// Fill v with n elements T(), reuse free table of matching size class if pool is active
+      /// @param v empty table
+      /// @param n number of elements
+      template<class T> static void Acquire(std::vector<T> &v, size_t n);
+
+      /// Give table back to pool of calling thread, v is left empty
+      /// @param v table to release
+      template<class T> static void Release(std::vector<T> &v);
+
+      /// Set number of bytes pool of calling thread keeps between queries
+      static void SetRetainedBytes(size_t bytes);
+
+      /// Get number of bytes held by free tables of calling thread
+      static size_t GetFreeBytes();
+
+      /// Get number of tables calling thread took from the pool
+      static u64 GetHits();
+
+      /// Get number of tables calling thread allocated while the pool was active
+      static u64 GetMisses();
+
+      /// Free all tables of calling thread
+      static void Clear();
+   };
+
    class FactorExtender
    {
    public:
@@ -643,6 +760,9 @@ namespace bayeslib
       // @param clauseHead VarSet for Head of this Factor
       Factor(const VarDb &db, std::initializer_list<VarId> varset, std::initializer_list<VarId> clauseHead);
 
+      /// Value tables go back to FactorPool
+      virtual ~Factor();
+
       /// Set Value to any row (Clause) in a table
       /// @param instance InstanceId representing Clause (row) in this table
       /// @param val ValueType assigned to this row
@@ -662,6 +782,44 @@ namespace bayeslib
       /// Erase all ExtendedInfo from this Factor
       void EraseExtendedInfo();
 
+      /// Check if rows carry Clauses of ExtendedVarSet, sum-product Factors never do
+      /// @return true if backtracking information was produced by max-product
+      bool HasExtendedInfo() const { return !mExtendedClauseVector.empty(); }
+
+      /// Replace table with 8 or 16 bit codes, values are decoded when read. Quantized
+      /// Factor is immutable, it is meant for CPTs that never change after loading.
+      /// Zero rows stay zero and nonzero rows stay nonzero
+      /// @param mode QuantMode of codes
+      /// @return false if table is sparse, already in other codes or has negative values and was left unchanged
+      bool Quantize(QuantMode mode);
+
+      /// Get QuantMode of table, QuantMode_None for ValueType table
+      QuantMode GetQuantMode() const { return mQuantMode; }
+
+      /// Get number of bytes of value table in its current storage
+      size_t GetStorageBytes() const;
+
+      /// Keep only nonzero rows as ascending row numbers with their values, so zero rows of
+      /// deterministic CPTs cost nothing in Merge, EliminateVar, MaximizeVar, Slice and
+      /// FactorContraction. Sparse table never holds zero rows, HasVal reports stored rows only
+      /// @param bSparse true for sparse table, false for full table
+      /// @return false if table is quantized, has negative values, has extended clauses kept
+      /// per row of full table or more rows than u32 holds, and was left unchanged
+      bool SetSparse(bool bSparse);
+
+      /// Choose sparse table when share of nonzero rows is at most maxFill and full table
+      /// otherwise. Stored row of sparse table takes 8 bytes against 4 of full one, so with
+      /// 0.5 sparse table is never larger and does at most half of the work
+      /// @param maxFill largest share of nonzero rows kept in sparse table
+      /// @return true if table is sparse
+      bool SelectStorage(double maxFill = 0.5);
+
+      /// Check if table keeps nonzero rows only
+      bool IsSparse() const { return mSparse; }
+
+      /// Get share of nonzero rows in the table
+      double GetFill() const;
+
       /// Set VarType of Factor. Normally type of Factor is defined by type of single Variable in Head FactorSet
       /// @param enVarType VarType to assign to this Factor
  	   void SetFactorType(VarType enVarType) { mFactorType = enVarType; }
@@ -770,6 +928,14 @@ namespace bayeslib
      /// @return Factor with eliminated variable
      std::shared_ptr<Factor> PruneEdge(VarId v, VarState val);
 
+     /// Restrict Factor to observed states of all Clause variables in one pass. Unlike
+     /// ApplyClause the observed variables leave the VarSet and Head, so the result has
+     /// only the matching rows. Factor that shares no variable with Clause is returned
+     /// itself, without copy
+     /// @param c Clause with observed states
+     /// @return Factor over VarSet of this Factor minus Clause VarSet
+     std::shared_ptr<Factor> Slice(const Clause &c);
+
       // from UIElem
       /// produce Json representation of the Factor
       /// @param VarDb of domain variables
@@ -823,19 +989,87 @@ namespace bayeslib
 	  FactorLoader operator << (ValueType v);
 
     protected:
-
-        void Init();
+        friend class FactorContraction;
+
+        /// Factor with empty sparse table, rows are filled by the caller
+        Factor(const VarSet &vset, const VarSet &clauseHead, bool bSparse);
+
+        void Init(bool bSparse = false);
+
+        /// Position of row in sparse table, size of table if row is not stored
+        size_t SparsePos(InstanceId row) const;
+
+        /// Product of this sparse Factor and f driven by stored rows of the sparser one
+        std::shared_ptr<Factor> MergeSparse(std::shared_ptr<Factor> f, const VarSet &vsRes,
+           const VarSet &vsHead);
+
+        /// Moves states of Clause of one ExtendedVarSet into another by multipliers, so
+        /// max-product bookkeeping does not build Clause objects for every row
+        struct ExtendedMap
+        {
+           /// @param vsFrom ExtendedVarSet of operand
+           /// @param vsTo ExtendedVarSet of result
+           /// @param vsSkip variables of #vsFrom that are taken from other operand
+           void Init(const VarSet &vsFrom, const VarSet &vsTo, const VarSet &vsSkip);
+
+           /// InstanceId of #vsTo component for InstanceId of #vsFrom
+           InstanceId Map(InstanceId e) const
+           {
+              InstanceId res = 0;
+              for (size_t n = 0; n < mFrom.size(); n++)
+                 res += (e / mFrom[n]) % mDomain[n] * mTo[n];
+              return res;
+           }
+
+           std::vector<InstanceId> mFrom;   // multiplier in operand VarSet
+           std::vector<InstanceId> mDomain;
+           std::vector<InstanceId> mTo;     // multiplier in result VarSet
+        };
+
+        /// Reads rows of ValueType or quantized table, codes are decoded per row
+        struct ValueReader
+        {
+           ValueReader(const Factor &f);
+           ValueReader(const ValueType *pValues);
+
+           ValueType operator[](InstanceId n) const
+           {
+              if (mpValues)
+                 return mpValues[n];
+              if (mpCodes16)
+                 return mpCodes16[n] * mScale;
+              return (mpLog ? mpLog[mpCodes8[n]] : (ValueType) mpCodes8[n]) * mScale;
+           }
+
+           const ValueType *mpValues;       // ValueType table, 0 if quantized
+           const u8 *mpCodes8;
+           const u16 *mpCodes16;
+           const ValueType *mpLog;          // code to fraction of scale for QuantMode_Log8
+           ValueType mScale;
+        };
+
+        /// Table as ValueType array, quantized or sparse one is decoded into scratch taken from FactorPool
+        const ValueType *GetDenseValues(std::vector<ValueType> &scratch) const;
+
+        /// Reader of table, sparse one is expanded into scratch taken from FactorPool
+        ValueReader GetReader(std::vector<ValueType> &scratch) const;
 
         const VarDb &GetDb() { return mSet.GetDb(); }
 
-        std::bitset<MAX_SET_SIZE> mBsPresent;
-        std::map<VarId, int> mVarToIndex;      // variable to offset in varset
         VarSet mSet;
         unsigned int mFactorSize;
         std::vector<ValueType> mValues;
         std::vector<bool> mValuePresent;
         std::vector<InstanceId> mExtendedClauseVector;
 
+        QuantMode mQuantMode;
+        ValueType mScale;                // value of code 1 or largest value for QuantMode_Log8
+        std::vector<u8> mCodes8;
+        std::vector<u16> mCodes16;
+
+        bool mSparse;
+        std::vector<u32> mSparseRows;    // ascending rows of mValues when mSparse
+
         VarSet mClauseHead;  // refactor into mVarsetHead
         VarSet mExtendedVarSet;
         FactorExtender *mpExtender;
@@ -922,11 +1156,15 @@ namespace bayeslib
       /// @param db VarDb database of domain variables 
       FactorSet(VarDb &db);
 
+      /// Copy list of shared Factors and rebuild bucket index
+      FactorSet(const FactorSet &fs);
+
       /// Add Factor for FactorSet
       /// @param f Factor to add  
       void AddFactor(std::shared_ptr<Factor> f);
 
-      /// Merge all Factors in this FactorSet into single Factor
+      /// Merge all Factors in this FactorSet into single Factor. After MaximizeVar every
+      /// row of merged Factor gets extended clause traced back through backpointer tables
       /// @return merged Factor 
       std::shared_ptr<Factor> Merge();
 
@@ -940,11 +1178,21 @@ namespace bayeslib
       /// db database of Domain variables
       std::shared_ptr<VarSet> GetTypedVarSet(VarId vid, VarType vartype, VarDb &db);
 
-      /// Get all ancestors of the node
+      /// Get all ancestors of the node, looked up in DAG index that is built once 
+      /// and rebuilt after Factors are added or removed
       /// @param vid VarId of child node 
       /// @return uncestors of child node
       std::shared_ptr<VarSet> GetAncestors(VarId vid);
 
+      /// Get parents of the node: tail of first Factor with the node in its head
+      /// @param vid VarId of child node
+      /// @return VarSet of parents, empty for root nodes
+      VarSet GetParents(VarId vid);
+
+      /// Get all variables of FactorSet ordered so that parents come before children
+      /// @return VarIds in topological order
+      const std::vector<VarId> &GetTopologicalOrder();
+
       /// Get all ancestors of particular type
       /// @param vid VarId of child node 
       /// @param vartype VarType type of ancestors to look 
@@ -956,13 +1204,65 @@ namespace bayeslib
       std::shared_ptr<VarSet> GetLeafNodes() const;
 
       /// Run eliminate Variable algorithm on this FactorSet
-      /// @param vs VarSet of variables that will be eleminated
+      /// @param vs VarSet of variables that will be eleminated, in order chosen by 
+      /// PlanElimOrder unless planning is disabled
       void EliminateVar(const VarSet &vs);
 
-      /// Run Maximize Variable algorithm on this FactorSet
-      /// @param vs VarSet of variables that will be maximized
+      /// Run Maximize Variable algorithm on this FactorSet. Every bucket keeps a table with
+      /// winning state of maximized variable per row of its result instead of extended 
+      /// clauses, Merge traces them back
+      /// @param vs VarSet of variables that will be maximized, in order chosen by 
+      /// PlanElimOrder unless planning is disabled
       void MaximizeVar(const VarSet &vs);
 
+      /// Find K most probable assignments of all variables of this FactorSet. Buckets keep
+      /// K best values of every row with backpointers to ranks of their inputs, so cost is
+      /// about K*K times one MaximizeVar. FactorSet is not modified
+      /// @param nK number of assignments to find
+      /// @return up to #nK Factors with empty VarSet, best first. Value of each is the
+      /// probability of the assignment, its extended clause holds the assignment. 
+      /// Assignments of zero probability are not returned
+      std::vector<std::shared_ptr<Factor> > TopKMPE(int nK);
+
+      /// Choose order of elimination for variables of #vs. Order of #vs and orders of 
+      /// every ElimHeuristic of InteractionGraph over variables of #vs are replayed on
+      /// VarSets of current Factors, the one with the fewest visited rows wins, ties go
+      /// to the order of #vs. Empty or single variable #vs is returned as it is,
+      /// without building the InteractionGraph
+      /// @param vs VarSet of variables to eliminate
+      /// @param bMax true for MaximizeVar buckets, they include Decision Factors
+      /// @return VarSet with variables of #vs in chosen order
+      VarSet PlanElimOrder(const VarSet &vs, bool bMax = false);
+
+      /// Order used by last EliminateVar, MaximizeVar or PlanElimOrder
+      const VarSet &GetElimOrder() const { return mElimOrder; }
+
+      /// Rows of largest Factor created by the order returned from last PlanElimOrder
+      double GetPredictedPeakInstances() const { return mPredictedPeakInstances; }
+
+      /// Split Factors into connected components, Factors are connected when they share
+      /// a variable. After PruneEdges observed variables no longer connect their children
+      /// @return FactorSets sharing Factors with this one, in order of their first Factor
+      std::vector<std::shared_ptr<FactorSet> > GetComponents() const;
+
+      /// Sum out #vsEliminate and then maximize #vsMaximize in every connected component
+      /// on a pool of threads. Component results are multiplied: P(e) is the product of
+      /// component sums and MPE/MAP clauses are concatenated in extended VarSet.
+      /// Threads are started per call, so by default components with few rows in their
+      /// largest cliques are solved inline on the calling thread
+      /// @param vsEliminate VarSet of variables to sum out
+      /// @param vsMaximize VarSet of variables to maximize after summation
+      /// @param nThreads number of worker threads, 0 as used by MPE and MAP session commands
+      /// for hardware concurrency or inline for small components
+      /// @return same Factor as EliminateVar, MaximizeVar and Merge on this FactorSet
+      std::shared_ptr<Factor> SolveComponents(const VarSet &vsEliminate, 
+         const VarSet &vsMaximize, int nThreads = 0) const;
+
+      /// Enable or disable ordering by PlanElimOrder, when disabled variables are 
+      /// eliminated in order of VarSet passed by caller
+      void SetElimPlanning(bool bPlan) { mElimPlanning = bPlan; }
+      bool GetElimPlanning() const { return mElimPlanning; }
+
       /// Remove all Factors that contain given Variables in its Head VarSet
       /// @param vs VarSet of variables present in Factor's Head to be erased
       void RemoveVars(const VarSet &vs);
@@ -971,6 +1271,16 @@ namespace bayeslib
       /// @param vs VarSet of variables that will be be searched in the Head of leaf Factors. The matdhed factors will be removed
       void PruneVars(const VarSet &vs);
 
+      /// Remove Factors that are not requisite for query given evidence. Bayes-Ball
+      /// walk over DAG index marks variables whose Factors can change the answer, 
+      /// everything else is dropped. Unlike PruneVars this also drops evidence that is
+      /// d-separated from the query, so results are only proportional to the joint 
+      /// probabilities computed on the full FactorSet
+      /// @param vsQuery VarSet of query variables
+      /// @param evidence Clause with observed variables, only its VarSet is used
+      /// @return VarSet of head variables of removed Factors
+      VarSet PruneRequisite(const VarSet &vsQuery, const Clause &evidence);
+
       /// Remove Edes (rows in the factors) that contradict to the passed Clause
       /// @param c Clause that will be applied on Factors and contradicting rows will be removed
       void PruneEdges(const Clause &c);
@@ -980,6 +1290,25 @@ namespace bayeslib
       /// @param c Clause to be applied
       void ApplyClause(const Clause &c);
 
+      /// Reduce every Factor on observed variables in one pass with Factor::Slice, observed
+      /// variables leave the FactorSet and downstream merges work on smaller tables.
+      /// Factors left without variables are kept, so probability of evidence is preserved
+      /// @param c Clause with observed variables
+      void SliceEvidence(const Clause &c);
+
+      /// Replace every Factor except decision ones with its quantized copy, Factors
+      /// shared with other FactorSets are not changed. Factors with negative values
+      /// and Factors already quantized are kept
+      /// @param mode QuantMode of copies
+      /// @return number of quantized Factors
+      int Quantize(QuantMode mode);
+
+      /// Choose sparse or full table of every Factor except decision ones by its share of
+      /// nonzero rows, see Factor::SelectStorage. Factors changing storage are replaced by copies
+      /// @param maxFill largest share of nonzero rows kept in sparse table, negative for full tables
+      /// @return number of Factors that changed storage
+      int SelectStorage(double maxFill = 0.5);
+
       /// Solve this FactorSet to build DecisionBuildHelper which can be used to query the decisions based on Samples of Data
       /// @return DecisionBuilderHelper containing solution for this FactorSet
       std::shared_ptr<DecisionBuilderHelper> BuildDecision();
@@ -998,6 +1327,11 @@ namespace bayeslib
       /// @return ListFactors list of all factors in this FactorSet
       const ListFactors &GetFactors() { return mFactors; }
 
+      /// Get Factors that contain variable, looked up in bucket index
+      /// @param id VarId of variable
+      /// @return Factors in order of GetFactors
+      std::vector<std::shared_ptr<Factor> > GetFactors(VarId id) const;
+
 
       // from UIElem
       /// Get string Json representations of this FactorSet
@@ -1018,9 +1352,58 @@ namespace bayeslib
       VarDb &mDb;
       int mDebugLevel;
 
+      bool mElimPlanning;
+      VarSet mElimOrder;
+      double mPredictedPeakInstances;
+
+      /// Entry of bucket index, ordinal grows with position of Factor in mFactors
+      typedef std::pair<s64, ListFactors::iterator> BucketEntry;
+
+      /// Insert Factor into mFactors and bucket index
+      void PushFactor(std::shared_ptr<Factor> f, bool bFront = false);
+
+      /// Erase Factor from mFactors and bucket index
+      ListFactors::iterator EraseFactor(ListFactors::iterator iter);
+
+      /// Factors containing any variable of vs, in order of mFactors
+      std::vector<ListFactors::iterator> GetBucket(const VarSet &vs) const;
+
+      std::map<VarId, std::vector<BucketEntry> > mBuckets;   // Factors of every variable
+      s64 mFrontOrdinal;                        // last ordinal given by insert in front
+      s64 mBackOrdinal;                         // next ordinal given by insert at end
+
+      /// Backpointer table of one MaximizeVar bucket
+      struct ArgMaxStep
+      {
+         ArgMaxStep(VarId id, const VarSet &vs) : mVar(id), mScope(vs) {}
+
+         VarId mVar;                        // maximized variable
+         VarSet mScope;                     // VarSet of bucket result, rows of mArgMax
+         std::vector<VarState> mArgMax;     // winning state of mVar
+      };
+
+      /// Fill extended clause of every row of res with states of maximized variables
+      void TraceBack(Factor &res) const;
+
+      std::vector<ArgMaxStep> mArgMaxSteps;     // in order of maximization
+
+      /// Build parents, topological order and ancestors of every variable
+      void BuildDagIndex();
+
+      bool mDagValid;                           // DAG index matches mFactors
+      std::map<VarId, VarSet> mDagParents;      // tail of first Factor with variable in head
+      std::map<VarId, VarSet> mDagChildren;     // variables that have it as parent
+      std::map<VarId, VarSet> mDagAncestors;    // ancestors in order of recursive walk
+      std::vector<VarId> mDagOrder;             // parents before children
+
    };
 
 
+   /// Merge plan for two Factors. For every variable of the merged VarSet it holds
+   /// the domain size and the strides of this variable in both operands (0 if variable
+   /// is absent), so the product can be walked as an odometer that only adds and
+   /// subtracts strides. Plan is built by every Merge in time that depends on number
+   /// of variables only, plans reused across calls are kept by FactorContraction
    class FactorMergeHelper
    {
    public:
@@ -1035,34 +1418,470 @@ namespace bayeslib
       VarSet mV2;
       VarSet mVr;   // merged varset
 
-      std::map<int, int> mMap_Offs1_Offs2;
-      std::map<int, int> mMap_Offs1_OffsR;
-      std::map<int, int> mMap_Offs2_OffsR;
+      std::vector<int> mOffsR_Offs1;         // offset in mVr to offset in mV1, -1 if absent
+      std::vector<int> mOffsR_Offs2;         // offset in mVr to offset in mV2, -1 if absent
 
-      std::map<int, int> mMap_OffsR_Offs1;
-      std::map<int, int> mMap_OffsR_Offs2;
+      std::vector<int> mDomain;              // domain size per offset in mVr
+      std::vector<InstanceId> mStride1;      // stride in mV1 per offset in mVr
+      std::vector<InstanceId> mStride2;      // stride in mV2 per offset in mVr
+      std::vector<InstanceId> mRewind1;      // stride1*(domain-1), applied on digit wraparound
+      std::vector<InstanceId> mRewind2;      // stride2*(domain-1), applied on digit wraparound
 
    };
 
+   /// Fused product and reduction of several Factors.
+   /// Multiplies all input Factors and sums (or maximizes) out the eliminated
+   /// variables in one pass, only the reduced result table is allocated.
+   /// Result VarSet and Head follow the same order as FactorSet::Merge followed by
+   /// Factor::EliminateVar, so callers can replace one with the other.
+   /// Plan is compiled once in constructor: for every input it holds strides of the
+   /// result variables and offsets of every instance of the eliminated variables
+   class FactorContraction
+   {
+   public:
+      /// Compile contraction plan
+      /// @param factors input Factors, multiplied in list order
+      /// @param vsEliminate variables to reduce, variables not present in any input are ignored
+      FactorContraction(const std::vector<std::shared_ptr<Factor> > &factors,
+         const VarSet &vsEliminate);
+
+      /// Multiply inputs and sum out eliminated variables
+      /// @return Factor over result VarSet
+      std::shared_ptr<Factor> Sum();
+
+      /// Multiply inputs and max out eliminated variables. Winning states of eliminated
+      /// variables are recorded in extended clause of every row, ties are resolved to
+      /// the highest state as in Factor::MaximizeVar
+      /// @return Factor over result VarSet
+      std::shared_ptr<Factor> Max();
+
+      /// Multiply inputs and sum out into preallocated Factor. Inputs are read when
+      /// called, so their values may be rewritten between calls
+      /// @param res Factor created with CreateResult
+      void Sum(Factor &res);
+
+      /// Multiply inputs and max out into preallocated Factor
+      /// @param res Factor created with CreateResult
+      void Max(Factor &res);
+
+      /// Multiply inputs and max out single variable without extended clauses. Winning
+      /// state of every row is written into compact backpointer table instead
+      /// @param res Factor created with CreateResult
+      /// @param argMax receives winning state of eliminated variable for every row of #res
+      void Max(Factor &res, std::vector<VarState> &argMax);
+
+      /// Allocate Factor over result VarSet and Head to be filled by Sum or Max
+      std::shared_ptr<Factor> CreateResult() const;
+
+      /// Get VarSet of Factor produced by this contraction
+      const VarSet &GetResultVarSet() const { return mVOut; }
+
+      /// Get VarSet of variables reduced by this contraction
+      const VarSet &GetEliminatedVarSet() const { return mVElim; }
+
+      /// Contract a batch of value tables in one pass. Batched tables hold nBatch values
+      /// per row with batch index innermost, other inputs are read from Factors passed
+      /// to constructor and are shared by all batch elements
+      /// @param bMax max out instead of sum out
+      /// @param inputs value table of every batched input, in order of Factors passed to constructor
+      /// @param batched true for inputs laid out as [row][batch]
+      /// @param nBatch number of batch elements
+      /// @param pRes result table [row][batch]
+      /// @param pArgMax for bMax, receives [row][batch] winning instance of eliminated VarSet
+      void RunBatch(bool bMax, const std::vector<const ValueType *> &inputs,
+         const std::vector<bool> &batched, size_t nBatch, ValueType *pRes, InstanceId *pArgMax) const;
+
+   protected:
+      /// @param pArgMax for bMax, receives winning elimination instance of every row in
+      /// place of extended clauses
+      void Run(bool bMax, Factor &res, VarState *pArgMax = 0);
+
+      /// Run driven by stored rows of sparse input nDriver, its zero rows are never visited
+      void RunSparse(bool bMax, Factor &res, VarState *pArgMax, size_t nDriver,
+         const std::vector<Factor::ExtendedMap> &maps, const std::vector<InstanceId> &elimExtended);
+
+      /// Check if any full table input holds a negative value, max-product of a sparse
+      /// driver is then run on full tables
+      bool HasNegativeInput() const;
+
+      /// Advance odometer to next row of result
+      /// @param digits state of every result variable
+      /// @param base row of every input at eliminated clause 0
+      void NextOutRow(std::vector<int> &digits, std::vector<InstanceId> &base) const;
+
+      std::vector<std::shared_ptr<Factor> > mFactors;
+      VarSet mVOut;                          // result varset
+      VarSet mVHead;                         // head of result
+      VarSet mVElim;                         // eliminated vars present in inputs
+
+      std::vector<int> mOutDomain;           // domain size per offset in mVOut
+      std::vector<InstanceId> mOutStride;    // [offset in mVOut][input] stride of input
+      std::vector<InstanceId> mOutRewind;    // [offset in mVOut][input] stride*(domain-1)
+      std::vector<InstanceId> mElimOffs;     // [elim instance][input] offset of elim clause in input
+   };
+
+   /// Inference plan compiled once for a model, query VarSet and evidence VarSet.
+   /// Constructor runs PruneVars, picks elimination order from InteractionGraph and
+   /// compiles a FactorContraction with preallocated result Factor for every bucket.
+   /// Evidence is sliced out of model Factors by one-hot indicator Factors, so every
+   /// Run only rewrites indicators and replays the schedule, no Factor is allocated
+   /// @ingroup API
+   class CompiledQuery : public UIElem
+   {
+   public:
+      /// Kind of answer produced by Run
+      enum QueryOp
+      {
+         QueryOp_Marginal = 0,  ///< sum out hidden variables, result is P(query, evidence)
+         QueryOp_Map = 1        ///< sum out hidden and max out query variables
+      };
+
+      /// Compile plan
+      /// @param fs FactorSet with Bayesian network, it is not modified
+      /// @param vsQuery variables of the answer, all non evidence variables for MPE
+      /// @param vsEvidence variables whose values are passed to Run
+      /// @param op QueryOp kind of answer
+      CompiledQuery(FactorSet &fs, const VarSet &vsQuery, const VarSet &vsEvidence,
+         QueryOp op = QueryOp_Map);
+
+      /// Replay plan for evidence values
+      /// @param evidence Clause assigning every variable of evidence VarSet
+      /// @return Factor over query VarSet for QueryOp_Marginal, single row Factor with
+      /// extended clause of winning query states for QueryOp_Map. Factor is owned
+      /// by the plan and is overwritten by the next Run
+      std::shared_ptr<Factor> Run(const Clause &evidence);
+
+      /// Replay plan for many evidence Clauses in one pass. Every intermediate table
+      /// keeps values of all Clauses of a row next to each other, so the plan is walked
+      /// once per batch. QueryOp_Marginal with empty query VarSet gives P(evidence)
+      /// @param evidence Clauses assigning every variable of evidence VarSet
+      /// @return Factor per Clause with the same values as returned by Run
+      std::vector<std::shared_ptr<Factor> > RunBatch(const std::vector<Clause> &evidence);
+
+      const VarSet &GetQueryVarSet() const { return mVQuery; }
+      const VarSet &GetEvidenceVarSet() const { return mVEvidence; }
+
+      /// Get number of contractions replayed by Run
+      size_t GetStepCount() const { return mSteps.size(); }
+
+      /// Get number of rows of largest intermediate Factor
+      InstanceId GetPeakInstances() const;
+
+      // from UIElem
+      virtual std::string GetJson(const VarDb &db) const override;
+      virtual std::string GetType() const override;
+
+   protected:
+      /// Contraction and its result buffer
+      class Step
+      {
+      public:
+         std::shared_ptr<FactorContraction> mContraction;
+         std::shared_ptr<Factor> mResult;
+         bool mMax;
+         std::vector<int> mInputBuffers;     // batch buffer of every input, -1 for model Factor
+      };
+
+      std::shared_ptr<Factor> AddStep(const std::vector<std::shared_ptr<Factor> > &inputs,
+         const VarSet &vsEliminate, bool bMax);
+
+      VarSet mVQuery;
+      VarSet mVEvidence;
+      QueryOp mOp;
+      std::vector<std::shared_ptr<Factor> > mIndicators;   // per evidence variable
+      std::vector<Step> mSteps;
+      std::shared_ptr<Factor> mResult;
+
+      std::vector<std::vector<ValueType> > mBatchValues;    // [indicator, step][row][batch]
+      std::vector<std::vector<InstanceId> > mBatchArgMax;   // [step][row][batch] for max steps
+   };
+
+   /// Clique tree compiled from FactorSet. Cliques are formed by eliminating variables
+   /// in order produced by InteractionGraph::GetElimOrder, every Factor is assigned to
+   /// a clique that contains its VarSet. Calibration runs one collect and one distribute 
+   /// pass of sum-product messages, after that marginals of every variable and every
+   /// family contained in a clique are available for the same evidence.
+   /// Factors of Decision nodes are not part of the tree
+   /// @ingroup API
+   class JunctionTree : public UIElem
+   {
+   public:
+      /// Compile clique tree
+      /// @param fs FactorSet with Bayesian network, its Factors are shared, not copied 
+      JunctionTree(FactorSet &fs);
+
+      /// Propagate evidence through the tree
+      /// @param evidence Clause with observed variables, empty Clause calibrates priors
+      void Calibrate(const Clause &evidence);
+
+      /// Get posterior distribution of variable after Calibrate
+      /// @param id VarId of variable
+      /// @return normalized Factor over #id, empty Factor if variable is not in the tree
+      std::shared_ptr<Factor> GetMarginal(VarId id);
+
+      /// Get posterior joint distribution of variables present together in one clique,
+      /// for example a node and its parents
+      /// @param vs VarSet of variables
+      /// @return normalized Factor over #vs in order of #vs, empty Factor if no clique contains #vs
+      std::shared_ptr<Factor> GetMarginal(const VarSet &vs);
+
+      /// Probability of evidence passed to last Calibrate
+      ValueType GetEvidenceProbability() const;
+
+      /// Natural logarithm of probability of evidence, does not underflow on large models
+      double GetLogEvidenceProbability() const { return mLogEvidence; }
+
+      /// Get number of cliques in the tree
+      size_t GetCliqueCount() const { return mCliques.size(); }
+
+      /// Get VarSet of largest clique, its size is the induced width of elimination order plus 1
+      VarSet GetLargestClique() const;
+
+      // from UIElem
+      virtual std::string GetJson(const VarDb &db) const override;
+      virtual std::string GetType() const override;
+
+   protected:
+      /// Node of clique tree
+      class Clique
+      {
+      public:
+         Clique(const VarDb &db) : mVars(db), mSeparator(db), mParent(-1) {}
+
+         VarSet mVars;
+         VarSet mSeparator;                     // variables shared with parent
+         int mParent;                           // -1 for root
+         std::vector<int> mChildren;
+         std::vector<std::shared_ptr<Factor> > mFactors;   // assigned Factors
+         std::shared_ptr<Factor> mPotential;    // product of assigned Factors
+         std::shared_ptr<Factor> mEvidencePotential;       // mPotential with evidence applied
+         std::shared_ptr<Factor> mUpMessage;    // message to parent over mSeparator
+         std::shared_ptr<Factor> mDownMessage;  // message from parent over mSeparator
+         std::shared_ptr<Factor> mBelief;       // calibrated, not normalized
+      };
+
+      std::shared_ptr<Factor> MessageProduct(int nClique, int nExcludeChild, const VarSet &vsEliminate);
+      static double NormalizeFactor(std::shared_ptr<Factor> f);
+
+      const VarDb &mDb;
+      std::vector<Clique> mCliques;
+      std::vector<int> mOrder;                  // children before parents
+      double mLogEvidence;
+   };
+
    // extern VarDb gVarDb;
 
+   /// Heuristic used by InteractionGraph::GetElimOrder to pick next variable
+   enum ElimHeuristic
+   {
+      ElimHeuristic_MinDegree = 0,        ///< fewest neighbours
+      ElimHeuristic_MinFill = 1,          ///< fewest edges added between neighbours
+      ElimHeuristic_WeightedMinFill = 2,  ///< added edges weighted by log state space of their ends
+      ElimHeuristic_MinSize = 3           ///< smallest state space of created clique
+   };
+
+   /// Undirected graph of variables sharing a Factor, adjacency is kept as one bitset 
+   /// row per variable
    class InteractionGraph
    {
    public:
       InteractionGraph(FactorSet *pFs);
 
-      VarSet GetElimOrder();
+      /// Build elimination order, graph is not modified so orders of several heuristics
+      /// can be compared. Variables without neighbours are not part of the order
+      /// unless a single variable is left
+      /// @param heuristic ElimHeuristic used to pick next variable, ties go to the first 
+      /// variable of FactorSet VarSet
+      VarSet GetElimOrder(ElimHeuristic heuristic = ElimHeuristic_MinDegree);
 
+      /// Build elimination order of variables of vsElim only, the other variables stay in
+      /// the graph and add to costs and cliques of the ones eliminated
+      /// @param heuristic ElimHeuristic used to pick next variable
+      /// @param vsElim variables to eliminate
+      VarSet GetElimOrder(ElimHeuristic heuristic, const VarSet &vsElim);
 
+      /// Induced width of last order built by GetElimOrder, size of largest clique minus 1
+      int GetInducedWidth() const { return mInducedWidth; }
 
-   protected:
+      /// Number of rows in Factor over largest clique of last order built by GetElimOrder, 
+      /// kept in double as it may not fit InstanceId
+      double GetMaxCliqueInstances() const { return mMaxCliqueInstances; }
 
-      bool FindEdge(VarId id1, VarId id2);
+   protected:
+      /// Cost of eliminating row n under heuristic
+      double ElimCost(ElimHeuristic heuristic, const std::vector<u64> &adj, size_t n,
+         int &nDegree, std::vector<size_t> &neighbours) const;
 
       VarSet mVarSet;
-      using EdgesMap = std::multimap<VarId, VarId>;
-      EdgesMap  mEdges;
+      std::vector<VarId> mIds;            // variable of every row
+      std::vector<double> mLogDomain;     // log of domain size of every row
+      size_t mWords;                      // u64 words per row
+      std::vector<u64> mAdjacency;        // [row][word]
+
+      int mInducedWidth;
+      double mMaxCliqueInstances;
+   };
+
+   /// Anytime depth first branch and bound search for MPE. Variables are assigned in
+   /// reverse of InteractionGraph elimination order, every node is bounded by static
+   /// mini-bucket heuristic: buckets are split into mini-buckets of at most i-bound + 1
+   /// variables and maximized separately, so their messages never exceed the i-bound and
+   /// give an upper bound of the best completion. Values are kept in log domain
+   /// @ingroup API
+   class BranchAndBoundMpe : public UIElem
+   {
+   public:
+      /// Compile mini-bucket heuristic. Evidence is expected to be applied by
+      /// FactorSet::ApplyClause, zeroed rows are pruned by the search
+      /// @param fs FactorSet with Factors of the model
+      /// @param nIBound largest number of variables of mini-bucket message
+      /// @param heuristic ElimHeuristic of elimination order
+      BranchAndBoundMpe(FactorSet &fs, int nIBound = 10,
+         ElimHeuristic heuristic = ElimHeuristic_MinFill);
+
+      /// Continue search until every node is explored or the deadline expires. Can
+      /// be called again to resume from where the previous call stopped
+      /// @param seconds time budget of this call, negative for no deadline
+      /// @return true if best assignment is proven to be MPE
+      bool Run(double seconds = -1);
+
+      /// Get probability of best assignment found so far, 0 before first one
+      ValueType GetBestValue() const;
 
+      /// Get best assignment found so far, over all variables of FactorSet
+      Clause GetBestClause() const;
+
+      /// Get upper bound on MPE probability: mini-bucket bound until search completes
+      ValueType GetUpperBound() const;
+
+      /// Get log of ratio between upper bound and best value, 0 when proven optimal
+      double GetLogGap() const;
+
+      /// Get number of nodes expanded by all calls of Run
+      u64 GetNodeCount() const { return mNodes; }
+
+      /// Get number of variables of largest mini-bucket message
+      int GetMaxMessageSize() const { return mMaxMessageSize; }
+
+      // from UIElem
+      virtual std::string GetJson(const VarDb &db) const override;
+      virtual std::string GetType() const override;
+
+   protected:
+      /// Table evaluated at assignment of search variables
+      class Function
+      {
+      public:
+         std::shared_ptr<Factor> mFactor;
+         int mPlace;          // depth where all variables are assigned, -1 for constants
+      };
+
+      /// Open node of search, children are sorted by bound
+      class Level
+      {
+      public:
+         double mLogG;                                       // Factors fully assigned
+         std::vector<std::pair<double, VarState> > mChildren;
+         size_t mNext;
+      };
+
+      double LogValue(const Function &fn) const;
+      void Expand(int depth, double logG);
+
+      const VarDb &mDb;
+      VarSet mVarSet;                        // variables in search order
+      std::vector<VarId> mOrder;             // search order
+      std::vector<Function> mFunctions;      // Factors of model
+      std::vector<Function> mMessages;       // mini-bucket messages
+      std::vector<std::vector<int> > mFunctionsAt;   // [depth] Factors placed at depth
+      std::vector<std::vector<int> > mMessagesAt;    // [depth] messages in bound after depth
+      double mLogConst;                      // Factors and messages without variables
+      double mLogRootBound;
+      int mMaxMessageSize;
+
+      std::vector<VarState> mStates;         // [VarId] current assignment
+      std::vector<Level> mStack;
+      bool mStarted;
+      bool mDone;
+      double mLogBest;
+      std::vector<VarState> mBestStates;     // [VarId]
+      u64 mNodes;
+   };
+
+   /// Approximate sum-product elimination with bounded memory. Buckets of InteractionGraph
+   /// elimination order are split into mini-buckets of at most i-bound + 1 variables and
+   /// at most given number of rows, so no message is larger than the cap. Two passes are
+   /// run: the upper one reduces R mini-buckets of a bucket by weighted power sums
+   /// (sum f^R)^(1/R), which bound the exact sum by Hoelder inequality; the lower one
+   /// sums out the first mini-bucket and minimizes the others. Messages are rescaled to
+   /// their largest value, scales are kept in log domain.
+   /// Factors of Decision nodes are not eliminated
+   /// @ingroup API
+   class MiniBucketElimination : public UIElem
+   {
+   public:
+      /// Compile elimination order. Evidence is expected to be applied by
+      /// FactorSet::PruneEdges and FactorSet::ApplyClause
+      /// @param fs FactorSet with Factors of the model, Factors are shared, not copied
+      /// @param nIBound largest number of variables of mini-bucket message
+      /// @param maxCells largest number of rows of mini-bucket product, 0 for no limit
+      /// @param heuristic ElimHeuristic of elimination order
+      MiniBucketElimination(FactorSet &fs, int nIBound = 10, InstanceId maxCells = 0,
+         ElimHeuristic heuristic = ElimHeuristic_MinFill);
+
+      /// Eliminate all variables but one and bound probability of evidence
+      /// @param idQuery VarId of variable to keep for GetMarginal, 0 to eliminate all
+      void Run(VarId idQuery = 0);
+
+      /// Geometric mean of bounds on probability of evidence
+      ValueType GetEvidenceProbability() const;
+
+      /// Natural logarithm of upper bound on probability of evidence
+      double GetLogUpperBound() const { return mLogUpper; }
+
+      /// Natural logarithm of lower bound on probability of evidence
+      double GetLogLowerBound() const { return mLogLower; }
+
+      /// Get approximate posterior of query variable, normalized upper pass
+      /// @return Factor over query variable, empty Factor if Run had no query
+      std::shared_ptr<Factor> GetMarginal() const;
+
+      /// Get lower bounds of posterior of every state of query variable
+      std::shared_ptr<Factor> GetMarginalLower() const;
+
+      /// Get upper bounds of posterior of every state of query variable
+      std::shared_ptr<Factor> GetMarginalUpper() const;
+
+      /// Get number of variables of largest message of last Run
+      int GetMaxMessageSize() const { return mMaxMessageSize; }
+
+      /// Get number of rows of largest mini-bucket product of last Run
+      InstanceId GetMaxMessageCells() const { return mMaxMessageCells; }
+
+      // from UIElem
+      virtual std::string GetJson(const VarDb &db) const override;
+      virtual std::string GetType() const override;
+
+   protected:
+      double Eliminate(bool bUpper, VarId idQuery, std::vector<ValueType> &query);
+      std::shared_ptr<Factor> Reduce(const std::vector<std::shared_ptr<Factor> > &mini,
+         VarId id, int nPower);
+      std::shared_ptr<Factor> CreateMarginal(const std::vector<ValueType> &values) const;
+
+      const VarDb &mDb;
+      std::vector<std::shared_ptr<Factor> > mFactors;
+      std::vector<VarId> mOrder;             // elimination order
+      int mIBound;
+      InstanceId mMaxCells;
+
+      VarId mQuery;
+      std::vector<ValueType> mQueryUpper;    // [state] bound of joint with evidence, scaled
+      std::vector<ValueType> mQueryLower;    // [state] bound of joint with evidence, scaled
+      double mLogUpper;
+      double mLogLower;
+      double mLogScaleGap;                   // log of mQueryUpper scale over mQueryLower scale
+      int mMaxMessageSize;
+      InstanceId mMaxMessageCells;
    };
 
 
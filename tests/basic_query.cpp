@@ -160,4 +160,47 @@ int Test1_3()
 }
 
 
+/** Enumerate clauses of mixed domain VarSet with Incr and Decr and
+    compare states against clauses decoded from InstanceId
+*/
+int Test1_4()
+{
+   VarDb db;
+
+   db.AddVar("injury");
+   db.AddVar("prep", { "low", "mid", "high" });
+   db.AddVar("result", { "lost", "draw", "won" });
+
+   VarSet vs(db, { db["result"], db["injury"], db["prep"] });
+   Clause cl(vs);
+   InstanceId n = 0;
+   do
+   {
+      Clause clRef(vs, n);
+      EXPECT_EQ(n, cl.GetInstanceId());
+      for (VarId id = vs.GetFirst(); id != 0; id = vs.GetNext(id))
+         EXPECT_EQ(clRef.GetVar(id), cl.GetVar(id));
+      n++;
+   } while (!cl.Incr());
+   EXPECT_EQ(vs.GetInstances(), n);
+
+   EXPECT_TRUE(cl.Decr());
+   EXPECT_EQ(vs.GetInstances() - 1, cl.GetInstanceId());
+   EXPECT_EQ(2, cl.GetVar(db["prep"]));
+
+   // adding variable keeps values of others, copies do not share states
+   db.AddVar("coach");
+   Clause cl2 = cl;
+   cl2.AddVar(db["coach"], 1);
+   EXPECT_EQ(2, cl2.GetVar(db["prep"]));
+   EXPECT_EQ(cl.GetInstanceId(), cl2.GetInstanceId(vs));
+   cl2.SetVar(db["result"], 1);
+   EXPECT_EQ(2, cl.GetVar(db["result"]));
+   EXPECT_EQ(1, cl2.GetVar(db["result"]));
+   EXPECT_FALSE(cl.GetVarSet().HasVar(db["coach"]));
+
+   return 0;
+}
+
+
 /// \}
@@ -0,0 +1,115 @@
+/*
+* Copyright (C) 2017 Boris Altshul.
+* All rights reserved.
+*
+* The software in this package is published under the terms of the BSD
+* style license a copy of which has been included with this distribution in
+* the LICENSE.txt file.
+*/
+
+#include <factor.h>
+#include <Factories.h>
+#include <json/json.h>
+#include <gtest/gtest.h>
+
+
+using namespace bayeslib;
+
+int CreateRainTest(VarDb &db, FactorSet &fs);
+int InitLargeTest(VarDb &db, FactorSet &fs);
+
+/// \file
+/// \ingroup branchAndBound
+/// \{
+
+/// Product of all factors of fs at assignment cl
+static ValueType
+ProductAt(FactorSet &fs, const Clause &cl)
+{
+   ValueType res = 1;
+   for (auto &f : fs.GetFactors())
+      res *= f->Get(cl.GetInstanceId(f->GetVarSet()));
+   return res;
+}
+
+/** Rain example: search with every i-bound finds largest row of the joint,
+    bound is never below it and gap closes when search completes
+*/
+int BranchAndBoundTest1()
+{
+   VarDb db;
+   FactorSet fs(db);
+   CreateRainTest(db, fs);
+   std::shared_ptr<Factor> fJoint = fs.Merge();
+   ValueType best = 0;
+   for (InstanceId n = 0; n < fJoint->GetVarSet().GetInstances(); n++)
+      best = std::max(best, fJoint->Get(n));
+
+   for (int nIBound = 0; nIBound <= 3; nIBound++)
+   {
+      BranchAndBoundMpe bb(fs, nIBound);
+      EXPECT_GE(bb.GetUpperBound(), best * 0.9999);
+      EXPECT_TRUE(bb.Run());
+      EXPECT_NEAR(best, bb.GetBestValue(), 0.00001);
+      EXPECT_NEAR(best, ProductAt(fs, bb.GetBestClause()), 0.00001);
+      EXPECT_EQ(0, bb.GetLogGap());
+      // single factor wider than i-bound still makes its own mini-bucket
+      if (nIBound >= 2)
+      {
+         EXPECT_LE(bb.GetMaxMessageSize(), nIBound);
+      }
+   }
+   return 0;
+}
+
+/** Carrier network with drop evidence against MaximizeVar, small i-bound gives
+    looser bound and expands more nodes. Search stopped before first node still
+    reports bound, deadline allows to resume
+*/
+int BranchAndBoundTest2()
+{
+   VarDb db;
+   FactorSet fs(db);
+   InitLargeTest(db, fs);
+   Clause cSample(VarSet(db, { db["drhi3_1"], db["drlo3_1"], db["drloa3_1"] }));
+   cSample.SetVar(db["drhi3_1"], true);
+   cSample.SetVar(db["drlo3_1"], true);
+   cSample.SetVar(db["drloa3_1"], true);
+   fs.PruneEdges(cSample);
+   fs.ApplyClause(cSample);
+
+   FactorSet fsMpe(fs);
+   fsMpe.MaximizeVar(*fs.GetVarSet());
+   ValueType best = fsMpe.Merge()->Get(0);
+
+   BranchAndBoundMpe bbLoose(fs, 1);
+   BranchAndBoundMpe bbTight(fs, 10);
+   EXPECT_GE(bbLoose.GetUpperBound(), bbTight.GetUpperBound() * 0.9999);
+   EXPECT_GE(bbTight.GetUpperBound(), best * 0.9999);
+   EXPECT_TRUE(bbLoose.Run());
+   EXPECT_TRUE(bbTight.Run());
+   EXPECT_LE(bbTight.GetNodeCount(), bbLoose.GetNodeCount());
+   printf("loose %s\ntight %s\n", bbLoose.GetJson(db).c_str(), bbTight.GetJson(db).c_str());
+
+   for (BranchAndBoundMpe *pBb : { &bbLoose, &bbTight })
+   {
+      EXPECT_NEAR(best, pBb->GetBestValue(), best * 0.0001);
+      Clause cl = pBb->GetBestClause();
+      EXPECT_EQ(1, cl.GetVar(db["drhi3_1"]));
+      EXPECT_NEAR(best, ProductAt(fs, cl), best * 0.0001);
+   }
+
+   BranchAndBoundMpe bbStop(fs, 1);
+   bool bDone = bbStop.Run(0);
+   while (!bDone)
+   {
+      EXPECT_GT(bbStop.GetLogGap(), -0.0001);
+      EXPECT_GE(bbStop.GetUpperBound(), best * 0.9999);
+      bDone = bbStop.Run(0);
+   }
+   EXPECT_NEAR(best, bbStop.GetBestValue(), best * 0.0001);
+   EXPECT_EQ(bbLoose.GetNodeCount(), bbStop.GetNodeCount());
+   return 0;
+}
+
+/// \}
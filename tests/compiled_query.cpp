@@ -0,0 +1,239 @@
+/*
+* Copyright (C) 2017 Boris Altshul.
+* All rights reserved.
+*
+* The software in this package is published under the terms of the BSD
+* style license a copy of which has been included with this distribution in
+* the LICENSE.txt file.
+*/
+
+#include <factor.h>
+#include <Factories.h>
+#include <json/json.h>
+#include <gtest/gtest.h>
+
+
+using namespace bayeslib;
+
+int InitLargeTest(VarDb &db, FactorSet &fs);
+
+/// \file
+/// \ingroup compiledQuery
+/// \{
+
+static VarSet
+CompiledQuerySolveVarSet(VarDb &db)
+{
+   VarSet vsSolve(db);
+   vsSolve << db["cjl1_1"] << db["cjl1_2"] << db["cjl1"];
+   vsSolve << db["cjl2_1"] << db["cjl2_2"] << db["cjl2"];
+   vsSolve << db["cjl3_1"] << db["cjl3_2"] << db["cjl3"];
+   vsSolve << db["cjl4_1"] << db["cjl4_2"] << db["cjl4"];
+   vsSolve << db["cjE"];
+   return vsSolve;
+}
+
+/// Drop measurements of link 3, every other measurement is false
+static Clause
+CompiledQuerySample(VarDb &db, const VarSet &vsSample, bool bLo3_2)
+{
+   Clause cSample(vsSample);
+   cSample.SetVar(db["drhi3_1"], true);
+   cSample.SetVar(db["drlo3_1"], true);
+   cSample.SetVar(db["drhi3_2"], false);
+   cSample.SetVar(db["drlo3_2"], bLo3_2);
+   cSample.SetVar(db["drhia3_1"], false);
+   cSample.SetVar(db["drloa3_1"], true);
+   cSample.SetVar(db["drhia3_2"], false);
+   return cSample;
+}
+
+/** Run MPE plan of the carrier network for several drop readings and compare
+    with PruneEdges, ApplyClause and MaximizeVar run on a copy of FactorSet
+*/
+int CompiledQueryTest1()
+{
+   VarDb db;
+   FactorSet fs(db);
+   InitLargeTest(db, fs);
+
+   VarSet vsSolve = CompiledQuerySolveVarSet(db);
+   VarSet vsSample = db.GetVarSet().Substract(vsSolve);
+
+   CompiledQuery query(fs, vsSolve, vsSample);
+   printf("\n==Compiled MPE==\n%s\n", query.GetJson(db).c_str());
+
+   for (bool bLo3_2 : { false, true, false })
+   {
+      Clause cSample = CompiledQuerySample(db, vsSample, bLo3_2);
+      std::shared_ptr<Factor> res = query.Run(cSample);
+      Clause clMpe(res->GetExtendedVarSet(), res->GetExtendedClause(0));
+
+      FactorSet fsCopy = fs;
+      fsCopy.PruneEdges(cSample);
+      fsCopy.ApplyClause(cSample);
+      fsCopy.MaximizeVar(db.GetVarSet());
+      std::shared_ptr<Factor> resRef = fsCopy.Merge();
+      Clause clRef(resRef->GetExtendedVarSet(), resRef->GetExtendedClause(0));
+
+      EXPECT_NEAR(resRef->Get(0), res->Get(0), resRef->Get(0) * 0.001);
+      for (VarId vid = vsSolve.GetFirst(); vid != 0; vid = vsSolve.GetNext(vid))
+         EXPECT_EQ(clRef.GetVar(vid), clMpe.GetVar(vid));
+
+      if (!bLo3_2)
+      {
+         // same answer as LargeTest1
+         EXPECT_NEAR(0.00024, res->Get(0), 0.00001);
+         EXPECT_TRUE(clMpe[db["cjl3_1"]]);
+         EXPECT_FALSE(clMpe[db["cjl3_2"]]);
+      }
+   }
+   return 0;
+}
+
+/** Run marginal plan over two query variables and compare with EliminateVar
+    run on a copy of FactorSet
+*/
+int CompiledQueryTest2()
+{
+   VarDb db;
+   FactorSet fs(db);
+   InitLargeTest(db, fs);
+
+   VarSet vsQuery(db, { db["cjl3"], db["cjE"] });
+   VarSet vsSample(db, { db["drhi3_1"], db["drlo3_1"], db["drhi3_2"], db["drloa3_1"] });
+
+   CompiledQuery query(fs, vsQuery, vsSample, CompiledQuery::QueryOp_Marginal);
+   EXPECT_EQ(vsQuery.GetJsonAbbrev(), query.Run(Clause(vsSample))->GetVarSet().GetJsonAbbrev());
+
+   for (InstanceId nSample = 0; nSample < vsSample.GetInstances(); nSample++)
+   {
+      Clause cSample(vsSample, nSample);
+      std::shared_ptr<Factor> res = query.Run(cSample);
+
+      FactorSet fsCopy = fs;
+      fsCopy.ApplyClause(cSample);
+      VarSet vsOrder = InteractionGraph(&fs).GetElimOrder();
+      vsOrder.Add(*fs.GetVarSet());
+      fsCopy.EliminateVar(vsOrder.Substract(vsQuery));
+      std::shared_ptr<Factor> resRef = fsCopy.Merge();
+
+      Clause cl(vsQuery);
+      do
+      {
+         EXPECT_NEAR(resRef->Get(cl.GetInstanceId(resRef->GetVarSet())), res->Get(cl.GetInstanceId()),
+            0.00001);
+      } while (!cl.Incr());
+   }
+   return 0;
+}
+
+/** Run batches of drop readings through MPE, marginal and P(e) plans in one pass
+    and compare every batch element with Run of the same plan
+*/
+int CompiledQueryTest3()
+{
+   VarDb db;
+   FactorSet fs(db);
+   InitLargeTest(db, fs);
+
+   VarSet vsSolve = CompiledQuerySolveVarSet(db);
+   VarSet vsSample = db.GetVarSet().Substract(vsSolve);
+
+   std::vector<Clause> batch;
+   for (InstanceId n = 0; n < 37; n++)
+      batch.push_back(Clause(vsSample, (n * 2654435761u) % vsSample.GetInstances()));
+   batch.push_back(CompiledQuerySample(db, vsSample, false));
+
+   CompiledQuery mpe(fs, vsSolve, vsSample);
+   CompiledQuery marginal(fs, VarSet(db, { db["cjl3"], db["cjE"] }), vsSample,
+      CompiledQuery::QueryOp_Marginal);
+   CompiledQuery evidence(fs, VarSet(db), vsSample, CompiledQuery::QueryOp_Marginal);
+
+   for (CompiledQuery *pQuery : { &mpe, &marginal, &evidence })
+   {
+      std::vector<std::shared_ptr<Factor> > res = pQuery->RunBatch(batch);
+      EXPECT_EQ(batch.size(), res.size());
+      for (size_t b = 0; b < batch.size(); b++)
+      {
+         std::shared_ptr<Factor> resRef = pQuery->Run(batch[b]);
+         EXPECT_EQ(resRef->GetVarSet().GetJsonAbbrev(), res[b]->GetVarSet().GetJsonAbbrev());
+         for (InstanceId n = 0; n < resRef->GetVarSet().GetInstances(); n++)
+            EXPECT_NEAR(resRef->Get(n), res[b]->Get(n), resRef->Get(n) * 0.0001);
+
+         if (pQuery != &mpe)
+            continue;
+         Clause clRef(resRef->GetExtendedVarSet(), resRef->GetExtendedClause(0));
+         Clause cl(res[b]->GetExtendedVarSet(), res[b]->GetExtendedClause(0));
+         for (VarId vid = vsSolve.GetFirst(); vid != 0; vid = vsSolve.GetNext(vid))
+            EXPECT_EQ(clRef.GetVar(vid), cl.GetVar(vid));
+      }
+   }
+
+   // last element is the sample of LargeTest1
+   std::vector<std::shared_ptr<Factor> > res = mpe.RunBatch(batch);
+   EXPECT_NEAR(0.00024, res.back()->Get(0), 0.00001);
+   return 0;
+}
+
+/** MAP of B over chain A -> B -> E with negative utility of B shared by every batch
+    element, so all products of the max step are negative. RunBatch, Run and maximum
+    over B of the joint summed over A have to agree
+*/
+int CompiledQueryTest4()
+{
+   VarDb db;
+   db.AddVar("A");
+   db.AddVar("B", { "0", "1", "2" });
+   db.AddVar("E");
+   VarId a = db["A"], b = db["B"], e = db["E"];
+
+   FactorSet fs(db);
+   std::shared_ptr<Factor> fA = std::make_shared<Factor>(VarSet(db, a), a);
+   Factor::FactorLoader flA(fA);
+   flA << 0.4F << 0.6F;
+   std::shared_ptr<Factor> fB = std::make_shared<Factor>(VarSet(db, { a, b }), b);
+   Factor::FactorLoader flB(fB);
+   flB << 0.2F << 0.5F << 0.3F << 0.1F << 0.2F << 0.7F;
+   std::shared_ptr<Factor> fE = std::make_shared<Factor>(VarSet(db, { b, e }), e);
+   Factor::FactorLoader flE(fE);
+   flE << 0.9F << 0.4F << 0.3F << 0.1F << 0.6F << 0.7F;
+   std::shared_ptr<Factor> fU = std::make_shared<Factor>(VarSet(db, b), b);
+   Factor::FactorLoader flU(fU);
+   flU << -3.0F << -1.0F << -2.0F;
+   for (auto &f : { fA, fB, fE, fU })
+      fs.AddFactor(f);
+   std::shared_ptr<Factor> fJoint = fs.Merge();
+
+   VarSet vsQuery(db, b);
+   VarSet vsEvidence(db, e);
+   std::vector<Clause> batch = { Clause(vsEvidence, 0), Clause(vsEvidence, 1) };
+   CompiledQuery map(fs, vsQuery, vsEvidence);
+   std::vector<std::shared_ptr<Factor> > res = map.RunBatch(batch);
+   for (size_t n = 0; n < batch.size(); n++)
+   {
+      std::vector<ValueType> sums(db.GetDomainSize(b), 0);
+      Clause cl(fJoint->GetVarSet());
+      do
+      {
+         if (cl.GetVar(e) == batch[n].GetVar(e))
+            sums[cl.GetVar(b)] += fJoint->Get(cl.GetInstanceId());
+      } while (!cl.Incr());
+      size_t bestState = 0;
+      for (size_t state = 1; state < sums.size(); state++)
+      {
+         if (sums[bestState] <= sums[state])
+            bestState = state;
+      }
+      EXPECT_GT(0, sums[bestState]);
+
+      std::shared_ptr<Factor> resRef = map.Run(batch[n]);
+      EXPECT_NEAR(sums[bestState], resRef->Get(0), 0.0001);
+      EXPECT_NEAR(sums[bestState], res[n]->Get(0), 0.0001);
+      EXPECT_EQ((VarState) bestState, Clause(resRef->GetExtendedVarSet(), resRef->GetExtendedClause(0)).GetVar(b));
+      EXPECT_EQ((VarState) bestState, Clause(res[n]->GetExtendedVarSet(), res[n]->GetExtendedClause(0)).GetVar(b));
+   }
+   return 0;
+}
+
+/// \}
@@ -0,0 +1,234 @@
+/*
+* Copyright (C) 2017 Boris Altshul.
+* All rights reserved.
+*
+* The software in this package is published under the terms of the BSD
+* style license a copy of which has been included with this distribution in
+* the LICENSE.txt file.
+*/
+
+#include <factor.h>
+#include <Factories.h>
+#include <json/json.h>
+#include <gtest/gtest.h>
+
+
+using namespace bayeslib;
+
+int CreateRainTest(VarDb &db, FactorSet &fs);
+
+/// \file
+/// \ingroup factorContraction
+/// \{
+
+static std::shared_ptr<Factor>
+ContractionTestFactor(const VarSet &vs, VarId head, InstanceId seed)
+{
+   std::shared_ptr<Factor> f = std::make_shared<Factor>(vs, head);
+   for (InstanceId n = 0; n < vs.GetInstances(); n++)
+      f->AddInstance(n, (ValueType)((n * 7919 + seed) % 17) / 17.0F);
+   return f;
+}
+
+/** Contract three factors sharing variable B and compare against
+    FactorSet::Merge followed by Factor::EliminateVar / Factor::MaximizeVar
+*/
+int ContractionTest1()
+{
+   VarDb db;
+   db.AddVar("A");
+   db.AddVar("B", { "0", "1", "2" });
+   db.AddVar("C");
+   db.AddVar("D", { "0", "1", "2", "3" });
+
+   std::vector<std::shared_ptr<Factor> > factors = {
+      ContractionTestFactor(VarSet(db, { db["A"], db["B"] }), db["B"], 1),
+      ContractionTestFactor(VarSet(db, { db["B"], db["C"], db["D"] }), db["C"], 2),
+      ContractionTestFactor(VarSet(db, { db["D"], db["B"] }), db["D"], 3) };
+
+   FactorSet fs(db);
+   for (auto &f : factors)
+      fs.AddFactor(f);
+   std::shared_ptr<Factor> fMerged = fs.Merge();
+
+   for (VarId id : { db["B"], db["D"] })
+   {
+      FactorContraction contraction(factors, VarSet(db, id));
+      std::shared_ptr<Factor> fSum = contraction.Sum();
+      std::shared_ptr<Factor> fSumRef = fMerged->EliminateVar(id);
+      EXPECT_EQ(fSumRef->GetVarSet().GetJsonAbbrev(), fSum->GetVarSet().GetJsonAbbrev());
+      EXPECT_TRUE(fSumRef->GetClauseHead() == fSum->GetClauseHead());
+      for (InstanceId n = 0; n < fSumRef->GetVarSet().GetInstances(); n++)
+         EXPECT_NEAR(fSumRef->Get(n), fSum->Get(n), 0.0001);
+
+      std::shared_ptr<Factor> fMax = contraction.Max();
+      std::shared_ptr<Factor> fMaxRef = fMerged->MaximizeVar(id);
+      EXPECT_EQ(fMaxRef->GetVarSet().GetJsonAbbrev(), fMax->GetVarSet().GetJsonAbbrev());
+      for (InstanceId n = 0; n < fMaxRef->GetVarSet().GetInstances(); n++)
+      {
+         EXPECT_NEAR(fMaxRef->Get(n), fMax->Get(n), 0.0001);
+         Clause cl(fMax->GetExtendedVarSet(), fMax->GetExtendedClause(n));
+         Clause clRef(fMaxRef->GetExtendedVarSet(), fMaxRef->GetExtendedClause(n));
+         EXPECT_EQ(clRef.GetVar(id), cl.GetVar(id));
+      }
+   }
+
+   // eliminate two variables at once
+   VarSet vsBD(db, { db["B"], db["D"] });
+   std::shared_ptr<Factor> fSum = FactorContraction(factors, vsBD).Sum();
+   std::shared_ptr<Factor> fSumRef = fMerged->EliminateVar(vsBD);
+   EXPECT_EQ(fSumRef->GetVarSet().GetJsonAbbrev(), fSum->GetVarSet().GetJsonAbbrev());
+   for (InstanceId n = 0; n < fSumRef->GetVarSet().GetInstances(); n++)
+      EXPECT_NEAR(fSumRef->Get(n), fSum->Get(n), 0.0001);
+
+   return 0;
+}
+
+/** Sum-product Merge carries no backtracking data. Max-product through Factor::MaximizeVar,
+    Factor::Merge and FactorContraction::Max has to trace back to the best row of the product
+*/
+int ContractionTest2()
+{
+   VarDb db;
+   db.AddVar("A");
+   db.AddVar("B", { "0", "1", "2" });
+   db.AddVar("C");
+   db.AddVar("D", { "0", "1", "2", "3" });
+
+   std::shared_ptr<Factor> f1 = ContractionTestFactor(VarSet(db, { db["A"], db["B"] }), db["B"], 1);
+   std::shared_ptr<Factor> f2 = ContractionTestFactor(VarSet(db, { db["B"], db["C"], db["D"] }), db["C"], 2);
+   std::shared_ptr<Factor> fFull = f1->Merge(f2);
+   EXPECT_FALSE(fFull->HasExtendedInfo());
+   EXPECT_FALSE(fFull->EliminateVar(db["B"])->Merge(f1)->HasExtendedInfo());
+   EXPECT_FALSE(FactorContraction({ f1, f2 }, VarSet(db, db["B"])).Sum()->HasExtendedInfo());
+
+   ValueType best = 0;
+   for (InstanceId n = 0; n < fFull->GetVarSet().GetInstances(); n++)
+      best = std::max(best, fFull->Get(n));
+
+   std::shared_ptr<Factor> m1 = f1->MaximizeVar(db["A"]);
+   std::shared_ptr<Factor> m2 = f2->MaximizeVar(db["D"])->MaximizeVar(db["C"]);
+   std::shared_ptr<Factor> fMerged = m1->Merge(m2);
+   EXPECT_TRUE(fMerged->HasExtendedInfo());
+   std::shared_ptr<Factor> results[] = { fMerged->MaximizeVar(db["B"]),
+      FactorContraction({ m1, m2 }, VarSet(db, db["B"])).Max() };
+
+   for (auto &res : results)
+   {
+      EXPECT_EQ(4u, res->GetExtendedVarSet().GetSize());
+      EXPECT_NEAR(best, res->Get(0), 0.0001);
+
+      // clause of extended VarSet has to select the best row of full product
+      Clause cl(res->GetExtendedVarSet(), res->GetExtendedClause(0));
+      EXPECT_NEAR(best, fFull->Get(cl.GetInstanceId(fFull->GetVarSet())), 0.0001);
+   }
+   return 0;
+}
+
+/** MPE of Rain example through FactorSet::MaximizeVar. Buckets keep only backpointer
+    tables, clause traced back by Merge has to select the best row of the joint
+*/
+int ContractionTest3()
+{
+   VarDb db;
+   FactorSet fs(db);
+   CreateRainTest(db, fs);
+   std::shared_ptr<Factor> fJoint = fs.Merge();
+   EXPECT_FALSE(fJoint->HasExtendedInfo());
+
+   ValueType best = 0;
+   for (InstanceId n = 0; n < fJoint->GetVarSet().GetInstances(); n++)
+      best = std::max(best, fJoint->Get(n));
+
+   VarSet vsAll = *fs.GetVarSet();
+   fs.MaximizeVar(vsAll);
+   for (auto &f : fs.GetFactors())
+      EXPECT_FALSE(f->HasExtendedInfo());
+
+   std::shared_ptr<Factor> res = fs.Merge();
+   EXPECT_NEAR(best, res->Get(0), 0.0001);
+   EXPECT_EQ(vsAll.GetSize(), res->GetExtendedVarSet().GetSize());
+   Clause cl(res->GetExtendedVarSet(), res->GetExtendedClause(0));
+   EXPECT_NEAR(best, fJoint->Get(cl.GetInstanceId(fJoint->GetVarSet())), 0.0001);
+
+   // Merge again gives the same clause and leaves Factors of the list untouched
+   std::shared_ptr<Factor> res2 = fs.Merge();
+   EXPECT_EQ(res->GetExtendedClause(0), res2->GetExtendedClause(0));
+   for (auto &f : fs.GetFactors())
+      EXPECT_FALSE(f->HasExtendedInfo());
+   return 0;
+}
+
+/** Max-product of utility-like Factor with negative values and positive Factor, every
+    product is negative and the best one is the closest to 0, as in Factor::MaximizeVar
+*/
+int ContractionTest4()
+{
+   VarDb db;
+   db.AddVar("A");
+   db.AddVar("B", { "0", "1", "2" });
+   db.AddVar("C");
+   db.AddVar("D", { "0", "1", "2", "3" });
+
+   std::shared_ptr<Factor> f1 = ContractionTestFactor(VarSet(db, { db["A"], db["B"] }), db["B"], 1);
+   std::shared_ptr<Factor> f2 = ContractionTestFactor(VarSet(db, { db["B"], db["C"], db["D"] }), db["C"], 2);
+   for (InstanceId n = 0; n < f1->GetVarSet().GetInstances(); n++)
+      f1->AddInstance(n, -0.1F - f1->Get(n));
+   for (InstanceId n = 0; n < f2->GetVarSet().GetInstances(); n++)
+      f2->AddInstance(n, 0.1F + f2->Get(n));
+   std::shared_ptr<Factor> fMerged = f1->Merge(f2);
+
+   for (VarId id : { db["B"], db["D"] })
+   {
+      std::shared_ptr<Factor> fMax = FactorContraction({ f1, f2 }, VarSet(db, id)).Max();
+      std::shared_ptr<Factor> fMaxRef = fMerged->MaximizeVar(id);
+      EXPECT_EQ(fMaxRef->GetVarSet().GetJsonAbbrev(), fMax->GetVarSet().GetJsonAbbrev());
+      for (InstanceId n = 0; n < fMaxRef->GetVarSet().GetInstances(); n++)
+      {
+         EXPECT_GT(0, fMax->Get(n));
+         EXPECT_NEAR(fMaxRef->Get(n), fMax->Get(n), 0.0001);
+         Clause cl(fMax->GetExtendedVarSet(), fMax->GetExtendedClause(n));
+         Clause clRef(fMaxRef->GetExtendedVarSet(), fMaxRef->GetExtendedClause(n));
+         EXPECT_EQ(clRef.GetVar(id), cl.GetVar(id));
+      }
+   }
+   return 0;
+}
+
+/** Factor::Merge against product computed row by row from Clauses, for operands
+    with disjoint, interleaved and reordered VarSets over domains of different size
+*/
+int MergeTest1()
+{
+   VarDb db;
+   db.AddVar("A");
+   db.AddVar("B", { "0", "1", "2" });
+   db.AddVar("C");
+   db.AddVar("D", { "0", "1", "2", "3" });
+   VarId a = db["A"], b = db["B"], c = db["C"], d = db["D"];
+
+   std::vector<std::pair<VarSet, VarSet> > shapes = {
+      { VarSet(db, { a, b }), VarSet(db, { c, d }) },
+      { VarSet(db, { a, b, c }), VarSet(db, { d, b }) },
+      { VarSet(db, { a, b, d }), VarSet(db, { d, b, a }) },
+      { VarSet(db, { d }), VarSet(db, { b, c, d, a }) } };
+   for (auto &shape : shapes)
+   {
+      std::shared_ptr<Factor> f1 = ContractionTestFactor(shape.first, shape.first.GetFirst(), 1);
+      std::shared_ptr<Factor> f2 = ContractionTestFactor(shape.second, shape.second.GetFirst(), 2);
+      std::shared_ptr<Factor> fRes = f1->Merge(f2);
+      const VarSet &vsRes = fRes->GetVarSet();
+      VarSet vsAll = shape.first.Disjuction(shape.second);
+      EXPECT_EQ(vsAll.GetInstances(), vsRes.GetInstances());
+
+      Clause cl(vsRes);
+      do
+      {
+         ValueType expected = f1->Get(cl.GetInstanceId(shape.first)) * f2->Get(cl.GetInstanceId(shape.second));
+         EXPECT_EQ(expected, fRes->Get(cl.GetInstanceId(vsRes)));
+      } while (!cl.Incr());
+   }
+   return 0;
+}
+
+/// \}
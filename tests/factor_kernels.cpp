@@ -0,0 +1,158 @@
+/*
+* Copyright (C) 2017 Boris Altshul.
+* All rights reserved.
+*
+* The software in this package is published under the terms of the BSD
+* style license a copy of which has been included with this distribution in
+* the LICENSE.txt file.
+*/
+
+#include <factor.h>
+#include <FactorKernels.h>
+#include <Factories.h>
+#include <json/json.h>
+#include <gtest/gtest.h>
+
+
+using namespace bayeslib;
+
+/// \file
+/// \ingroup factorKernels
+/// \{
+
+static ValueType
+KernelTestValue(InstanceId n)
+{
+   // repeating values so max-out sees ties
+   return (ValueType)((n * 7919) % 13) / 13.0F;
+}
+
+/** Run sum-out and max-out kernels with every instruction set supported by CPU
+    and validate results against the scalar kernels.
+    Covers contiguous (inner == 1) and strided layouts including vector tails
+*/
+int KernelTest1()
+{
+   KernelIsa isaSaved = FactorKernels::GetIsa();
+   const InstanceId shapes[][3] = {
+      // outer, elim, inner
+      { 5, 2, 1 }, { 3, 10, 1 }, { 2, 17, 1 }, { 4, 3, 2 },
+      { 2, 4, 4 }, { 3, 2, 8 }, { 2, 10, 13 }, { 1, 3, 64 } };
+
+   for (auto &shape : shapes)
+   {
+      InstanceId nOuter = shape[0];
+      int nElim = (int)shape[1];
+      InstanceId nInner = shape[2];
+
+      std::vector<ValueType> in(nOuter * nElim * nInner);
+      for (InstanceId n = 0; n < in.size(); n++)
+         in[n] = KernelTestValue(n);
+
+      std::vector<ValueType> sumRef(nOuter * nInner), maxRef(nOuter * nInner);
+      std::vector<VarState> argRef(nOuter * nInner);
+      FactorKernels::SetIsa(KernelIsa_Scalar);
+      FactorKernels::SumOut(in.data(), sumRef.data(), nOuter, nElim, nInner);
+      FactorKernels::MaxOut(in.data(), maxRef.data(), argRef.data(), nOuter, nElim, nInner);
+
+      for (int isa = KernelIsa_Sse2; isa <= FactorKernels::GetSupportedIsa(); isa++)
+      {
+         FactorKernels::SetIsa((KernelIsa)isa);
+         std::vector<ValueType> sum(nOuter * nInner), max(nOuter * nInner);
+         std::vector<VarState> arg(nOuter * nInner);
+         FactorKernels::SumOut(in.data(), sum.data(), nOuter, nElim, nInner);
+         FactorKernels::MaxOut(in.data(), max.data(), arg.data(), nOuter, nElim, nInner);
+
+         for (InstanceId n = 0; n < sum.size(); n++)
+         {
+            EXPECT_NEAR(sumRef[n], sum[n], 0.0001);
+            EXPECT_EQ(maxRef[n], max[n]);
+            EXPECT_EQ(argRef[n], arg[n]);
+         }
+      }
+   }
+
+   FactorKernels::SetIsa(isaSaved);
+   return 0;
+}
+
+/** Eliminate and Maximize every variable of a factor with a 10 state variable
+    and compare against values calculated directly from the table
+*/
+int KernelTest2()
+{
+   VarDb db;
+   db.AddVar("A");
+   db.AddVar("B", { "0", "1", "2", "3", "4", "5", "6", "7", "8", "9" });
+   db.AddVar("C", { "0", "1", "2" });
+
+   VarSet vs(db, { db["A"], db["B"], db["C"] });
+   std::shared_ptr<Factor> f = std::make_shared<Factor>(vs);
+   for (InstanceId n = 0; n < vs.GetInstances(); n++)
+      f->AddInstance(n, KernelTestValue(n));
+
+   // B has multiplier 2 and domain 10
+   std::shared_ptr<Factor> fSum = f->EliminateVar(db["B"]);
+   std::shared_ptr<Factor> fMax = f->MaximizeVar(db["B"]);
+   for (InstanceId c = 0; c < 3; c++)
+   {
+      for (InstanceId a = 0; a < 2; a++)
+      {
+         ValueType valSum = 0;
+         ValueType valMax = 0;
+         VarState stateMax = 0;
+         for (VarState b = 0; b < 10; b++)
+         {
+            ValueType v = f->Get(c * 20 + b * 2 + a);
+            valSum += v;
+            if (valMax <= v)
+            {
+               valMax = v;
+               stateMax = b;
+            }
+         }
+         EXPECT_NEAR(valSum, fSum->Get(c * 2 + a), 0.0001);
+         EXPECT_EQ(valMax, fMax->Get(c * 2 + a));
+
+         Clause cl(fMax->GetExtendedVarSet(), fMax->GetExtendedClause(c * 2 + a));
+         EXPECT_EQ(stateMax, cl.GetVar(db["B"]));
+      }
+   }
+   return 0;
+}
+
+/** Sum-out of a column where one large value hides the small ones from a float
+    accumulator. Result carries all of them when AccumType is wider than float,
+    Factor::Normalize divides by the same wide sum
+*/
+int KernelTest3()
+{
+   const int nElim = 200;
+   std::vector<ValueType> in(nElim, 1);
+   in[0] = 1e8F;
+   double exact = 1e8 + nElim - 1;
+   for (KernelIsa isa : { KernelIsa_Scalar, FactorKernels::GetSupportedIsa() })
+   {
+      KernelIsa isaSaved = FactorKernels::SetIsa(isa);
+      ValueType out = 0;
+      FactorKernels::SumOut(in.data(), &out, 1, nElim, 1);
+      if (sizeof(AccumType) > sizeof(float))
+         EXPECT_EQ((ValueType) exact, out);
+      else
+         EXPECT_NEAR(exact, out, exact * 0.00001);
+      FactorKernels::SetIsa(isaSaved);
+   }
+
+   VarDb db;
+   db.AddVar("A");
+   std::shared_ptr<Factor> f = std::make_shared<Factor>(VarSet(db, db["A"]));
+   f->AddInstance(0, 1e8F);
+   f->AddInstance(1, 1);
+   std::shared_ptr<Factor> fNorm = f->Normalize();
+   EXPECT_NEAR(1.0, fNorm->Get(0) + fNorm->Get(1), 0.000001);
+   EXPECT_GT(fNorm->Get(1), 0);
+   return 0;
+}
+
+/// \}
+
@@ -0,0 +1,157 @@
+/*
+* Copyright (C) 2017 Boris Altshul.
+* All rights reserved.
+*
+* The software in this package is published under the terms of the BSD
+* style license a copy of which has been included with this distribution in
+* the LICENSE.txt file.
+*/
+
+#include <factor.h>
+#include <Factories.h>
+#include <json/json.h>
+#include <gtest/gtest.h>
+
+
+using namespace bayeslib;
+
+int CreateRainTest(VarDb &db, FactorSet &fs);
+int InitLargeTest3(VarDb &db, FactorSet &fs);
+
+/// \file
+/// \ingroup interactionGraph
+/// \{
+
+/** Build orders with every heuristic for Rain example and carrier network with
+    4 state cjE variable, all of them have the same width on these models
+*/
+int InteractionGraphTest1()
+{
+   for (int nModel = 0; nModel < 2; nModel++)
+   {
+      VarDb db;
+      FactorSet fs(db);
+      if (nModel == 0)
+         CreateRainTest(db, fs);
+      else
+         InitLargeTest3(db, fs);
+
+      InteractionGraph ig(&fs);
+      for (int h = ElimHeuristic_MinDegree; h <= ElimHeuristic_MinSize; h++)
+      {
+         VarSet vsOrder = ig.GetElimOrder((ElimHeuristic) h);
+         printf("model %d heuristic %d width %d clique %g\n   %s\n", nModel, h,
+            ig.GetInducedWidth(), ig.GetMaxCliqueInstances(), vsOrder.GetJson(db).c_str());
+
+         EXPECT_EQ(fs.GetVarSet()->GetSize(), vsOrder.GetSize());
+         EXPECT_EQ(nModel == 0 ? 2 : 3, ig.GetInducedWidth());
+         EXPECT_EQ(nModel == 0 ? 8.0 : 640.0, ig.GetMaxCliqueInstances());
+      }
+   }
+   return 0;
+}
+
+/** Graphs where heuristics disagree on the first variable.
+    Cycle A-B-C-D plus clique A,B,E,F: C has fewest neighbours, E adds no edges.
+    Chain A-B-C with 10 state A: C creates the smallest clique
+*/
+int InteractionGraphTest2()
+{
+   VarDb db;
+   db.AddVar("A");
+   db.AddVar("B");
+   db.AddVar("C");
+   db.AddVar("D");
+   db.AddVar("E");
+   db.AddVar("F");
+
+   FactorSet fs(db);
+   fs.AddFactor(std::make_shared<Factor>(VarSet(db, { db["A"], db["B"] })));
+   fs.AddFactor(std::make_shared<Factor>(VarSet(db, { db["B"], db["C"] })));
+   fs.AddFactor(std::make_shared<Factor>(VarSet(db, { db["C"], db["D"] })));
+   fs.AddFactor(std::make_shared<Factor>(VarSet(db, { db["D"], db["A"] })));
+   fs.AddFactor(std::make_shared<Factor>(VarSet(db, { db["A"], db["B"], db["E"], db["F"] })));
+
+   InteractionGraph ig(&fs);
+   EXPECT_EQ(db["C"], ig.GetElimOrder(ElimHeuristic_MinDegree).GetFirst());
+   EXPECT_EQ(3, ig.GetInducedWidth());
+   EXPECT_EQ(db["E"], ig.GetElimOrder(ElimHeuristic_MinFill).GetFirst());
+   EXPECT_EQ(3, ig.GetInducedWidth());
+   EXPECT_EQ(db["E"], ig.GetElimOrder(ElimHeuristic_WeightedMinFill).GetFirst());
+   EXPECT_EQ(16.0, ig.GetMaxCliqueInstances());
+
+   VarDb db2;
+   db2.AddVar("A", { "0", "1", "2", "3", "4", "5", "6", "7", "8", "9" });
+   db2.AddVar("B");
+   db2.AddVar("C");
+
+   FactorSet fs2(db2);
+   fs2.AddFactor(std::make_shared<Factor>(VarSet(db2, { db2["A"], db2["B"] })));
+   fs2.AddFactor(std::make_shared<Factor>(VarSet(db2, { db2["B"], db2["C"] })));
+
+   InteractionGraph ig2(&fs2);
+   EXPECT_EQ(db2["A"], ig2.GetElimOrder(ElimHeuristic_MinDegree).GetFirst());
+   EXPECT_EQ(db2["C"], ig2.GetElimOrder(ElimHeuristic_MinSize).GetFirst());
+   EXPECT_EQ(1, ig2.GetInducedWidth());
+   EXPECT_EQ(20.0, ig2.GetMaxCliqueInstances());
+   return 0;
+}
+
+/** Hub H with 12 leaves, caller lists H first. Planned elimination must keep
+    Factors over two variables and give the same marginal of the last leaf as
+    elimination in caller order
+*/
+int ElimPlanTest1()
+{
+   VarDb db;
+   db.AddVar("H");
+   char sz[10];
+   for (int n = 1; n <= 12; n++)
+   {
+      snprintf(sz, sizeof(sz), "L%d", n);
+      db.AddVar(sz);
+   }
+
+   FactorSet fs(db);
+   std::shared_ptr<Factor> fH = std::make_shared<Factor>(VarSet(db, db["H"]), db["H"]);
+   fH->AddInstance(0, 0.3F);
+   fH->AddInstance(1, 0.7F);
+   fs.AddFactor(fH);
+   for (int n = 1; n <= 12; n++)
+   {
+      snprintf(sz, sizeof(sz), "L%d", n);
+      std::shared_ptr<Factor> fL = std::make_shared<Factor>(VarSet(db, { db["H"], db[sz] }), db[sz]);
+      Factor::FactorLoader fl(fL);
+      fl << 0.05F * n << 0.9F - 0.05F * n << 1.0F - 0.05F * n << 0.1F + 0.05F * n;
+      fs.AddFactor(fL);
+   }
+
+   VarSet vsEliminate = db.GetVarSet().Substract(VarSet(db, db["L12"]));
+   EXPECT_EQ(db["H"], vsEliminate.GetFirst());
+
+   FactorSet fsCallerOrder = fs;
+   fsCallerOrder.SetElimPlanning(false);
+   fsCallerOrder.EliminateVar(vsEliminate);
+   std::shared_ptr<Factor> fRef = fsCallerOrder.Merge();
+
+   fs.EliminateVar(vsEliminate);
+   std::shared_ptr<Factor> f = fs.Merge();
+   printf("\n==Planned order==\n%s\n", fs.GetElimOrder().GetJson(db).c_str());
+
+   EXPECT_EQ(vsEliminate.GetSize(), fs.GetElimOrder().GetSize());
+   EXPECT_NE(db["H"], fs.GetElimOrder().GetFirst());
+   EXPECT_EQ(2.0, fs.GetPredictedPeakInstances());
+   for (InstanceId n = 0; n < 2; n++)
+      EXPECT_NEAR(fRef->Get(n), f->Get(n), 0.0001);
+
+   // trivial sets are not planned, single variable still predicts its bucket
+   fs.EliminateVar(VarSet(db));
+   EXPECT_EQ(0u, fs.GetElimOrder().GetSize());
+   EXPECT_EQ(0.0, fs.GetPredictedPeakInstances());
+   fs.EliminateVar(VarSet(db, db["L12"]));
+   EXPECT_EQ(db["L12"], fs.GetElimOrder().GetFirst());
+   EXPECT_EQ(1.0, fs.GetPredictedPeakInstances());
+   return 0;
+}
+
+/// \}
@@ -0,0 +1,114 @@
+/*
+* Copyright (C) 2017 Boris Altshul.
+* All rights reserved.
+*
+* The software in this package is published under the terms of the BSD
+* style license a copy of which has been included with this distribution in
+* the LICENSE.txt file.
+*/
+
+#include <factor.h>
+#include <Factories.h>
+#include <json/json.h>
+#include <gtest/gtest.h>
+
+
+using namespace bayeslib;
+
+int CreateRainTest(VarDb &db, FactorSet &fs);
+int InitLargeTest(VarDb &db, FactorSet &fs);
+
+/// \file
+/// \ingroup junctionTree
+/// \{
+
+/// Compare every marginal of calibrated tree with variable elimination
+/// run on a copy of FactorSet
+static void
+CompareWithElimination(VarDb &db, FactorSet &fs, JunctionTree &jt, const Clause &evidence)
+{
+   jt.Calibrate(evidence);
+   std::shared_ptr<VarSet> vsAll = fs.GetVarSet();
+
+   // eliminate in interaction graph order, variable set order is too wide
+   VarSet vsOrder = InteractionGraph(&fs).GetElimOrder();
+   vsOrder.Add(*vsAll);
+   for (VarId id = vsAll->GetFirst(); id != 0; id = vsAll->GetNext(id))
+   {
+      FactorSet fsCopy = fs;
+      fsCopy.ApplyClause(evidence);
+      fsCopy.EliminateVar(vsOrder.Substract(VarSet(db, id)));
+      std::shared_ptr<Factor> fRef = fsCopy.Merge();
+
+      ValueType sum = 0;
+      for (InstanceId n = 0; n < fRef->GetVarSet().GetInstances(); n++)
+         sum += fRef->Get(n);
+      EXPECT_NEAR(sum, jt.GetEvidenceProbability(), sum * 0.001);
+
+      std::shared_ptr<Factor> f = jt.GetMarginal(id);
+      for (InstanceId n = 0; n < fRef->GetVarSet().GetInstances(); n++)
+         EXPECT_NEAR(fRef->Get(n) / sum, f->Get(n), 0.0001);
+   }
+}
+
+/** Calibrate Rain example with and without evidence and compare all marginals
+    and family marginal of Wet grass node
+*/
+int JunctionTreeTest1()
+{
+   VarDb db;
+   FactorSet fs(db);
+   CreateRainTest(db, fs);
+
+   JunctionTree jt(fs);
+   printf("\n==Junction tree==\n%s\n", jt.GetJson(db).c_str());
+   EXPECT_EQ(3u, jt.GetLargestClique().GetSize());
+
+   CompareWithElimination(db, fs, jt, Clause(db));
+
+   Clause cSample(VarSet(db, { db["A"], db["E"] }));
+   cSample.SetVar(db["A"], true);
+   cSample.SetVar(db["E"], true);
+   CompareWithElimination(db, fs, jt, cSample);
+
+   // Wet grass with both parents
+   VarSet vsFamily(db, { db["B"], db["C"], db["D"] });
+   std::shared_ptr<Factor> fFamily = jt.GetMarginal(vsFamily);
+   EXPECT_EQ(vsFamily.GetJsonAbbrev(), fFamily->GetVarSet().GetJsonAbbrev());
+
+   FactorSet fsCopy = fs;
+   fsCopy.ApplyClause(cSample);
+   fsCopy.EliminateVar(VarSet(db, { db["A"], db["E"] }));
+   std::shared_ptr<Factor> fRef = fsCopy.Merge();
+   ValueType sum = jt.GetEvidenceProbability();
+   for (VarId id : { db["B"], db["C"], db["D"] })
+   {
+      std::shared_ptr<Factor> fMarg = fRef->EliminateVar(vsFamily.Substract(VarSet(db, id)));
+      std::shared_ptr<Factor> fJt = fFamily->EliminateVar(vsFamily.Substract(VarSet(db, id)));
+      for (InstanceId n = 0; n < 2; n++)
+         EXPECT_NEAR(fMarg->Get(n) / sum, fJt->Get(n), 0.0001);
+   }
+   return 0;
+}
+
+/** Calibrate carrier network model with drop measurements as evidence
+*/
+int JunctionTreeTest2()
+{
+   VarDb db;
+   FactorSet fs(db);
+   InitLargeTest(db, fs);
+
+   JunctionTree jt(fs);
+   EXPECT_EQ(4u, jt.GetLargestClique().GetSize());
+
+   Clause cSample(VarSet(db, { db["drhi3_1"], db["drlo3_1"], db["drhi3_2"], db["drloa3_1"] }));
+   cSample.SetVar(db["drhi3_1"], true);
+   cSample.SetVar(db["drlo3_1"], true);
+   cSample.SetVar(db["drhi3_2"], false);
+   cSample.SetVar(db["drloa3_1"], true);
+   CompareWithElimination(db, fs, jt, cSample);
+   return 0;
+}
+
+/// \}
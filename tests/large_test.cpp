@@ -17,6 +17,8 @@
 
 using namespace bayeslib;
 
+int CreateRainTest(VarDb &db, FactorSet &fs);
+
 /** \file
  \ingroup largeModel
  \{
@@ -1116,3 +1118,756 @@ int LargeTest3()
    return 0;
 }
 
+
+/** Chain of 1000 binary variables X1 -> X2 -> ... -> X1000, more than
+    fits in VarSet membership mask. Probability of the last node is compared
+    with the value propagated directly along the chain
+*/
+int LargeTest4()
+{
+   const int nChain = 1000;
+   VarDb db;
+   FactorSet fs(db);
+
+   for (int n = 1; n <= nChain; n++)
+      db.AddVar("X" + std::to_string(n));
+
+   std::shared_ptr<Factor> fFirst = std::make_shared<Factor>(VarSet(db, db["X1"]), db["X1"]);
+   *fFirst << 0.3F << 0.7F;
+   fs.AddFactor(fFirst);
+
+   for (int n = 2; n <= nChain; n++)
+   {
+      VarId idPrev = db["X" + std::to_string(n - 1)];
+      VarId id = db["X" + std::to_string(n)];
+      std::shared_ptr<Factor> f = std::make_shared<Factor>(VarSet(db, { idPrev, id }), id);
+      // X = 0 | Xprev = 0, X = 0 | Xprev = 1, X = 1 | Xprev = 0, X = 1 | Xprev = 1
+      *f << 0.9F << 0.2F << 0.1F << 0.8F;
+      fs.AddFactor(f);
+   }
+
+   // VarIds that share bits of VarSet mask are still different variables
+   VarSet vsLow(db, { 5 }), vsHigh(db, { 133, 261 });
+   EXPECT_FALSE(vsHigh.HasVar(5));
+   EXPECT_FALSE(vsHigh.HasVar(vsLow));
+   EXPECT_TRUE(vsHigh.Conjuction(vsLow).IsEmpty());
+   EXPECT_EQ(2u, vsHigh.Substract(vsLow).GetSize());
+   EXPECT_FALSE(vsHigh == VarSet(db, { 133, 389 }));
+
+   VarId idLast = db["X" + std::to_string(nChain)];
+   VarSet vsEliminate = fs.GetVarSet()->Substract(VarSet(db, idLast));
+   EXPECT_EQ((unsigned int) nChain - 1, vsEliminate.GetSize());
+   fs.EliminateVar(vsEliminate);
+   std::shared_ptr<Factor> res = fs.Merge();
+
+   double p1 = 0.7;
+   for (int n = 2; n <= nChain; n++)
+      p1 = 0.1 * (1 - p1) + 0.8 * p1;
+
+   EXPECT_EQ(1u, res->GetVarSet().GetSize());
+   EXPECT_NEAR(1 - p1, res->Get(0), 0.001);
+   EXPECT_NEAR(p1, res->Get(1), 0.001);
+   return 0;
+}
+
+/** Bucket index of FactorSet follows Factors through PruneEdges, ApplyClause, 
+    RemoveVars and EliminateVar of the carrier network. After every step each 
+    bucket has to list the same Factors in the same order as a scan of the list
+*/
+int LargeTest5()
+{
+   VarDb db;
+   FactorSet fs(db);
+   InitLargeTest(db, fs);
+
+   auto checkBuckets = [&db, &fs]()
+   {
+      VarSet vsAll = db.GetVarSet();
+      for (VarId id = vsAll.GetFirst(); id != 0; id = vsAll.GetNext(id))
+      {
+         std::vector<std::shared_ptr<Factor> > scan;
+         for (auto &f : fs.GetFactors())
+         {
+            if (f->GetVarSet().HasVar(id))
+               scan.push_back(f);
+         }
+         EXPECT_TRUE(scan == fs.GetFactors(id));
+      }
+   };
+   checkBuckets();
+
+   Clause cSample(VarSet(db, { db["drhi3_1"], db["drlo3_1"], db["drhi3_2"], db["drloa3_1"] }));
+   cSample.SetVar(db["drhi3_1"], true);
+   cSample.SetVar(db["drlo3_1"], true);
+   cSample.SetVar(db["drloa3_1"], true);
+
+   FactorSet fsCopy = fs;
+   fs.PruneEdges(cSample);
+   checkBuckets();
+   fs.ApplyClause(cSample);
+   checkBuckets();
+   fs.RemoveVars(VarSet(db, { db["drhi4_1"], db["drlo4_1"] }));
+   checkBuckets();
+   fs.EliminateVar(VarSet(db, { db["cjl1_1"], db["cjl1"], db["cjl2"] }));
+   checkBuckets();
+   fs.MaximizeVar(VarSet(db, { db["cjl3_1"], db["cjl4_1"] }));
+   checkBuckets();
+
+   // copy keeps its own index
+   EXPECT_FALSE(fsCopy.GetFactors(db["cjl1"]).empty());
+   EXPECT_TRUE(fs.GetFactors(db["cjl1"]).empty());
+   return 0;
+}
+
+/** Ladder of 60 layers with two binary variables each, both variables of a layer
+    are children of both variables of the layer above. Recursive walk to ancestors 
+    would visit the top 2^60 times, DAG index visits every variable once
+*/
+int LargeTest6()
+{
+   const int nLayers = 60;
+   VarDb db;
+   FactorSet fs(db);
+
+   for (int n = 1; n <= nLayers; n++)
+   {
+      db.AddVar("A" + std::to_string(n));
+      db.AddVar("B" + std::to_string(n));
+   }
+
+   // children are added before parents, order of list is not topological
+   for (int n = nLayers; n >= 1; n--)
+   {
+      for (const char *name : { "A", "B" })
+      {
+         VarId id = db[name + std::to_string(n)];
+         VarSet vs(db);
+         if (n > 1)
+            vs << db["A" + std::to_string(n - 1)] << db["B" + std::to_string(n - 1)];
+         vs << id;
+         std::shared_ptr<Factor> f = std::make_shared<Factor>(vs, id);
+         fs.AddFactor(f);
+      }
+   }
+
+   VarId idBottom = db["A" + std::to_string(nLayers)];
+   EXPECT_EQ((unsigned int) (2 * nLayers - 2), fs.GetAncestors(idBottom)->GetSize());
+   EXPECT_EQ(0u, fs.GetAncestors(db["B1"])->GetSize());
+   EXPECT_EQ(2u, fs.GetParents(idBottom).GetSize());
+
+   // every parent is placed before its child
+   const std::vector<VarId> &order = fs.GetTopologicalOrder();
+   EXPECT_EQ((size_t) (2 * nLayers), order.size());
+   std::map<VarId, size_t> position;
+   for (size_t n = 0; n < order.size(); n++)
+      position[order[n]] = n;
+   for (VarId id : order)
+   {
+      VarSet vsParents = fs.GetParents(id);
+      for (VarId p = vsParents.GetFirst(); p != 0; p = vsParents.GetNext(p))
+         EXPECT_LT(position[p], position[id]);
+   }
+
+   // index is rebuilt after Factor of A1 is replaced by one with new root on top
+   db.AddVar("R");
+   VarId idRoot = db["R"];
+   fs.RemoveVars(VarSet(db, db["A1"]));
+   EXPECT_EQ(0u, fs.GetParents(db["A1"]).GetSize());
+   fs.AddFactor(std::make_shared<Factor>(VarSet(db, idRoot), idRoot));
+   fs.AddFactor(std::make_shared<Factor>(VarSet(db, { idRoot, db["A1"] }), db["A1"]));
+   EXPECT_TRUE(fs.GetAncestors(idBottom)->HasVar(idRoot));
+   EXPECT_EQ((unsigned int) (2 * nLayers - 1), fs.GetAncestors(idBottom)->GetSize());
+   EXPECT_EQ((size_t) (2 * nLayers + 1), fs.GetTopologicalOrder().size());
+
+   // carrier network, drop measurement depends on link, sublink and endpoint
+   VarDb db2;
+   FactorSet fs2(db2);
+   InitLargeTest(db2, fs2);
+   std::shared_ptr<VarSet> vsAncestors = fs2.GetAncestors(db2["drlo1_1"]);
+   EXPECT_EQ(3u, vsAncestors->GetSize());
+   EXPECT_TRUE(vsAncestors->HasVar(VarSet(db2, db2["cjE"])));
+   EXPECT_TRUE(fs2.GetAncestors(db2["cjl1"])->IsEmpty());
+   return 0;
+}
+
+/** Requisite pruning of carrier network for congestion of link 1. Drops on link 3
+    stay requisite as they are connected through congested endpoint, links 2 and 4
+    carry no evidence and are dropped. Normalized marginal has to match the one of 
+    full FactorSet. Session MAP with Requisite flag reports d-separated evidence
+*/
+int LargeTest7()
+{
+   VarDb db;
+   FactorSet fs(db);
+   InitLargeTest(db, fs);
+
+   Clause cSample(VarSet(db, { db["drlo1_1"], db["drhi3_1"] }));
+   cSample.SetVar(db["drlo1_1"], true);
+   cSample.SetVar(db["drhi3_1"], true);
+   VarSet vsQuery(db, db["cjl1"]);
+
+   FactorSet fsRequisite = fs;
+   VarSet vsPruned = fsRequisite.PruneRequisite(vsQuery, cSample);
+   EXPECT_TRUE(vsPruned.HasVar(VarSet(db, db["cjl2"])));
+   EXPECT_TRUE(vsPruned.HasVar(VarSet(db, db["drhia4_2"])));
+   EXPECT_FALSE(vsPruned.HasVar(VarSet(db, { db["cjE"], db["cjl3"], db["cjl3_1"], db["drlo1_1"] })));
+   EXPECT_EQ(fs.GetFactors().size(), fsRequisite.GetFactors().size() + vsPruned.GetSize());
+
+   std::shared_ptr<Factor> res[2];
+   FactorSet *pFs[2] = { &fs, &fsRequisite };
+   for (int n = 0; n < 2; n++)
+   {
+      pFs[n]->ApplyClause(cSample);
+      pFs[n]->EliminateVar(pFs[n]->GetVarSet()->Substract(vsQuery));
+      res[n] = pFs[n]->Merge();
+      EXPECT_EQ(2u, res[n]->GetVarSet().GetInstances());
+   }
+   ValueType sum0 = res[0]->Get(0) + res[0]->Get(1);
+   ValueType sum1 = res[1]->Get(0) + res[1]->Get(1);
+   EXPECT_NEAR(res[0]->Get(1) / sum0, res[1]->Get(1) / sum1, 0.0001);
+
+   // evidence on D is d-separated from A
+   std::string s = SessionEntry::RunCommand(R"( {
+      "VarDb": ["A", "B", "C", "D"],
+      "FactorSet" : [
+         { "vars": ["A"], "head" : ["A"], "vals" : [0.3, 0.7] },
+         { "vars": ["A", "B"], "head" : ["B"], "vals" : [0.9, 0.2, 0.1, 0.8] },
+         { "vars": ["C"], "head" : ["C"], "vals" : [0.6, 0.4] },
+         { "vars": ["C", "D"], "head" : ["D"], "vals" : [0.5, 0.1, 0.5, 0.9] }
+      ],
+      "QueryVarSet": ["A"],
+      "SampleClause" : { "varset": ["D"], "values" : [1] },
+      "op" : "MAP",
+      "Requisite" : true
+   })");
+   EXPECT_NE(std::string::npos, s.find("\"pruned\":[\"B\",\"C\",\"D\"]"));
+   return 0;
+}
+
+/** Observed congested endpoint splits carrier network into independent links. 
+    Components are solved on a pool of threads, probability of evidence and MPE
+    have to match the ones of single FactorSet
+*/
+int LargeTest8()
+{
+   VarDb db;
+   FactorSet fs(db);
+   InitLargeTest(db, fs);
+
+   Clause cSample(VarSet(db, { db["cjE"], db["drlo1_1"], db["drhi3_1"] }));
+   cSample.SetVar(db["cjE"], false);
+   cSample.SetVar(db["drlo1_1"], true);
+   cSample.SetVar(db["drhi3_1"], true);
+   fs.PruneEdges(cSample);
+   fs.ApplyClause(cSample);
+
+   // 4 links and prior of endpoint
+   std::vector<std::shared_ptr<FactorSet> > components = fs.GetComponents();
+   EXPECT_EQ(5u, components.size());
+   size_t nFactors = 0;
+   for (auto &c : components)
+      nFactors += c->GetFactors().size();
+   EXPECT_EQ(fs.GetFactors().size(), nFactors);
+
+   VarSet vsAll = *fs.GetVarSet();
+   VarSet vsHidden = vsAll.Substract(cSample.GetVarSet());
+   FactorSet fsRef = fs;
+   fsRef.EliminateVar(vsAll);
+   ValueType pEvidence = fsRef.Merge()->Get(0);
+   for (int nThreads : { 0, 1, 4 })
+   {
+      std::shared_ptr<Factor> res = fs.SolveComponents(vsAll, VarSet(db), nThreads);
+      EXPECT_NEAR(pEvidence, res->Get(0), pEvidence * 0.0001);
+   }
+
+   FactorSet fsMpeRef = fs;
+   fsMpeRef.MaximizeVar(vsHidden);
+   std::shared_ptr<Factor> fMpeRef = fsMpeRef.Merge();
+   Clause clRef(fMpeRef->GetExtendedVarSet(), fMpeRef->GetExtendedClause(0));
+
+   std::shared_ptr<Factor> fMpe = fs.SolveComponents(VarSet(db), vsHidden, 4);
+   Clause cl(fMpe->GetExtendedVarSet(), fMpe->GetExtendedClause(0));
+   EXPECT_NEAR(fMpeRef->Get(0), fMpe->Get(0), fMpeRef->Get(0) * 0.0001);
+   EXPECT_EQ(vsHidden.GetSize(), cl.GetVarSet().GetSize());
+   for (VarId id = vsHidden.GetFirst(); id != 0; id = vsHidden.GetNext(id))
+      EXPECT_EQ(clRef.GetVar(id), cl.GetVar(id));
+   return 0;
+}
+
+/// Product of all Factors of FactorSet at the assignment
+static ValueType
+JointValue(FactorSet &fs, const Clause &cl)
+{
+   ValueType res = 1;
+   for (auto &f : fs.GetFactors())
+      res *= f->Get(cl.GetInstanceId(f->GetVarSet()));
+   return res;
+}
+
+/** Top-K MPE of Rain example against sorted rows of the joint, and of carrier network
+    with drop evidence against single MPE of MaximizeVar. Session TopKMPE returns K entries
+*/
+int LargeTest9()
+{
+   VarDb db;
+   FactorSet fs(db);
+   CreateRainTest(db, fs);
+   std::shared_ptr<Factor> fJoint = fs.Merge();
+   std::vector<ValueType> joint;
+   for (InstanceId n = 0; n < fJoint->GetVarSet().GetInstances(); n++)
+      joint.push_back(fJoint->Get(n));
+   std::sort(joint.rbegin(), joint.rend());
+
+   std::vector<std::shared_ptr<Factor> > res = fs.TopKMPE(8);
+   EXPECT_EQ(8u, res.size());
+   for (size_t n = 0; n < res.size(); n++)
+   {
+      EXPECT_NEAR(joint[n], res[n]->Get(0), 0.00001);
+      Clause cl(res[n]->GetExtendedVarSet(), res[n]->GetExtendedClause(0));
+      EXPECT_NEAR(res[n]->Get(0), JointValue(fs, cl), 0.00001);
+      for (size_t n2 = 0; n2 < n; n2++)
+         EXPECT_NE(res[n2]->GetExtendedClause(0), res[n]->GetExtendedClause(0));
+   }
+
+   VarDb db2;
+   FactorSet fs2(db2);
+   InitLargeTest(db2, fs2);
+   Clause cSample(VarSet(db2, { db2["drhi3_1"], db2["drlo3_1"], db2["drloa3_1"] }));
+   cSample.SetVar(db2["drhi3_1"], true);
+   cSample.SetVar(db2["drlo3_1"], true);
+   cSample.SetVar(db2["drloa3_1"], true);
+   fs2.PruneEdges(cSample);
+   fs2.ApplyClause(cSample);
+
+   res = fs2.TopKMPE(10);
+   EXPECT_EQ(10u, res.size());
+   FactorSet fsMpe = fs2;
+   fsMpe.MaximizeVar(*fs2.GetVarSet());
+   EXPECT_NEAR(fsMpe.Merge()->Get(0), res[0]->Get(0), res[0]->Get(0) * 0.0001);
+   for (size_t n = 0; n < res.size(); n++)
+   {
+      Clause cl(res[n]->GetExtendedVarSet(), res[n]->GetExtendedClause(0));
+      EXPECT_EQ(1, cl.GetVar(db2["drhi3_1"]));
+      EXPECT_NEAR(res[n]->Get(0), JointValue(fs2, cl), res[n]->Get(0) * 0.0001);
+      if (n > 0)
+      {
+         EXPECT_LE(res[n]->Get(0), res[n - 1]->Get(0));
+      }
+   }
+
+   std::string s = SessionEntry::RunCommand(R"( {
+      "VarDb": ["A", "B"],
+      "FactorSet" : [
+         { "vars": ["A"], "head" : ["A"], "vals" : [0.3, 0.7] },
+         { "vars": ["A", "B"], "head" : ["B"], "vals" : [0.9, 0.2, 0.1, 0.8] }
+      ],
+      "SampleClause" : { "varset": ["B"], "values" : [1] },
+      "op" : "TopKMPE",
+      "K" : 3
+   })");
+   printf("==TopKMPE==\n%s\n", s.c_str());
+   Json::Value v;
+   Json::Reader r;
+   EXPECT_TRUE(r.parse(s, v));
+   // B = 1 leaves two assignments of A
+   EXPECT_EQ(2u, v["topk"].size());
+   return 0;
+}
+
+/** Slice carrier network on evidence with observed states 0 and 1: sliced Factors
+    hold the matching rows of the original ones, no Factor keeps an observed variable
+    and probability of evidence matches PruneEdges followed by ApplyClause.
+    Session MPE with evidence in state 1 reports the single MPE row
+*/
+int LargeTest10()
+{
+   VarDb db;
+   FactorSet fs(db);
+   InitLargeTest(db, fs);
+   Clause cSample(VarSet(db, { db["drhi3_1"], db["drlo3_1"], db["drhi3_2"], db["cjl3_1"] }));
+   cSample.SetVar(db["drhi3_1"], true);
+   cSample.SetVar(db["drlo3_1"], true);
+   cSample.SetVar(db["drhi3_2"], false);
+   cSample.SetVar(db["cjl3_1"], true);
+
+   for (auto &f : fs.GetFactors())
+   {
+      std::shared_ptr<Factor> fSlice = f->Slice(cSample);
+      if (!f->GetVarSet().HasVar(cSample.GetVarSet()))
+      {
+         EXPECT_EQ(f, fSlice);
+         continue;
+      }
+      const VarSet &vsSlice = fSlice->GetVarSet();
+      EXPECT_FALSE(vsSlice.HasVar(cSample.GetVarSet()));
+      EXPECT_FALSE(fSlice->GetClauseHead().HasVar(cSample.GetVarSet()));
+      for (InstanceId n = 0; n < vsSlice.GetInstances(); n++)
+      {
+         Clause cl(vsSlice, n);
+         InstanceId row = cl.GetInstanceId(f->GetVarSet()) + cSample.GetInstanceId(f->GetVarSet());
+         EXPECT_EQ(f->Get(row), fSlice->Get(n));
+      }
+   }
+
+   FactorSet fsRef = fs;
+   fsRef.PruneEdges(cSample);
+   fsRef.ApplyClause(cSample);
+   fsRef.EliminateVar(*fsRef.GetVarSet());
+   ValueType pEvidence = fsRef.Merge()->Get(0);
+
+   FactorSet fsSlice = fs;
+   fsSlice.SliceEvidence(cSample);
+   EXPECT_FALSE(fsSlice.GetVarSet()->HasVar(cSample.GetVarSet()));
+   for (VarId id = cSample.GetVarSet().GetFirst(); id != 0; id = cSample.GetVarSet().GetNext(id))
+      EXPECT_TRUE(fsSlice.GetFactors(id).empty());
+   fsSlice.EliminateVar(*fsSlice.GetVarSet());
+   EXPECT_NEAR(pEvidence, fsSlice.Merge()->Get(0), pEvidence * 0.0001);
+
+   std::string s = SessionEntry::RunCommand(R"( {
+      "VarDb": ["A", "B"],
+      "FactorSet" : [
+         { "vars": ["A"], "head" : ["A"], "vals" : [0.3, 0.7] },
+         { "vars": ["A", "B"], "head" : ["B"], "vals" : [0.9, 0.2, 0.1, 0.8] }
+      ],
+      "SampleClause" : { "varset": ["B"], "values" : [1] },
+      "op" : "MPE"
+   })");
+   printf("==MPE==\n%s\n", s.c_str());
+   EXPECT_NE(std::string::npos, s.find("0.56"));
+   EXPECT_NE(std::string::npos, s.find("\"A\":\"1\""));
+   return 0;
+}
+
+/** Query of carrier network repeated inside one pool scope: second query takes
+    its tables from the pool, results do not change, and pool is trimmed to the
+    retained bytes when the scope ends
+*/
+int LargeTest11()
+{
+   VarDb db;
+   FactorSet fs(db);
+   InitLargeTest(db, fs);
+   Clause cSample(VarSet(db, { db["drhi3_1"], db["drlo3_1"] }));
+   cSample.SetVar(db["drhi3_1"], true);
+   cSample.SetVar(db["drlo3_1"], true);
+   fs.SliceEvidence(cSample);
+   VarSet vsEliminate = fs.GetVarSet()->Substract(VarSet(db, db["cjE"]));
+
+   ValueType res[2][2];
+   u64 misses[2];
+   {
+      FactorPool::Scope poolScope;
+      for (int n = 0; n < 2; n++)
+      {
+         u64 nMisses = FactorPool::GetMisses();
+         FactorSet fsQuery = fs;
+         fsQuery.EliminateVar(vsEliminate);
+         std::shared_ptr<Factor> f = fsQuery.Merge();
+         EXPECT_EQ(2u, f->GetVarSet().GetInstances());
+         for (InstanceId row = 0; row < 2; row++)
+            res[n][row] = f->Get(row);
+         misses[n] = FactorPool::GetMisses() - nMisses;
+      }
+      EXPECT_GT(FactorPool::GetFreeBytes(), 0u);
+   }
+   printf("pool misses %llu then %llu, hits %llu\n", (unsigned long long) misses[0],
+      (unsigned long long) misses[1], (unsigned long long) FactorPool::GetHits());
+   EXPECT_EQ(0u, misses[1]);
+   for (InstanceId row = 0; row < 2; row++)
+      EXPECT_EQ(res[0][row], res[1][row]);
+
+   FactorPool::SetRetainedBytes(1 << 10);
+   EXPECT_LE(FactorPool::GetFreeBytes(), 1u << 10);
+   FactorPool::Clear();
+   EXPECT_EQ(0u, FactorPool::GetFreeBytes());
+
+   // outside of any scope tables go back to the heap
+   std::make_shared<Factor>(VarSet(db, db["cjE"]));
+   EXPECT_EQ(0u, FactorPool::GetFreeBytes());
+   FactorPool::SetRetainedBytes(64 << 20);
+   return 0;
+}
+
+/** Carrier network with CPTs in 16 and 8 bit codes: tables shrink, probability of
+    evidence, posterior of cjE and MPE value stay close to the ones of ValueType
+    tables, quantized Factors can not be quantized by session again
+*/
+int LargeTest12()
+{
+   VarDb db;
+   FactorSet fs(db);
+   InitLargeTest(db, fs);
+   Clause cSample(VarSet(db, { db["drhi3_1"], db["drlo3_1"] }));
+   cSample.SetVar(db["drhi3_1"], true);
+   cSample.SetVar(db["drlo3_1"], true);
+   VarSet vsEliminate = fs.GetVarSet()->Substract(cSample.GetVarSet()).Substract(VarSet(db, db["cjE"]));
+
+   auto storageOf = [](FactorSet &fsSize)
+   {
+      size_t bytes = 0;
+      for (auto &f : fsSize.GetFactors())
+         bytes += f->GetStorageBytes();
+      return bytes;
+   };
+   auto posteriorOf = [&](FactorSet &fsQuery, ValueType res[2])
+   {
+      fsQuery.SliceEvidence(cSample);
+      fsQuery.EliminateVar(vsEliminate);
+      std::shared_ptr<Factor> f = fsQuery.Merge();
+      ValueType pEvidence = f->Get(0) + f->Get(1);
+      res[0] = f->Get(0) / pEvidence;
+      res[1] = f->Get(1) / pEvidence;
+      return pEvidence;
+   };
+   auto mpeOf = [&](FactorSet &fsQuery)
+   {
+      fsQuery.SliceEvidence(cSample);
+      fsQuery.MaximizeVar(*fsQuery.GetVarSet());
+      return fsQuery.Merge()->Get(0);
+   };
+
+   FactorSet fsFloat = fs;
+   ValueType posterior[2];
+   ValueType pEvidence = posteriorOf(fsFloat, posterior);
+   FactorSet fsFloatMpe = fs;
+   ValueType mpe = mpeOf(fsFloatMpe);
+   size_t bytes = storageOf(fs);
+
+   struct { QuantMode mode; double shrink; double tolerance; } modes[] = {
+      { QuantMode_Linear16, 1.75, 0.001 },
+      { QuantMode_Linear8, 3, 0.05 },
+      { QuantMode_Log8, 3, 0.05 } };
+   for (auto &m : modes)
+   {
+      FactorSet fsQuant = fs;
+      EXPECT_EQ((int) fs.GetFactors().size(), fsQuant.Quantize(m.mode));
+      EXPECT_EQ(0, fsQuant.Quantize(m.mode));
+      for (auto &f : fs.GetFactors())
+         EXPECT_EQ(QuantMode_None, f->GetQuantMode());
+      // most CPTs of carrier network have a few rows, presence bits weigh on them
+      size_t bytesQuant = storageOf(fsQuant);
+      EXPECT_LE(bytesQuant * m.shrink, bytes);
+
+      FactorSet fsQuery = fsQuant;
+      ValueType posteriorQuant[2];
+      ValueType pEvidenceQuant = posteriorOf(fsQuery, posteriorQuant);
+      FactorSet fsMpe = fsQuant;
+      ValueType mpeQuant = mpeOf(fsMpe);
+      printf("quant %d: bytes %llu of %llu, p(e) %g of %g, posterior %g of %g, mpe %g of %g\n",
+         (int) m.mode, (unsigned long long) bytesQuant, (unsigned long long) bytes,
+         pEvidenceQuant, pEvidence, posteriorQuant[1], posterior[1], mpeQuant, mpe);
+      EXPECT_NEAR(pEvidence, pEvidenceQuant, pEvidence * m.tolerance * 4);
+      EXPECT_NEAR(mpe, mpeQuant, mpe * m.tolerance * 4);
+      for (int n = 0; n < 2; n++)
+         EXPECT_NEAR(posterior[n], posteriorQuant[n], m.tolerance);
+   }
+
+   // zero stays zero, largest value of log8 is exact
+   std::shared_ptr<Factor> f = std::make_shared<Factor>(VarSet(db, db["cjE"]));
+   f->AddInstance(0, 0);
+   f->AddInstance(1, 0.75F);
+   EXPECT_TRUE(f->Quantize(QuantMode_Log8));
+   EXPECT_EQ(0, f->Get(0));
+   EXPECT_EQ(0.75F, f->Get(1));
+   std::shared_ptr<Factor> fNegative = std::make_shared<Factor>(VarSet(db, db["cjE"]));
+   fNegative->AddInstance(0, -1);
+   EXPECT_FALSE(fNegative->Quantize(QuantMode_Linear8));
+   EXPECT_EQ(QuantMode_None, fNegative->GetQuantMode());
+
+   std::string s = SessionEntry::RunCommand(R"( {
+      "VarDb": ["A", "B"],
+      "FactorSet" : [
+         { "vars": ["A"], "head" : ["A"], "vals" : [0.3, 0.7] },
+         { "vars": ["A", "B"], "head" : ["B"], "vals" : [0.9, 0.2, 0.1, 0.8], "quant" : "linear16" }
+      ],
+      "SampleClause" : { "varset": ["B"], "values" : [1] },
+      "Quantize" : "log8",
+      "op" : "MPE"
+   })");
+   printf("==MPE==\n%s\n", s.c_str());
+   EXPECT_NE(std::string::npos, s.find("0.5599"));
+   EXPECT_NE(std::string::npos, s.find("\"A\":\"1\""));
+   return 0;
+}
+
+/// Deterministic CPT of gate with two binary inputs, head is 1 where fn of inputs holds
+static std::shared_ptr<Factor>
+GateFactor(VarDb &db, VarId a, VarId b, VarId head, bool (*fn)(int, int))
+{
+   VarSet vs(db, { a, b, head });
+   std::shared_ptr<Factor> f = std::make_shared<Factor>(vs, head);
+   Clause cl(vs);
+   do
+   {
+      bool bOut = fn(cl.GetVar(a), cl.GetVar(b));
+      f->AddInstance(cl.GetInstanceId(vs), cl.GetVar(head) == (bOut ? 1 : 0) ? 1.0F : 0.0F);
+   } while (!cl.Incr());
+   return f;
+}
+
+/// Same rows, values and extended clauses of nonzero rows
+static void
+ExpectSameFactor(std::shared_ptr<Factor> f1, std::shared_ptr<Factor> f2)
+{
+   EXPECT_EQ(f1->GetVarSet().GetInstances(), f2->GetVarSet().GetInstances());
+   EXPECT_EQ(f1->HasExtendedInfo(), f2->HasExtendedInfo());
+   for (InstanceId n = 0; n < f1->GetVarSet().GetInstances(); n++)
+   {
+      EXPECT_NEAR(f1->Get(n), f2->Get(n), 0.000001);
+      if (f1->HasExtendedInfo() && f1->Get(n) != 0)
+      {
+         EXPECT_EQ(f1->GetExtendedClause(n), f2->GetExtendedClause(n));
+      }
+   }
+}
+
+/** Circuit of OR, AND and XOR gates with noisy sensor: gate CPTs are kept sparse,
+    Merge, EliminateVar, MaximizeVar, Slice and FactorContraction over sparse
+    tables give the same values and MPE clauses as over full tables
+*/
+int LargeTest13()
+{
+   VarDb db;
+   for (const char *sz : { "A", "B", "C", "D", "Y", "Z", "W", "S" })
+      db.AddVar(sz);
+   FactorSet fs(db);
+   ValueType priors[] = { 0.3F, 0.6F, 0.8F, 0.1F };
+   const char *szPriors[] = { "A", "B", "C", "D" };
+   for (int n = 0; n < 4; n++)
+   {
+      std::shared_ptr<Factor> f = std::make_shared<Factor>(VarSet(db, db[szPriors[n]]), db[szPriors[n]]);
+      f->AddInstance(0, 1 - priors[n]);
+      f->AddInstance(1, priors[n]);
+      fs.AddFactor(f);
+   }
+   std::shared_ptr<Factor> fOr = GateFactor(db, db["A"], db["B"], db["Y"], [](int a, int b) { return a || b; });
+   std::shared_ptr<Factor> fAnd = GateFactor(db, db["Y"], db["C"], db["Z"], [](int a, int b) { return a && b; });
+   fs.AddFactor(fOr);
+   fs.AddFactor(fAnd);
+   fs.AddFactor(GateFactor(db, db["Z"], db["D"], db["W"], [](int a, int b) { return a != b; }));
+   std::shared_ptr<Factor> fSensor = std::make_shared<Factor>(VarSet(db, { db["W"], db["S"] }), db["S"]);
+   Factor::FactorLoader flSensor(fSensor);
+   flSensor << 0.9F << 0.2F << 0.1F << 0.8F;
+   fs.AddFactor(fSensor);
+
+   // half of the rows of every gate are zero, shared Factors keep their full tables
+   FactorSet fsSparse = fs;
+   EXPECT_EQ(3, fsSparse.SelectStorage());
+   EXPECT_EQ(0, fsSparse.SelectStorage());
+   for (auto &f : fsSparse.GetFactors())
+   {
+      if (f->IsSparse())
+      {
+         EXPECT_EQ(0.5, f->GetFill());
+         EXPECT_LT(f->GetStorageBytes(), fOr->GetStorageBytes());
+      }
+   }
+   EXPECT_FALSE(fOr->IsSparse());
+
+   std::shared_ptr<Factor> fOrSparse = std::make_shared<Factor>(*fOr);
+   std::shared_ptr<Factor> fAndSparse = std::make_shared<Factor>(*fAnd);
+   EXPECT_TRUE(fOrSparse->SetSparse(true));
+   EXPECT_TRUE(fAndSparse->SetSparse(true));
+   std::shared_ptr<Factor> fPriorA = fs.GetFactors(db["A"]).front();
+   ExpectSameFactor(fOr, fOrSparse);
+   ExpectSameFactor(fOr->Merge(fPriorA), fOrSparse->Merge(fPriorA));
+   ExpectSameFactor(fPriorA->Merge(fOr), fPriorA->Merge(fOrSparse));
+   ExpectSameFactor(fOr->Merge(fAnd), fOrSparse->Merge(fAndSparse));
+   EXPECT_TRUE(fOrSparse->Merge(fAndSparse)->IsSparse());
+   ExpectSameFactor(fOr->EliminateVar(db["Y"]), fOrSparse->EliminateVar(db["Y"]));
+   ExpectSameFactor(fOr->EliminateVar(db["A"]), fOrSparse->EliminateVar(db["A"]));
+   ExpectSameFactor(fOr->MaximizeVar(db["A"]), fOrSparse->MaximizeVar(db["A"]));
+   ExpectSameFactor(fOr->MaximizeVar(db["A"])->Merge(fAnd->MaximizeVar(db["C"])),
+      fOrSparse->MaximizeVar(db["A"])->Merge(fAndSparse->MaximizeVar(db["C"])));
+   // extended clauses are kept per row of full table, so are the tables holding them
+   EXPECT_FALSE(fOrSparse->MaximizeVar(db["A"])->IsSparse());
+   EXPECT_FALSE(fOrSparse->MaximizeVar(db["A"])->Merge(fAndSparse)->IsSparse());
+   EXPECT_FALSE(fOrSparse->MaximizeVar(db["A"])->SetSparse(true));
+   Clause clA(VarSet(db, db["A"]));
+   clA.SetVar(db["A"], 1);
+   ExpectSameFactor(fOr->Slice(clA), fOrSparse->Slice(clA));
+   EXPECT_TRUE(fOrSparse->Slice(clA)->IsSparse());
+
+   std::vector<std::shared_ptr<Factor> > inputs = { fPriorA, fOr, fAnd };
+   std::vector<std::shared_ptr<Factor> > inputsSparse = { fPriorA, fOrSparse, fAndSparse };
+   VarSet vsElim(db, { db["A"], db["Y"] });
+   ExpectSameFactor(FactorContraction(inputs, vsElim).Sum(), FactorContraction(inputsSparse, vsElim).Sum());
+   ExpectSameFactor(FactorContraction(inputs, vsElim).Max(), FactorContraction(inputsSparse, vsElim).Max());
+   EXPECT_FALSE(FactorContraction(inputsSparse, vsElim).Max()->IsSparse());
+
+   // every state of A is a stored row for B and Y both on, negative utility of A
+   // makes all of their products negative
+   std::shared_ptr<Factor> fCostA = std::make_shared<Factor>(VarSet(db, db["A"]), db["A"]);
+   Factor::FactorLoader flCostA(fCostA);
+   flCostA << -0.5F << -0.25F;
+   VarSet vsA(db, db["A"]);
+   std::shared_ptr<Factor> fMaxCost = FactorContraction({ fOrSparse, fCostA }, vsA).Max();
+   ExpectSameFactor(FactorContraction({ fOr, fCostA }, vsA).Max(), fMaxCost);
+   ExpectSameFactor(fOr->Merge(fCostA)->MaximizeVar(db["A"]), fMaxCost);
+   Clause clBY(fMaxCost->GetVarSet());
+   clBY.SetVar(db["B"], 1);
+   clBY.SetVar(db["Y"], 1);
+   EXPECT_EQ(-0.25F, fMaxCost->Get(clBY.GetInstanceId()));
+
+   // posterior of A, probability of evidence and MPE with sensor on
+   Clause cSample(VarSet(db, db["S"]));
+   cSample.SetVar(db["S"], 1);
+   ValueType posterior[2][2];
+   ValueType pEvidence[2];
+   std::shared_ptr<Factor> fMpe[2];
+   FactorSet *pSets[] = { &fs, &fsSparse };
+   for (int n = 0; n < 2; n++)
+   {
+      FactorSet fsQuery = *pSets[n];
+      fsQuery.SliceEvidence(cSample);
+      fsQuery.EliminateVar(fsQuery.GetVarSet()->Substract(VarSet(db, db["A"])));
+      std::shared_ptr<Factor> f = fsQuery.Merge();
+      pEvidence[n] = f->Get(0) + f->Get(1);
+      posterior[n][0] = f->Get(0) / pEvidence[n];
+      posterior[n][1] = f->Get(1) / pEvidence[n];
+
+      FactorSet fsMpe = *pSets[n];
+      fsMpe.SliceEvidence(cSample);
+      fsMpe.MaximizeVar(*fsMpe.GetVarSet());
+      fMpe[n] = fsMpe.Merge();
+   }
+   printf("p(e) %g, posterior of A %g, mpe %g %s\n", pEvidence[1], posterior[1][1], fMpe[1]->Get(0),
+      Clause(fMpe[1]->GetExtendedVarSet(), fMpe[1]->GetExtendedClause(0)).GetJson(db).c_str());
+   EXPECT_NEAR(pEvidence[0], pEvidence[1], 0.000001);
+   EXPECT_NEAR(posterior[0][1], posterior[1][1], 0.000001);
+   EXPECT_NEAR(fMpe[0]->Get(0), fMpe[1]->Get(0), 0.000001);
+   EXPECT_EQ(Clause(fMpe[0]->GetExtendedVarSet(), fMpe[0]->GetExtendedClause(0)).GetJson(db),
+      Clause(fMpe[1]->GetExtendedVarSet(), fMpe[1]->GetExtendedClause(0)).GetJson(db));
+
+   // sparse table stores nonzero rows only, negative value goes back to full table
+   std::shared_ptr<Factor> f = std::make_shared<Factor>(*fOrSparse);
+   InstanceId row = 0;
+   while (f->HasVal(row))
+      row++;
+   f->AddInstance(row, 0.5F);
+   EXPECT_TRUE(f->HasVal(row));
+   EXPECT_EQ(0.5F, f->Get(row));
+   f->AddInstance(row, 0);
+   EXPECT_FALSE(f->HasVal(row));
+   EXPECT_EQ(0.5, f->GetFill());
+   f->AddInstance(row, -1);
+   EXPECT_FALSE(f->IsSparse());
+   EXPECT_EQ(-1, f->Get(row));
+   EXPECT_FALSE(f->SetSparse(true));
+
+   // gates loaded by session are sparse unless fill is set below their share
+   std::string sModel = R"( {
+      "VarDb": ["A", "B", "Y"],
+      "FactorSet" : [
+         { "vars": ["A"], "head" : ["A"], "vals" : [0.3, 0.7] },
+         { "vars": ["B"], "head" : ["B"], "vals" : [0.6, 0.4] },
+         { "vars": ["A", "B", "Y"], "head" : ["Y"], "vals" : [1, 0, 0, 0, 0, 1, 1, 1] }
+      ],
+      "SampleClause" : { "varset": ["Y"], "values" : [1] },)";
+   std::string s = SessionEntry::RunCommand(sModel + R"( "op" : "MPE" })");
+   std::string sDense = SessionEntry::RunCommand(sModel + R"( "SparseFill" : -1, "op" : "MPE" })");
+   printf("==MPE==\n%s\n", s.c_str());
+   EXPECT_EQ(sDense, s);
+   EXPECT_NE(std::string::npos, s.find("0.42"));
+   return 0;
+}
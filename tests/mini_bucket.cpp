@@ -0,0 +1,117 @@
+/*
+* Copyright (C) 2017 Boris Altshul.
+* All rights reserved.
+*
+* The software in this package is published under the terms of the BSD
+* style license a copy of which has been included with this distribution in
+* the LICENSE.txt file.
+*/
+
+#include <factor.h>
+#include <Factories.h>
+#include <json/json.h>
+#include <gtest/gtest.h>
+
+
+using namespace bayeslib;
+
+int CreateRainTest(VarDb &db, FactorSet &fs);
+int InitLargeTest(VarDb &db, FactorSet &fs);
+
+/// \file
+/// \ingroup miniBucket
+/// \{
+
+/** Rain example with evidence: i-bound wide enough for every bucket makes both
+    passes exact, marginals and probability of evidence match junction tree
+*/
+int MiniBucketTest1()
+{
+   VarDb db;
+   FactorSet fs(db);
+   CreateRainTest(db, fs);
+   Clause cSample(VarSet(db, { db["A"], db["E"] }));
+   cSample.SetVar(db["A"], true);
+   cSample.SetVar(db["E"], true);
+
+   JunctionTree jt(fs);
+   jt.Calibrate(cSample);
+
+   FactorSet fsEvidence(fs);
+   fsEvidence.ApplyClause(cSample);
+   MiniBucketElimination mbe(fsEvidence, 10);
+   mbe.Run();
+   EXPECT_NEAR(mbe.GetLogUpperBound(), mbe.GetLogLowerBound(), 0.0001);
+   EXPECT_NEAR(jt.GetEvidenceProbability(), mbe.GetEvidenceProbability(), 0.00001);
+   EXPECT_TRUE(mbe.GetMarginal()->IsEmpty());
+
+   for (VarId id : { db["B"], db["C"], db["D"] })
+   {
+      mbe.Run(id);
+      std::shared_ptr<Factor> fJt = jt.GetMarginal(id);
+      std::shared_ptr<Factor> f = mbe.GetMarginal();
+      std::shared_ptr<Factor> fLower = mbe.GetMarginalLower();
+      std::shared_ptr<Factor> fUpper = mbe.GetMarginalUpper();
+      for (InstanceId n = 0; n < 2; n++)
+      {
+         EXPECT_NEAR(fJt->Get(n), f->Get(n), 0.0001);
+         EXPECT_NEAR(fJt->Get(n), fLower->Get(n), 0.0001);
+         EXPECT_NEAR(fJt->Get(n), fUpper->Get(n), 0.0001);
+      }
+   }
+   return 0;
+}
+
+/** Carrier network with drop evidence and i-bound 1: messages stay within the
+    cap, bounds bracket exact probability of evidence and posterior of cjE, and
+    tighten as i-bound grows
+*/
+int MiniBucketTest2()
+{
+   VarDb db;
+   FactorSet fs(db);
+   InitLargeTest(db, fs);
+   Clause cSample(VarSet(db, { db["drhi3_1"], db["drlo3_1"], db["drhi3_2"], db["drloa3_1"] }));
+   cSample.SetVar(db["drhi3_1"], true);
+   cSample.SetVar(db["drlo3_1"], true);
+   cSample.SetVar(db["drhi3_2"], false);
+   cSample.SetVar(db["drloa3_1"], true);
+
+   JunctionTree jt(fs);
+   jt.Calibrate(cSample);
+   double logExact = jt.GetLogEvidenceProbability();
+   std::shared_ptr<Factor> fExact = jt.GetMarginal(db["cjE"]);
+
+   FactorSet fsEvidence(fs);
+   fsEvidence.PruneEdges(cSample);
+   fsEvidence.ApplyClause(cSample);
+   InstanceId largest = 0;
+   for (auto &f : fsEvidence.GetFactors())
+      largest = std::max(largest, f->GetVarSet().GetInstances());
+
+   double gap = std::numeric_limits<double>::infinity();
+   for (int nIBound = 1; nIBound <= 4; nIBound++)
+   {
+      MiniBucketElimination mbe(fsEvidence, nIBound, largest);
+      mbe.Run(db["cjE"]);
+      printf("%s\n", mbe.GetJson(db).c_str());
+      EXPECT_LE(mbe.GetMaxMessageSize(), std::max(nIBound, 3));
+      EXPECT_LE(mbe.GetMaxMessageCells(), largest);
+      EXPECT_LE(mbe.GetLogLowerBound(), logExact + 0.0001);
+      EXPECT_GE(mbe.GetLogUpperBound(), logExact - 0.0001);
+      EXPECT_LE(mbe.GetLogUpperBound() - mbe.GetLogLowerBound(), gap + 0.0001);
+      gap = mbe.GetLogUpperBound() - mbe.GetLogLowerBound();
+
+      std::shared_ptr<Factor> fLower = mbe.GetMarginalLower();
+      std::shared_ptr<Factor> fUpper = mbe.GetMarginalUpper();
+      for (InstanceId n = 0; n < fExact->GetVarSet().GetInstances(); n++)
+      {
+         EXPECT_LE(fLower->Get(n), fExact->Get(n) + 0.0001);
+         EXPECT_GE(fUpper->Get(n), fExact->Get(n) - 0.0001);
+      }
+   }
+   EXPECT_NEAR(0, gap, 0.0001);
+   return 0;
+}
+
+/// \}
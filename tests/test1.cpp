@@ -52,6 +52,34 @@
    @brief Test regular and optimized operations on Large model
 */
 
+/** @defgroup factorKernels Factor Kernels
+   @brief Validate vectorized reduction kernels against scalar implementation
+*/
+
+/** @defgroup factorContraction Factor Contraction
+   @brief Validate fused multiply and reduce against Merge followed by reduction
+*/
+
+/** @defgroup junctionTree Junction Tree
+   @brief Validate calibrated clique tree marginals against variable elimination
+*/
+
+/** @defgroup compiledQuery Compiled Query
+   @brief Validate replayed inference plans against FactorSet elimination
+*/
+
+/** @defgroup interactionGraph Interaction Graph
+   @brief Validate elimination order heuristics and their width report
+*/
+
+/** @defgroup branchAndBound Branch and Bound MPE
+   @brief Validate anytime MPE search and its mini-bucket bound against exact maximization
+*/
+
+/** @defgroup miniBucket Mini-Bucket Elimination
+   @brief Validate approximate marginals and their bounds against junction tree
+*/
+
 /** @} */
 
 
@@ -61,6 +89,7 @@ using namespace bayeslib;
 int Test1_1();
 int Test_DeepCopy();
 int Test1_3();
+int Test1_4();
 int Test_JsonFactor();
 int TestRain();
 int TestRain2();
@@ -70,6 +99,16 @@ int TestJson();
 int LargeTest1();
 int LargeTest2();
 int LargeTest3();
+int LargeTest4();
+int LargeTest5();
+int LargeTest6();
+int LargeTest7();
+int LargeTest8();
+int LargeTest9();
+int LargeTest10();
+int LargeTest11();
+int LargeTest12();
+int LargeTest13();
 int DecisionTest1();
 int DecisionTest2();
 int DecisionTest3();
@@ -79,6 +118,28 @@ int IspTest1();
 int IspTest2();
 int IspDecisionExample();
 
+int KernelTest1();
+int KernelTest2();
+int KernelTest3();
+int ContractionTest1();
+int ContractionTest2();
+int ContractionTest3();
+int ContractionTest4();
+int MergeTest1();
+int JunctionTreeTest1();
+int JunctionTreeTest2();
+int CompiledQueryTest1();
+int CompiledQueryTest2();
+int CompiledQueryTest3();
+int CompiledQueryTest4();
+int InteractionGraphTest1();
+int InteractionGraphTest2();
+int ElimPlanTest1();
+int BranchAndBoundTest1();
+int BranchAndBoundTest2();
+int MiniBucketTest1();
+int MiniBucketTest2();
+
 
 TEST(BASIC, TEST1_1)
 {
@@ -96,6 +157,11 @@ TEST(BASIC, Test1_3)
    EXPECT_EQ(0, Test1_3());
 }
 
+TEST(BASIC, Test1_4)
+{
+   EXPECT_EQ(0, Test1_4());
+}
+
 TEST(BASIC, Test_JsonFactor)
 {
    EXPECT_EQ(0, Test_JsonFactor());
@@ -169,6 +235,162 @@ TEST(BASIC, LargeTest3)
     EXPECT_EQ(0, LargeTest3());
 }
 
+TEST(BASIC, LargeTest4)
+{
+    EXPECT_EQ(0, LargeTest4());
+}
+
+TEST(BASIC, LargeTest5)
+{
+    EXPECT_EQ(0, LargeTest5());
+}
+
+TEST(BASIC, LargeTest6)
+{
+    EXPECT_EQ(0, LargeTest6());
+}
+
+TEST(BASIC, LargeTest7)
+{
+    EXPECT_EQ(0, LargeTest7());
+}
+
+TEST(BASIC, LargeTest8)
+{
+    EXPECT_EQ(0, LargeTest8());
+}
+
+TEST(BASIC, LargeTest9)
+{
+    EXPECT_EQ(0, LargeTest9());
+}
+
+TEST(BASIC, LargeTest10)
+{
+    EXPECT_EQ(0, LargeTest10());
+}
+
+TEST(BASIC, LargeTest11)
+{
+    EXPECT_EQ(0, LargeTest11());
+}
+
+TEST(BASIC, LargeTest12)
+{
+    EXPECT_EQ(0, LargeTest12());
+}
+
+TEST(BASIC, LargeTest13)
+{
+    EXPECT_EQ(0, LargeTest13());
+}
+
+
+TEST(KERNELS, KernelTest1)
+{
+   EXPECT_EQ(0, KernelTest1());
+}
+
+TEST(KERNELS, KernelTest2)
+{
+   EXPECT_EQ(0, KernelTest2());
+}
+
+TEST(KERNELS, KernelTest3)
+{
+   EXPECT_EQ(0, KernelTest3());
+}
+
+TEST(KERNELS, ContractionTest1)
+{
+   EXPECT_EQ(0, ContractionTest1());
+}
+
+TEST(KERNELS, ContractionTest2)
+{
+   EXPECT_EQ(0, ContractionTest2());
+}
+
+TEST(KERNELS, ContractionTest3)
+{
+   EXPECT_EQ(0, ContractionTest3());
+}
+
+TEST(KERNELS, ContractionTest4)
+{
+   EXPECT_EQ(0, ContractionTest4());
+}
+
+TEST(KERNELS, MergeTest1)
+{
+   EXPECT_EQ(0, MergeTest1());
+}
+
+TEST(JTREE, JunctionTreeTest1)
+{
+   EXPECT_EQ(0, JunctionTreeTest1());
+}
+
+TEST(JTREE, JunctionTreeTest2)
+{
+   EXPECT_EQ(0, JunctionTreeTest2());
+}
+
+TEST(PLAN, CompiledQueryTest1)
+{
+   EXPECT_EQ(0, CompiledQueryTest1());
+}
+
+TEST(PLAN, CompiledQueryTest2)
+{
+   EXPECT_EQ(0, CompiledQueryTest2());
+}
+
+TEST(PLAN, CompiledQueryTest3)
+{
+   EXPECT_EQ(0, CompiledQueryTest3());
+}
+
+TEST(PLAN, CompiledQueryTest4)
+{
+   EXPECT_EQ(0, CompiledQueryTest4());
+}
+
+TEST(PLAN, InteractionGraphTest1)
+{
+   EXPECT_EQ(0, InteractionGraphTest1());
+}
+
+TEST(PLAN, InteractionGraphTest2)
+{
+   EXPECT_EQ(0, InteractionGraphTest2());
+}
+
+TEST(PLAN, ElimPlanTest1)
+{
+   EXPECT_EQ(0, ElimPlanTest1());
+}
+
+TEST(SEARCH, BranchAndBoundTest1)
+{
+   EXPECT_EQ(0, BranchAndBoundTest1());
+}
+
+TEST(SEARCH, BranchAndBoundTest2)
+{
+   EXPECT_EQ(0, BranchAndBoundTest2());
+}
+
+TEST(SEARCH, MiniBucketTest1)
+{
+   EXPECT_EQ(0, MiniBucketTest1());
+}
+
+TEST(SEARCH, MiniBucketTest2)
+{
+   EXPECT_EQ(0, MiniBucketTest2());
+}
+
 
 TEST(EXAMPLE, IspTest1)
 {